@@ -0,0 +1,1336 @@
+#include "FbxBinary.h"
+#include "FbxLoader.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <zlib.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	template<class T>
+	T ReadValue(const uint8_t* data)
+	{
+		T value;
+		memcpy(&value, data, sizeof(T));
+		return value;
+	}
+
+	size_t ArrayElementSize(char type)
+	{
+		switch (type)
+		{
+		case 'f': return 4;
+		case 'd': return 8;
+		case 'l': return 8;
+		case 'i': return 4;
+		case 'b': return 1;
+		default: return 0;
+		}
+	}
+
+	// Deflate output is at most about 1032 times its input, arrays claiming more than that are corrupt
+	const size_t maxInflateRatio = 1032;
+
+	// Real files nest records a handful of levels deep, deeper nesting is a corrupt file and would exhaust the stack
+	const int maxNodeDepth = 64;
+
+	template<class T> bool IsNativeArrayType(char type) { return false; }
+	template<> bool IsNativeArrayType<int>(char type) { return type == 'i'; }
+	template<> bool IsNativeArrayType<int64_t>(char type) { return type == 'l'; }
+	template<> bool IsNativeArrayType<float>(char type) { return type == 'f'; }
+	template<> bool IsNativeArrayType<double>(char type) { return type == 'd'; }
+
+	template<class T, class S>
+	void ConvertElements(const uint8_t* source, size_t count, T* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = (T)ReadValue<S>(source + i * sizeof(S));
+	}
+
+	// Rotation matrix for euler angles in degrees, applied in the given FBX rotation order
+	FbxAMatrix EulerToMatrix(const FbxVector4& euler, int order)
+	{
+		FbxAMatrix x, y, z;
+		x.SetR(FbxVector4(euler[0], 0, 0));
+		y.SetR(FbxVector4(0, euler[1], 0));
+		z.SetR(FbxVector4(0, 0, euler[2]));
+
+		switch (order)
+		{
+		case eEulerXZY: return y * z * x;
+		case eEulerYZX: return x * z * y;
+		case eEulerYXZ: return z * x * y;
+		case eEulerZXY: return y * x * z;
+		case eEulerZYX: return x * y * z;
+		default: return z * y * x;
+		}
+	}
+
+	FbxAMatrix TranslationMatrix(const FbxVector4& translation)
+	{
+		FbxAMatrix matrix;
+		matrix.SetT(translation);
+		return matrix;
+	}
+
+	double FrameRateFromTimeMode(int timeMode, double customFrameRate)
+	{
+		switch (timeMode)
+		{
+		case 1: return 120.0;
+		case 2: return 100.0;
+		case 3: return 60.0;
+		case 4: return 50.0;
+		case 5: return 48.0;
+		case 6: return 30.0;
+		case 7: return 30.0;
+		case 8: return 29.9700262;
+		case 9: return 29.9700262;
+		case 10: return 25.0;
+		case 11: return 24.0;
+		case 12: return 1000.0;
+		case 13: return 23.976;
+		case 14: return customFrameRate > 0.0 ? customFrameRate : 30.0;
+		case 15: return 96.0;
+		case 16: return 72.0;
+		case 17: return 59.94;
+		case 18: return 119.88;
+		default: return 30.0;
+		}
+	}
+
+	// Lookup over the "P" records of a Properties70 block
+	struct PropertyTable
+	{
+		const FbxLoader::Binary::Document& document;
+		int node;
+
+		int Find(const char* name) const
+		{
+			if (node == -1)
+				return -1;
+			for (int p = document.FirstChild(node); p != -1; p = document.NextSibling(p))
+			{
+				if (document.PropertyCount(p) > 4 && document.GetProperty(p, 0).AsString() == name)
+					return p;
+			}
+			return -1;
+		}
+		int64_t Int(const char* name, int64_t fallback) const
+		{
+			int p = Find(name);
+			return p == -1 ? fallback : document.GetProperty(p, 4).AsInt();
+		}
+		double Double(const char* name, double fallback) const
+		{
+			int p = Find(name);
+			return p == -1 ? fallback : document.GetProperty(p, 4).AsDouble();
+		}
+		FbxVector4 Vector(const char* name, const FbxVector4& fallback) const
+		{
+			int p = Find(name);
+			if (p == -1 || document.PropertyCount(p) < 7)
+				return fallback;
+			return FbxVector4(document.GetProperty(p, 4).AsDouble(), document.GetProperty(p, 5).AsDouble(), document.GetProperty(p, 6).AsDouble(), fallback[3]);
+		}
+	};
+
+	// A LayerElement* block resolved to direct values, indexed per polygon-vertex, control point or polygon
+	struct LayerElement
+	{
+		enum Mapping { None, ByPolygonVertex, ByControlPoint, ByPolygon, AllSame };
+
+		Mapping mapping = None;
+		bool indexed = false;
+		int stride = 0;
+		std::vector<double> values;
+		std::vector<int> indices;
+
+		bool Read(const FbxLoader::Binary::Document& document, int geometry, const char* elementName, const char* valuesName, const char* indicesName, int elementStride)
+		{
+			int element = document.FindChild(geometry, elementName);
+			if (element == -1)
+				return false;
+
+			int mappingNode = document.FindChild(element, "MappingInformationType");
+			int referenceNode = document.FindChild(element, "ReferenceInformationType");
+			if (mappingNode == -1 || document.PropertyCount(mappingNode) < 1)
+				return false;
+
+			std::string mappingName = document.GetProperty(mappingNode, 0).AsString();
+			if (mappingName == "ByPolygonVertex") mapping = ByPolygonVertex;
+			else if (mappingName == "ByVertice" || mappingName == "ByVertex" || mappingName == "ByControlPoint") mapping = ByControlPoint;
+			else if (mappingName == "ByPolygon") mapping = ByPolygon;
+			else if (mappingName == "AllSame") mapping = AllSame;
+			else return false;
+
+			std::string referenceName = referenceNode != -1 && document.PropertyCount(referenceNode) > 0 ? document.GetProperty(referenceNode, 0).AsString() : "Direct";
+			indexed = referenceName == "IndexToDirect" || referenceName == "Index";
+
+			stride = elementStride;
+			if (!document.ReadChildArray(element, valuesName, values))
+				return false;
+			if (indexed && (!indicesName || !document.ReadChildArray(element, indicesName, indices)))
+				return false;
+			return true;
+		}
+
+		// Index of the first component of the value used by a polygon-vertex, -1 if out of range
+		int Resolve(int polygonVertex, int controlPoint, int polygon) const
+		{
+			int index = 0;
+			switch (mapping)
+			{
+			case ByPolygonVertex: index = polygonVertex; break;
+			case ByControlPoint: index = controlPoint; break;
+			case ByPolygon: index = polygon; break;
+			case AllSame: index = 0; break;
+			default: return -1;
+			}
+			if (indexed)
+			{
+				if (index < 0 || index >= (int)indices.size())
+					return -1;
+				index = indices[index];
+			}
+			if (index < 0 || (size_t)(index + 1) * stride > values.size())
+				return -1;
+			return index * stride;
+		}
+	};
+
+	enum ObjectKind { KindModel, KindGeometry, KindMaterial, KindSkin, KindCluster, KindStack, KindLayer, KindCurveNode, KindCurve };
+	struct ObjectRef
+	{
+		ObjectKind kind;
+		int index;
+	};
+}
+
+FbxLoader::Binary::MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool FbxLoader::Binary::MappedFile::Open(const char* path)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	file = fileHandle;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+
+	mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		Close();
+		return false;
+	}
+	data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	file = open(path, O_RDONLY);
+	if (file == -1)
+		return false;
+
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0)
+	{
+		Close();
+		return false;
+	}
+	size = (size_t)fileStat.st_size;
+
+	void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (view == MAP_FAILED)
+	{
+		Close();
+		return false;
+	}
+	madvise(view, size, MADV_SEQUENTIAL);
+	data = (const uint8_t*)view;
+#endif
+
+	if (!data)
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void FbxLoader::Binary::MappedFile::Close()
+{
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+	mapping = nullptr;
+	file = nullptr;
+#else
+	if (data) munmap((void*)data, size);
+	if (file != -1) close(file);
+	file = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+int64_t FbxLoader::Binary::Property::AsInt() const
+{
+	switch (type)
+	{
+	case 'C': return data[0];
+	case 'Y': return ReadValue<int16_t>(data);
+	case 'I': return ReadValue<int32_t>(data);
+	case 'L': return ReadValue<int64_t>(data);
+	case 'F': return (int64_t)ReadValue<float>(data);
+	case 'D': return (int64_t)ReadValue<double>(data);
+	default: return 0;
+	}
+}
+
+double FbxLoader::Binary::Property::AsDouble() const
+{
+	switch (type)
+	{
+	case 'F': return ReadValue<float>(data);
+	case 'D': return ReadValue<double>(data);
+	default: return (double)AsInt();
+	}
+}
+
+std::string FbxLoader::Binary::Property::AsString() const
+{
+	if (type != 'S' && type != 'R')
+		return std::string();
+
+	const char* text = (const char*)data;
+	size_t textLength = 0;
+	while (textLength < length && text[textLength] != '\0')
+		textLength++;
+	return std::string(text, textLength);
+}
+
+bool FbxLoader::Binary::Document::Open(const char* path)
+{
+	static const char magic[] = "Kaydara FBX Binary  ";
+	const size_t headerSize = 27;
+
+	nodes.clear();
+	properties.clear();
+	if (!file.Open(path))
+		return false;
+
+	if (file.Size() < headerSize || memcmp(file.Data(), magic, sizeof(magic) - 1) != 0)
+		return false;
+	version = ReadValue<uint32_t>(file.Data() + 23);
+
+	nodes.push_back(Node{}); // Root, owns the top level records
+
+	size_t offset = headerSize;
+	int previousSibling = -1;
+	while (offset < file.Size())
+	{
+		bool isNullRecord = false;
+		if (!ParseNode(offset, file.Size(), 0, Root(), previousSibling, isNullRecord))
+			return false;
+		if (isNullRecord)
+			break;
+	}
+	return true;
+}
+
+bool FbxLoader::Binary::Document::ParseNode(size_t& offset, size_t end, int depth, int parent, int& previousSibling, bool& isNullRecord)
+{
+	const uint8_t* data = file.Data();
+	const bool wide = version >= 7500;
+	const size_t headerSize = wide ? 25 : 13;
+	if (depth > maxNodeDepth || offset + headerSize > end)
+		return false;
+
+	uint64_t endOffset, propertyCount, propertyListLength;
+	if (wide)
+	{
+		endOffset = ReadValue<uint64_t>(data + offset);
+		propertyCount = ReadValue<uint64_t>(data + offset + 8);
+		propertyListLength = ReadValue<uint64_t>(data + offset + 16);
+	}
+	else
+	{
+		endOffset = ReadValue<uint32_t>(data + offset);
+		propertyCount = ReadValue<uint32_t>(data + offset + 4);
+		propertyListLength = ReadValue<uint32_t>(data + offset + 8);
+	}
+	uint8_t nameLength = data[offset + headerSize - 1];
+	offset += headerSize;
+
+	if (endOffset == 0)
+	{
+		isNullRecord = true;
+		return true;
+	}
+	if (endOffset > end || offset + nameLength + propertyListLength > endOffset)
+		return false;
+
+	int index = (int)nodes.size();
+	nodes.push_back(Node{});
+	nodes[index].name = (const char*)data + offset;
+	nodes[index].nameLength = nameLength;
+	offset += nameLength;
+
+	size_t propertyEnd = offset + (size_t)propertyListLength;
+	nodes[index].firstProperty = (uint32_t)properties.size();
+	nodes[index].propertyCount = (uint32_t)propertyCount;
+	for (uint64_t i = 0; i < propertyCount; i++)
+	{
+		if (!ParseProperty(offset, propertyEnd))
+			return false;
+	}
+	offset = propertyEnd;
+
+	if (previousSibling == -1)
+		nodes[parent].firstChild = index;
+	else
+		nodes[previousSibling].nextSibling = index;
+	previousSibling = index;
+
+	int previousChild = -1;
+	while (offset < endOffset)
+	{
+		bool isChildNullRecord = false;
+		if (!ParseNode(offset, (size_t)endOffset, depth + 1, index, previousChild, isChildNullRecord))
+			return false;
+		if (isChildNullRecord)
+			break;
+	}
+	offset = (size_t)endOffset;
+
+	return true;
+}
+
+bool FbxLoader::Binary::Document::ParseProperty(size_t& offset, size_t end)
+{
+	const uint8_t* data = file.Data();
+	if (offset >= end)
+		return false;
+
+	Property property = {};
+	property.type = (char)data[offset++];
+	property.data = data + offset;
+
+	size_t propertySize = 0;
+	switch (property.type)
+	{
+	case 'C': propertySize = 1; break;
+	case 'Y': propertySize = 2; break;
+	case 'I': case 'F': propertySize = 4; break;
+	case 'L': case 'D': propertySize = 8; break;
+	case 'S': case 'R':
+		if (offset + 4 > end)
+			return false;
+		property.length = ReadValue<uint32_t>(data + offset);
+		property.data = data + offset + 4;
+		propertySize = 4 + (size_t)property.length;
+		break;
+	case 'f': case 'd': case 'l': case 'i': case 'b':
+		if (offset + 12 > end)
+			return false;
+		property.length = ReadValue<uint32_t>(data + offset);
+		property.encoding = ReadValue<uint32_t>(data + offset + 4);
+		property.compressedLength = ReadValue<uint32_t>(data + offset + 8);
+		property.data = data + offset + 12;
+		propertySize = 12 + (property.encoding ? (size_t)property.compressedLength : (size_t)property.length * ArrayElementSize(property.type));
+		break;
+	default:
+		return false;
+	}
+
+	if (offset + propertySize > end)
+		return false;
+	offset += propertySize;
+	properties.push_back(property);
+	return true;
+}
+
+int FbxLoader::Binary::Document::FindChild(int node, const char* name) const
+{
+	for (int child = FirstChild(node); child != -1; child = NextSibling(child))
+	{
+		if (NameIs(child, name))
+			return child;
+	}
+	return -1;
+}
+
+bool FbxLoader::Binary::Document::NameIs(int node, const char* name) const
+{
+	size_t nameLength = strlen(name);
+	return nodes[node].nameLength == nameLength && memcmp(nodes[node].name, name, nameLength) == 0;
+}
+
+template<class T>
+bool FbxLoader::Binary::Document::ReadArray(const Property& property, std::vector<T>& out) const
+{
+	size_t elementSize = ArrayElementSize(property.type);
+	if (elementSize == 0)
+		return false;
+
+	size_t count = property.length;
+	size_t byteCount = count * elementSize;
+	bool nativeType = sizeof(T) == elementSize && IsNativeArrayType<T>(property.type);
+
+	// The element count comes straight from the file, check it against the bytes behind it before allocating
+	const size_t available = property.encoding == 1 ? (size_t)property.compressedLength * maxInflateRatio :
+		(size_t)(file.Data() + file.Size() - property.data);
+	if (property.data < file.Data() || byteCount > available)
+		return false;
+	out.resize(count);
+
+	const uint8_t* source = property.data;
+	std::vector<uint8_t> inflated;
+	if (property.encoding == 1)
+	{
+		// Inflate straight into the output when no conversion is needed
+		if (!nativeType)
+			inflated.resize(byteCount);
+		uint8_t* target = nativeType ? (uint8_t*)out.data() : inflated.data();
+
+		uLongf targetLength = (uLongf)byteCount;
+		if (uncompress(target, &targetLength, source, property.compressedLength) != Z_OK || targetLength != byteCount)
+			return false;
+		if (nativeType)
+			return true;
+		source = inflated.data();
+	}
+	else if (property.encoding != 0)
+	{
+		return false;
+	}
+	else if (nativeType)
+	{
+		memcpy(out.data(), source, byteCount);
+		return true;
+	}
+
+	switch (property.type)
+	{
+	case 'f': ConvertElements<T, float>(source, count, out.data()); break;
+	case 'd': ConvertElements<T, double>(source, count, out.data()); break;
+	case 'l': ConvertElements<T, int64_t>(source, count, out.data()); break;
+	case 'i': ConvertElements<T, int32_t>(source, count, out.data()); break;
+	case 'b': ConvertElements<T, uint8_t>(source, count, out.data()); break;
+	}
+	return true;
+}
+
+template<class T>
+bool FbxLoader::Binary::Document::ReadChildArray(int node, const char* childName, std::vector<T>& out) const
+{
+	int child = FindChild(node, childName);
+	if (child == -1 || PropertyCount(child) < 1 || !GetProperty(child, 0).IsArray())
+		return false;
+	return ReadArray(GetProperty(child, 0), out);
+}
+
+template bool FbxLoader::Binary::Document::ReadArray<int>(const Property&, std::vector<int>&) const;
+template bool FbxLoader::Binary::Document::ReadArray<int64_t>(const Property&, std::vector<int64_t>&) const;
+template bool FbxLoader::Binary::Document::ReadArray<float>(const Property&, std::vector<float>&) const;
+template bool FbxLoader::Binary::Document::ReadArray<double>(const Property&, std::vector<double>&) const;
+template bool FbxLoader::Binary::Document::ReadChildArray<int>(int, const char*, std::vector<int>&) const;
+template bool FbxLoader::Binary::Document::ReadChildArray<int64_t>(int, const char*, std::vector<int64_t>&) const;
+template bool FbxLoader::Binary::Document::ReadChildArray<float>(int, const char*, std::vector<float>&) const;
+template bool FbxLoader::Binary::Document::ReadChildArray<double>(int, const char*, std::vector<double>&) const;
+
+float FbxLoader::Binary::Curve::Evaluate(int64_t time) const
+{
+	if (times.empty() || values.size() < times.size())
+		return 0.0f;
+	if (time <= times.front())
+		return values.front();
+	if (time >= times.back())
+		return values.back();
+
+	size_t next = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+	size_t key = next - 1;
+
+	int attribute = key < keyAttributes.size() ? keyAttributes[key] : -1;
+	int flag = attribute >= 0 && attribute < (int)flags.size() ? flags[attribute] : 0x4;
+
+	const float v0 = values[key];
+	const float v1 = values[next];
+	const double t = (double)(time - times[key]) / (double)(times[next] - times[key]);
+
+	if (flag & 0x2) // Constant
+		return (flag & 0x100) ? v1 : v0;
+
+	if ((flag & 0x8) && (size_t)attribute * 4 + 1 < attributeData.size()) // Cubic, slopes are per second
+	{
+		const double span = (double)(times[next] - times[key]) / (double)Scene::TicksPerSecond;
+		const double rightSlope = attributeData[attribute * 4 + 0];
+		const double nextLeftSlope = attributeData[attribute * 4 + 1];
+		const double t2 = t * t;
+		const double t3 = t2 * t;
+		return (float)((2 * t3 - 3 * t2 + 1) * v0 + (t3 - 2 * t2 + t) * span * rightSlope + (-2 * t3 + 3 * t2) * v1 + (t3 - t2) * span * nextLeftSlope);
+	}
+
+	return (float)(v0 + (v1 - v0) * t);
+}
+
+bool FbxLoader::Binary::Scene::Load(const Document& _document)
+{
+	document = &_document;
+	const Document& doc = _document;
+
+	ReadGlobalSettings(doc.FindChild(doc.Root(), "GlobalSettings"));
+
+	int objects = doc.FindChild(doc.Root(), "Objects");
+	int connections = doc.FindChild(doc.Root(), "Connections");
+	if (objects == -1 || connections == -1)
+		return false;
+
+	std::unordered_map<int64_t, ObjectRef> objectMap;
+	std::vector<int> clusterNodes;
+	std::vector<int> clusterLinks;
+	std::vector<int> layerStacks;
+	struct CurveNode { int node; int layer = -1; int model = -1; int transform = -1; int curves[3] = { -1, -1, -1 }; };
+	std::vector<CurveNode> curveNodes;
+
+	for (int object = doc.FirstChild(objects); object != -1; object = doc.NextSibling(object))
+	{
+		if (doc.PropertyCount(object) < 3)
+			continue;
+
+		int64_t id = doc.GetProperty(object, 0).AsInt();
+		std::string subclass = doc.GetProperty(object, 2).AsString();
+
+		if (doc.NameIs(object, "Model"))
+		{
+			objectMap[id] = { KindModel, (int)models.size() };
+			models.push_back(Model{});
+			models.back().id = id;
+			models.back().name = doc.GetProperty(object, 1).AsString();
+			models.back().type = subclass;
+			ReadModel(object, models.back());
+		}
+		else if (doc.NameIs(object, "Geometry") && subclass == "Mesh")
+		{
+			objectMap[id] = { KindGeometry, (int)geometries.size() };
+			geometries.push_back(Geometry{});
+			geometries.back().id = id;
+			geometries.back().node = object;
+		}
+		else if (doc.NameIs(object, "Material"))
+		{
+			objectMap[id] = { KindMaterial, (int)materialNames.size() };
+			materialNames.push_back(doc.GetProperty(object, 1).AsString());
+		}
+		else if (doc.NameIs(object, "Deformer") && subclass == "Skin")
+		{
+			objectMap[id] = { KindSkin, (int)skins.size() };
+			skins.push_back(Skin{});
+		}
+		else if (doc.NameIs(object, "Deformer") && subclass == "Cluster")
+		{
+			objectMap[id] = { KindCluster, (int)clusterNodes.size() };
+			clusterNodes.push_back(object);
+			clusterLinks.push_back(-1);
+		}
+		else if (doc.NameIs(object, "AnimationStack"))
+		{
+			PropertyTable table = { doc, doc.FindChild(object, "Properties70") };
+			objectMap[id] = { KindStack, (int)stacks.size() };
+			stacks.push_back(AnimationStack{});
+			stacks.back().name = doc.GetProperty(object, 1).AsString();
+			stacks.back().start = table.Int("LocalStart", 0);
+			stacks.back().stop = table.Int("LocalStop", 0);
+		}
+		else if (doc.NameIs(object, "AnimationLayer"))
+		{
+			objectMap[id] = { KindLayer, (int)layerStacks.size() };
+			layerStacks.push_back(-1);
+		}
+		else if (doc.NameIs(object, "AnimationCurveNode"))
+		{
+			objectMap[id] = { KindCurveNode, (int)curveNodes.size() };
+			curveNodes.push_back(CurveNode{ object });
+		}
+		else if (doc.NameIs(object, "AnimationCurve"))
+		{
+			Curve curve;
+			std::vector<int> attributeRuns;
+			doc.ReadChildArray(object, "KeyTime", curve.times);
+			doc.ReadChildArray(object, "KeyValueFloat", curve.values);
+			doc.ReadChildArray(object, "KeyAttrFlags", curve.flags);
+			doc.ReadChildArray(object, "KeyAttrDataFloat", curve.attributeData);
+			doc.ReadChildArray(object, "KeyAttrRefCount", attributeRuns);
+
+			curve.keyAttributes.reserve(curve.times.size());
+			for (int attribute = 0; attribute < (int)attributeRuns.size(); attribute++)
+			{
+				for (int run = 0; run < attributeRuns[attribute]; run++)
+					curve.keyAttributes.push_back(attribute);
+			}
+
+			objectMap[id] = { KindCurve, (int)curves.size() };
+			curves.push_back(std::move(curve));
+		}
+	}
+
+	// Layers connect to their stack in member order, like FbxAnimStack::GetMember the first one connected is layer 0
+	std::vector<int> firstLayers(stacks.size(), -1);
+	for (int connection = doc.FirstChild(connections); connection != -1; connection = doc.NextSibling(connection))
+	{
+		if (!doc.NameIs(connection, "C") || doc.PropertyCount(connection) < 3)
+			continue;
+
+		std::string propertyName = doc.PropertyCount(connection) > 3 ? doc.GetProperty(connection, 3).AsString() : std::string();
+		auto source = objectMap.find(doc.GetProperty(connection, 1).AsInt());
+		int64_t destinationId = doc.GetProperty(connection, 2).AsInt();
+		if (source == objectMap.end())
+			continue;
+
+		if (destinationId == 0)
+		{
+			if (source->second.kind == KindModel)
+				rootModels.push_back(source->second.index);
+			continue;
+		}
+
+		auto destination = objectMap.find(destinationId);
+		if (destination == objectMap.end())
+			continue;
+
+		const ObjectRef src = source->second;
+		const ObjectRef dst = destination->second;
+		if (src.kind == KindModel && dst.kind == KindModel)
+		{
+			// A model has a single parent, further parent connections would list it under several models
+			if (models[src.index].parent == -1 && src.index != dst.index)
+			{
+				models[src.index].parent = dst.index;
+				models[dst.index].children.push_back(src.index);
+			}
+		}
+		else if (src.kind == KindGeometry && dst.kind == KindModel)
+			models[dst.index].geometry = src.index;
+		else if (src.kind == KindMaterial && dst.kind == KindModel)
+			models[dst.index].materials.push_back(src.index);
+		else if (src.kind == KindSkin && dst.kind == KindGeometry)
+			geometries[dst.index].skins.push_back(src.index);
+		else if (src.kind == KindCluster && dst.kind == KindSkin)
+		{
+			skins[dst.index].clusters.push_back(clusterNodes[src.index]);
+			skins[dst.index].links.push_back(src.index); // Resolved to the linked model below
+		}
+		else if (src.kind == KindModel && dst.kind == KindCluster)
+			clusterLinks[dst.index] = src.index;
+		else if (src.kind == KindLayer && dst.kind == KindStack)
+		{
+			layerStacks[src.index] = dst.index;
+			if (firstLayers[dst.index] == -1)
+				firstLayers[dst.index] = src.index;
+		}
+		else if (src.kind == KindCurveNode && dst.kind == KindLayer)
+			curveNodes[src.index].layer = dst.index;
+		else if (src.kind == KindCurveNode && dst.kind == KindModel)
+		{
+			curveNodes[src.index].model = dst.index;
+			if (propertyName == "Lcl Translation") curveNodes[src.index].transform = 0;
+			else if (propertyName == "Lcl Rotation") curveNodes[src.index].transform = 1;
+			else if (propertyName == "Lcl Scaling") curveNodes[src.index].transform = 2;
+		}
+		else if (src.kind == KindCurve && dst.kind == KindCurveNode)
+		{
+			if (propertyName == "d|X") curveNodes[dst.index].curves[0] = src.index;
+			else if (propertyName == "d|Y") curveNodes[dst.index].curves[1] = src.index;
+			else if (propertyName == "d|Z") curveNodes[dst.index].curves[2] = src.index;
+		}
+	}
+
+	for (Skin& skin : skins)
+	{
+		for (int& link : skin.links)
+			link = clusterLinks[link];
+	}
+
+	// Hierarchies are walked down from the roots and transforms up to them, so every model has to reach the scene root.
+	// A parent cycle in a corrupt file is rejected, it would make both walks endless.
+	rootModels.erase(std::remove_if(rootModels.begin(), rootModels.end(), [this](int model) { return models[model].parent != -1; }), rootModels.end());
+	std::vector<uint8_t> reachesRoot(models.size(), 0); // 1 while on the current walk, 2 once known to reach the root
+	std::vector<int> walk;
+	for (int model = 0; model < (int)models.size(); model++)
+	{
+		walk.clear();
+		int ancestor = model;
+		for (; ancestor != -1 && reachesRoot[ancestor] == 0; ancestor = models[ancestor].parent)
+		{
+			reachesRoot[ancestor] = 1;
+			walk.push_back(ancestor);
+		}
+		if (ancestor != -1 && reachesRoot[ancestor] == 1)
+			return false;
+		for (int visited : walk)
+			reachesRoot[visited] = 2;
+	}
+
+	for (AnimationStack& stack : stacks)
+		stack.channelCurves.assign(models.size() * 9, -1);
+
+	// Only the first layer of each stack is used, additional layers would need blending
+	for (const CurveNode& curveNode : curveNodes)
+	{
+		if (curveNode.layer == -1 || curveNode.model == -1 || curveNode.transform == -1 || layerStacks[curveNode.layer] == -1 ||
+			firstLayers[layerStacks[curveNode.layer]] != curveNode.layer)
+			continue;
+
+		AnimationStack& stack = stacks[layerStacks[curveNode.layer]];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int& channel = stack.channelCurves[curveNode.model * 9 + curveNode.transform * 3 + axis];
+			if (channel == -1)
+				channel = curveNode.curves[axis];
+		}
+	}
+
+	return true;
+}
+
+void FbxLoader::Binary::Scene::ReadGlobalSettings(int node)
+{
+	const Document& doc = *document;
+	PropertyTable table = { doc, node == -1 ? -1 : doc.FindChild(node, "Properties70") };
+
+	unitScaleFactor = table.Double("UnitScaleFactor", 1.0);
+	frameRate = FrameRateFromTimeMode((int)table.Int("TimeMode", 0), table.Double("CustomFrameRate", -1.0));
+	frameTicks = std::max((int64_t)1, (int64_t)llround((double)TicksPerSecond / frameRate));
+
+	// Map the file's right/up/front axes onto DirectX (+X right, +Y up, left handed)
+	int upAxis = (int)table.Int("UpAxis", 1);
+	int frontAxis = (int)table.Int("FrontAxis", 2);
+	int coordAxis = (int)table.Int("CoordAxis", 0);
+	double upSign = (double)table.Int("UpAxisSign", 1);
+	double frontSign = (double)table.Int("FrontAxisSign", 1);
+	double coordSign = (double)table.Int("CoordAxisSign", 1);
+
+	axisConversion.SetIdentity();
+	if (upAxis < 0 || upAxis > 2 || frontAxis < 0 || frontAxis > 2 || coordAxis < 0 || coordAxis > 2 ||
+		upAxis == frontAxis || upAxis == coordAxis || frontAxis == coordAxis)
+		return;
+
+	double* matrix = (double*)axisConversion;
+	memset(matrix, 0, sizeof(double) * 16);
+	matrix[coordAxis * 4 + 0] = coordSign;
+	matrix[upAxis * 4 + 1] = upSign;
+	matrix[frontAxis * 4 + 2] = -frontSign;
+	matrix[15] = 1.0;
+}
+
+void FbxLoader::Binary::Scene::ReadModel(int node, Model& model)
+{
+	PropertyTable table = { *document, document->FindChild(node, "Properties70") };
+
+	model.translation = table.Vector("Lcl Translation", model.translation);
+	model.rotation = table.Vector("Lcl Rotation", model.rotation);
+	model.scaling = table.Vector("Lcl Scaling", model.scaling);
+	model.preRotation = table.Vector("PreRotation", model.preRotation);
+	model.postRotation = table.Vector("PostRotation", model.postRotation);
+	model.rotationPivot = table.Vector("RotationPivot", model.rotationPivot);
+	model.scalingPivot = table.Vector("ScalingPivot", model.scalingPivot);
+	model.rotationOffset = table.Vector("RotationOffset", model.rotationOffset);
+	model.scalingOffset = table.Vector("ScalingOffset", model.scalingOffset);
+	model.rotationOrder = (int)table.Int("RotationOrder", 0);
+	model.rotationActive = table.Int("RotationActive", 0) != 0;
+}
+
+FbxAMatrix FbxLoader::Binary::Scene::GetLocalTransform(int modelIndex, const AnimationStack* stack, int64_t time) const
+{
+	const Model& model = models[modelIndex];
+
+	FbxVector4 channels[3] = { model.translation, model.rotation, model.scaling };
+	if (stack)
+	{
+		const int* channelCurves = &stack->channelCurves[modelIndex * 9];
+		for (int channel = 0; channel < 9; channel++)
+		{
+			if (channelCurves[channel] != -1)
+				channels[channel / 3][channel % 3] = curves[channelCurves[channel]].Evaluate(time);
+		}
+	}
+
+	FbxAMatrix preRotation, postRotation, scaling;
+	int rotationOrder = eEulerXYZ;
+	if (model.rotationActive)
+	{
+		preRotation = EulerToMatrix(model.preRotation, eEulerXYZ);
+		postRotation = EulerToMatrix(model.postRotation, eEulerXYZ);
+		rotationOrder = model.rotationOrder;
+	}
+	scaling.SetS(channels[2]);
+
+	// FBX transform chain: T * Roff * Rp * Rpre * R * Rpost^-1 * Rp^-1 * Soff * Sp * S * Sp^-1
+	return TranslationMatrix(channels[0]) * TranslationMatrix(model.rotationOffset) * TranslationMatrix(model.rotationPivot) *
+		preRotation * EulerToMatrix(channels[1], rotationOrder) * postRotation.Inverse() * TranslationMatrix(model.rotationPivot).Inverse() *
+		TranslationMatrix(model.scalingOffset) * TranslationMatrix(model.scalingPivot) * scaling * TranslationMatrix(model.scalingPivot).Inverse();
+}
+
+FbxAMatrix FbxLoader::Binary::Scene::GetGlobalTransform(int model, const AnimationStack* stack, int64_t time) const
+{
+	FbxAMatrix global = GetLocalTransform(model, stack, time);
+	for (int parent = models[model].parent; parent != -1; parent = models[parent].parent)
+		global = GetLocalTransform(parent, stack, time) * global;
+	return global;
+}
+
+bool FbxLoader::Binary::Scene::ReadMesh(int modelIndex, const std::unordered_map<std::string, int>& materialNameToIndexMap, const VertexLayout& layout, MeshSource& out) const
+{
+	const Model& model = models[modelIndex];
+	if (model.geometry == -1)
+		return false;
+
+	const Document& doc = *document;
+	const Geometry& geometry = geometries[model.geometry];
+
+	std::vector<double> vertices;
+	std::vector<int> polygonVertexIndex;
+	if (!doc.ReadChildArray(geometry.node, "Vertices", vertices) || !doc.ReadChildArray(geometry.node, "PolygonVertexIndex", polygonVertexIndex))
+		return false;
+
+	out = MeshSource{};
+	out.transform = axisConversion * GetGlobalTransform(modelIndex);
+
+	out.controlPoints.resize(vertices.size() / 3);
+	for (size_t i = 0; i < out.controlPoints.size(); i++)
+		out.controlPoints[i] = FbxVector4(vertices[i * 3 + 0], vertices[i * 3 + 1], vertices[i * 3 + 2], 1.0);
+
+	// Fan triangulate, keeping the original polygon-vertex and polygon of every corner for layer lookups
+	std::vector<int> cornerPolygonVertex;
+	std::vector<int> cornerPolygon;
+	cornerPolygonVertex.reserve(polygonVertexIndex.size() * 2);
+	cornerPolygon.reserve(polygonVertexIndex.size());
+	out.polygonVertices.reserve(polygonVertexIndex.size() * 2);
+
+	int polygon = 0;
+	int polygonStart = 0;
+	for (int polygonVertex = 0; polygonVertex < (int)polygonVertexIndex.size(); polygonVertex++)
+	{
+		if (polygonVertexIndex[polygonVertex] >= 0)
+			continue;
+
+		for (int corner = polygonStart + 1; corner + 1 <= polygonVertex; corner++)
+		{
+			const int triangle[3] = { polygonStart, corner, corner + 1 };
+			for (int pv : triangle)
+			{
+				int controlPoint = polygonVertexIndex[pv];
+				if (controlPoint < 0)
+					controlPoint = ~controlPoint;
+				if (controlPoint >= (int)out.controlPoints.size())
+					return false;
+
+				out.polygonVertices.push_back(controlPoint);
+				cornerPolygonVertex.push_back(pv);
+				cornerPolygon.push_back(polygon);
+			}
+		}
+
+		polygonStart = polygonVertex + 1;
+		polygon++;
+	}
+
+	const size_t cornerCount = out.polygonVertices.size();
+
+	// Layers the vertex layout leaves out are never read, UVs are still needed to generate tangents
+	const bool wantTangents = layout.Has(VertexAttribute::Tangent);
+	LayerElement normals, binormals, tangents, uvs, colors;
+	if ((layout.Has(VertexAttribute::Normal) || wantTangents) && normals.Read(doc, geometry.node, "LayerElementNormal", "Normals", "NormalsIndex", 3))
+		out.normals.resize(cornerCount, FbxVector4(0, 0, 0, 0));
+	if (wantTangents && binormals.Read(doc, geometry.node, "LayerElementBinormal", "Binormals", "BinormalsIndex", 3))
+		out.binormals.resize(cornerCount, FbxVector4(0, 0, 0, 0));
+	if (wantTangents && tangents.Read(doc, geometry.node, "LayerElementTangent", "Tangents", "TangentsIndex", 3))
+		out.tangents.resize(cornerCount, FbxVector4(0, 0, 0, 0));
+	if ((layout.Has(VertexAttribute::UV) || wantTangents) && uvs.Read(doc, geometry.node, "LayerElementUV", "UV", "UVIndex", 2))
+		out.uvs.resize(cornerCount, FbxVector2(0, 0));
+	if (layout.Has(VertexAttribute::Color) && colors.Read(doc, geometry.node, "LayerElementColor", "Colors", "ColorIndex", 4))
+		out.colors.resize(cornerCount, FbxColor(1, 1, 1, 1));
+
+	for (size_t corner = 0; corner < cornerCount; corner++)
+	{
+		const int pv = cornerPolygonVertex[corner];
+		const int cp = out.polygonVertices[corner];
+		const int poly = cornerPolygon[corner];
+		int at;
+
+		if (!out.normals.empty() && (at = normals.Resolve(pv, cp, poly)) != -1)
+			out.normals[corner] = FbxVector4(normals.values[at], normals.values[at + 1], normals.values[at + 2], 0);
+		if (!out.binormals.empty() && (at = binormals.Resolve(pv, cp, poly)) != -1)
+			out.binormals[corner] = FbxVector4(binormals.values[at], binormals.values[at + 1], binormals.values[at + 2], 0);
+		if (!out.tangents.empty() && (at = tangents.Resolve(pv, cp, poly)) != -1)
+			out.tangents[corner] = FbxVector4(tangents.values[at], tangents.values[at + 1], tangents.values[at + 2], 0);
+		if (!out.uvs.empty() && (at = uvs.Resolve(pv, cp, poly)) != -1)
+			out.uvs[corner] = FbxVector2(uvs.values[at], uvs.values[at + 1]);
+		if (!out.colors.empty() && (at = colors.Resolve(pv, cp, poly)) != -1)
+			out.colors[corner] = FbxColor(colors.values[at], colors.values[at + 1], colors.values[at + 2], colors.values[at + 3]);
+	}
+
+	// Equivalent of GenerateTangentsDataForAllUVSets for files exported without tangents
+	if (wantTangents && (out.binormals.empty() || out.tangents.empty()) && !out.uvs.empty() && !out.normals.empty())
+	{
+		out.binormals.assign(cornerCount, FbxVector4(0, 0, 0, 0));
+		out.tangents.assign(cornerCount, FbxVector4(0, 0, 0, 0));
+		for (size_t triangle = 0; triangle + 2 < cornerCount; triangle += 3)
+		{
+			const FbxVector4 edge1 = out.controlPoints[out.polygonVertices[triangle + 1]] - out.controlPoints[out.polygonVertices[triangle]];
+			const FbxVector4 edge2 = out.controlPoints[out.polygonVertices[triangle + 2]] - out.controlPoints[out.polygonVertices[triangle]];
+			const double du1 = out.uvs[triangle + 1][0] - out.uvs[triangle][0];
+			const double dv1 = out.uvs[triangle + 1][1] - out.uvs[triangle][1];
+			const double du2 = out.uvs[triangle + 2][0] - out.uvs[triangle][0];
+			const double dv2 = out.uvs[triangle + 2][1] - out.uvs[triangle][1];
+			const double determinant = du1 * dv2 - du2 * dv1;
+			if (fabs(determinant) < 1e-12)
+				continue;
+
+			const double r = 1.0 / determinant;
+			FbxVector4 faceTangent = (edge1 * dv2 - edge2 * dv1) * r;
+			FbxVector4 faceBinormal = (edge2 * du1 - edge1 * du2) * r;
+
+			for (size_t corner = triangle; corner < triangle + 3; corner++)
+			{
+				const FbxVector4& normal = out.normals[corner];
+				FbxVector4 tangent = faceTangent - normal * normal.DotProduct(faceTangent);
+				tangent[3] = 0;
+				tangent.Normalize();
+				FbxVector4 binormal = normal.CrossProduct(tangent);
+				if (binormal.DotProduct(faceBinormal) < 0.0)
+					binormal = -binormal;
+				binormal[3] = 0;
+
+				out.tangents[corner] = tangent;
+				out.binormals[corner] = binormal;
+			}
+		}
+	}
+
+	if (layout.flipUVY)
+	{
+		for (FbxVector2& uv : out.uvs)
+			uv.mData[1] = 1.0f - uv.mData[1];
+	}
+
+	// Map node material slots to scene material indices
+	int materialElement = doc.FindChild(geometry.node, "LayerElementMaterial");
+	std::vector<int> materials;
+	if (materialElement != -1 && doc.ReadChildArray(materialElement, "Materials", materials) && !materials.empty())
+	{
+		const size_t triangleCount = cornerCount / 3;
+		out.materials.resize(triangleCount);
+		for (size_t triangle = 0; triangle < triangleCount; triangle++)
+		{
+			int poly = cornerPolygon[triangle * 3];
+			int localIndex = materials.size() == 1 ? materials[0] : (poly < (int)materials.size() ? materials[poly] : 0);
+			out.materials[triangle] = localIndex;
+
+			if (localIndex >= 0 && localIndex < (int)model.materials.size())
+			{
+				auto found = materialNameToIndexMap.find(materialNames[model.materials[localIndex]]);
+				if (found != materialNameToIndexMap.end())
+					out.materials[triangle] = found->second;
+			}
+		}
+	}
+
+	for (int skinIndex : geometry.skins)
+	{
+		if (!layout.HasSkin())
+			break;
+
+		const Skin& skin = skins[skinIndex];
+		for (size_t cluster = 0; cluster < skin.clusters.size(); cluster++)
+		{
+			if (skin.links[cluster] == -1)
+				continue;
+
+			MeshSource::Cluster source;
+			source.jointName = models[skin.links[cluster]].name.c_str();
+			doc.ReadChildArray(skin.clusters[cluster], "Indexes", source.indices);
+			doc.ReadChildArray(skin.clusters[cluster], "Weights", source.weights);
+			source.weights.resize(source.indices.size(), 0.0);
+			out.clusters.push_back(std::move(source));
+		}
+	}
+
+	return true;
+}
+
+namespace
+{
+	// Converts a native transform into the DirectX axis system and meters, matching what the SDK path produces
+	FbxAMatrix ToLoaderSpace(const FbxLoader::Binary::Scene& scene, const FbxAMatrix& matrix, float scaleFactor)
+	{
+		FbxAMatrix result = scene.axisConversion * matrix * scene.axisConversion.Inverse();
+		result.SetT(result.GetT() * scaleFactor);
+		return result;
+	}
+}
+
+bool FbxLoader::Parser::LoadSceneNative()
+{
+	FbxString fullFbxFile = GetFullFbxFile();
+
+	BeginStats();
+	if (!cacheFile.IsEmpty() && !lazyAnimations && LoadCache(cacheFile.Buffer()))
+	{
+		EndStats();
+		return true;
+	}
+
+	// Shared so lazily decoded clips can keep reading from them after loading
+	std::shared_ptr<Binary::Document> document = std::make_shared<Binary::Document>();
+	std::shared_ptr<Binary::Scene> scene = std::make_shared<Binary::Scene>();
+	bool status = true;
+	{
+		PhaseScope phase(*this, LoadStats::Import);
+		if (!document->Open(fullFbxFile.Buffer()))
+		{
+			FBXSDK_printf("error: %s is not a readable binary FBX file\n", fullFbxFile.Buffer());
+			status = false;
+		}
+		else if (!scene->Load(*document))
+		{
+			FBXSDK_printf("error: %s is missing objects or connections, or its node hierarchy has a cycle\n", fullFbxFile.Buffer());
+			status = false;
+		}
+	}
+	if (!status)
+	{
+		EndStats();
+		return false;
+	}
+
+	scaleFactor = (float)(scene->unitScaleFactor / 100.0);
+
+	for (int i = 0; i < (int)scene->materialNames.size(); i++)
+	{
+		materialNameToIndexMap[scene->materialNames[i]] = i;
+	}
+
+	std::vector<int> jointModels;
+	{
+		PhaseScope phase(*this, LoadStats::Skeleton);
+		for (int root : scene->rootModels)
+		{
+			LoadSkeleton(*scene, root, (int)skeleton.joints.size(), -1, jointModels);
+		}
+	}
+	LoadMeshes(*scene);
+	LoadAnimations(*scene, jointModels);
+
+	if (lazyAnimations)
+	{
+		decodeAnimation = [this, document, scene, jointModels](size_t animIndex, Animation& result)
+		{
+			LoadAnimation(*scene, jointModels, animIndex, result);
+		};
+	}
+	else if (!cacheFile.IsEmpty() && !meshSink)
+	{
+		SaveCache(cacheFile.Buffer());
+	}
+
+	EndStats();
+	return true;
+}
+
+void FbxLoader::Parser::LoadSkeleton(const Binary::Scene& scene, int model, int currIndex, int parentIndex, std::vector<int>& jointModels)
+{
+	const bool isJoint = scene.models[model].IsSkeleton();
+	if (isJoint)
+	{
+		Joint jointTmp = {};
+		jointTmp.jointName = scene.models[model].name.c_str();
+		jointTmp.parentIndex = parentIndex;
+		jointTmp.currentIndex = currIndex;
+
+		jointTmp.localMatrix = ToLoaderSpace(scene, scene.GetLocalTransform(model), scaleFactor);
+		jointTmp.globalMatrix = ToLoaderSpace(scene, scene.GetGlobalTransform(model), scaleFactor);
+
+		skeleton.jointMap.emplace(scene.models[model].name, (int)skeleton.joints.size());
+		skeleton.joints.push_back(jointTmp);
+		jointModels.push_back(model);
+	}
+
+	for (int child : scene.models[model].children)
+	{
+		LoadSkeleton(scene, child, (int)skeleton.joints.size(), isJoint ? currIndex : parentIndex, jointModels);
+	}
+}
+
+void FbxLoader::Parser::LoadMeshes(const Binary::Scene& scene)
+{
+	// Same depth first order as FindMeshes
+	std::vector<int> meshModels;
+	std::vector<int> stack(scene.rootModels.rbegin(), scene.rootModels.rend());
+	while (!stack.empty())
+	{
+		int model = stack.back();
+		stack.pop_back();
+
+		if (scene.models[model].geometry != -1)
+			meshModels.push_back(model);
+
+		const std::vector<int>& children = scene.models[model].children;
+		stack.insert(stack.end(), children.rbegin(), children.rend());
+	}
+
+	// The native scene is read only, so the whole extraction can run on the workers
+	std::vector<Mesh> results(meshModels.size());
+	std::vector<char> valid(meshModels.size());
+	auto loadMesh = [&](size_t i)
+	{
+		MeshSource source;
+		valid[i] = scene.ReadMesh(meshModels[i], materialNameToIndexMap, vertexLayout, source);
+		if (valid[i])
+			BuildMesh(source, results[i]);
+	};
+
+	{
+		PhaseScope phase(*this, LoadStats::MeshBuild);
+		if (workerCount == 1)
+		{
+			for (size_t i = 0; i < meshModels.size(); i++)
+				loadMesh(i);
+		}
+		else
+		{
+			GetWorkerPool().Run(meshModels.size(), loadMesh);
+		}
+	}
+	arenas.clear();
+
+	std::vector<Mesh> built;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (valid[i])
+			built.push_back(std::move(results[i]));
+	}
+
+	materialCount = (int)scene.materialNames.size();
+
+	std::vector<FbxString> materialNames;
+	for (const std::string& name : scene.materialNames)
+		materialNames.push_back(name.c_str());
+	SplitMeshesByMaterial(built, materialNames);
+}
+
+void FbxLoader::Parser::LoadAnimationInfo(const Binary::Scene& scene, const std::vector<int>& jointModels, size_t animIndex, FbxLoader::Animation& result) const
+{
+	const Binary::AnimationStack& stack = scene.stacks[animIndex];
+
+	result.name = stack.name.c_str();
+	result.length = (double)(stack.stop - stack.start) / (double)Binary::Scene::TicksPerSecond;
+	result.frameRate = scene.frameRate;
+	result.frameCount = (FbxLongLong)(std::max(stack.stop - stack.start, (int64_t)0) / scene.frameTicks);
+
+	for (size_t boneIndex = 0; boneIndex < jointModels.size(); boneIndex++)
+	{
+		const int* channelCurves = &stack.channelCurves[jointModels[boneIndex] * 9];
+		if (std::any_of(channelCurves, channelCurves + 9, [](int curve) { return curve != -1; }))
+			result.animatedJoints.push_back((int)boneIndex);
+	}
+}
+
+void FbxLoader::Parser::LoadAnimation(const Binary::Scene& scene, const std::vector<int>& jointModels, size_t animIndex, FbxLoader::Animation& result) const
+{
+	const Binary::AnimationStack& stack = scene.stacks[animIndex];
+	LoadAnimationInfo(scene, jointModels, animIndex, result);
+
+	result.localTransforms.resize(skeleton.joints.size());
+	result.globalTransforms.resize(skeleton.joints.size());
+	for (size_t boneIndex = 0; boneIndex < skeleton.joints.size(); boneIndex++)
+	{
+		result.localTransforms[boneIndex].resize((size_t)result.frameCount);
+		result.globalTransforms[boneIndex].resize((size_t)result.frameCount);
+	}
+
+	// Every joint and all of its ancestors, a parent always comes before its children, so each frame builds every
+	// local transform once and accumulates the globals down the hierarchy
+	std::vector<int> models;
+	std::vector<int> parents;
+	std::unordered_map<int, int> slots;
+	std::vector<int> jointSlots(jointModels.size());
+	std::vector<int> chain;
+	for (size_t boneIndex = 0; boneIndex < jointModels.size(); boneIndex++)
+	{
+		chain.clear();
+		for (int model = jointModels[boneIndex]; model != -1 && slots.count(model) == 0; model = scene.models[model].parent)
+			chain.push_back(model);
+		for (auto model = chain.rbegin(); model != chain.rend(); ++model)
+		{
+			const int parent = scene.models[*model].parent;
+			slots[*model] = (int)models.size();
+			models.push_back(*model);
+			parents.push_back(parent == -1 ? -1 : slots[parent]);
+		}
+		jointSlots[boneIndex] = slots[jointModels[boneIndex]];
+	}
+
+	std::vector<FbxAMatrix> locals(models.size());
+	std::vector<FbxAMatrix> globals(models.size());
+	for (FbxLongLong frameIndex = 0; frameIndex < result.frameCount; frameIndex++)
+	{
+		const int64_t time = frameIndex * scene.frameTicks;
+		for (size_t slot = 0; slot < models.size(); slot++)
+		{
+			locals[slot] = scene.GetLocalTransform(models[slot], &stack, time);
+			globals[slot] = parents[slot] == -1 ? locals[slot] : globals[parents[slot]] * locals[slot];
+		}
+
+		for (size_t boneIndex = 0; boneIndex < jointSlots.size(); boneIndex++)
+		{
+			result.localTransforms[boneIndex][frameIndex] = ToLoaderSpace(scene, locals[jointSlots[boneIndex]], scaleFactor);
+			result.globalTransforms[boneIndex][frameIndex] = ToLoaderSpace(scene, globals[jointSlots[boneIndex]], scaleFactor);
+		}
+	}
+	CompressAnimation(result);
+}
+
+void FbxLoader::Parser::LoadAnimations(const Binary::Scene& scene, const std::vector<int>& jointModels)
+{
+	PhaseScope phase(*this, LoadStats::Animations);
+
+	animations.resize(scene.stacks.size());
+	if (lazyAnimations)
+	{
+		for (size_t animIndex = 0; animIndex < scene.stacks.size(); animIndex++)
+			LoadAnimationInfo(scene, jointModels, animIndex, animations[animIndex]);
+		return;
+	}
+
+	// Scene evaluation is read only, so every stack is sampled on its own worker
+	GetWorkerPool().Run(scene.stacks.size(), [&](size_t animIndex)
+	{
+		const std::chrono::steady_clock::time_point start = activeStats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+		LoadAnimation(scene, jointModels, animIndex, animations[animIndex]);
+		RecordEvent(scene.stacks[animIndex].name.c_str(), start);
+	});
+}
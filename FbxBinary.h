@@ -0,0 +1,199 @@
+#ifndef FBXBINARY_H
+#define FBXBINARY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "fbxsdk.h"
+
+// Native reader for binary FBX (7.x) files. The file is memory mapped and node records are indexed in place,
+// property data is never copied until an array is explicitly read (and inflated if it is zlib compressed).
+namespace FbxLoader
+{
+	struct MeshSource;
+	struct VertexLayout;
+
+	namespace Binary
+	{
+		class MappedFile
+		{
+		public:
+			MappedFile() = default;
+			~MappedFile();
+
+			MappedFile(const MappedFile&) = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+
+			bool Open(const char* path);
+			void Close();
+
+			const uint8_t* Data() const { return data; }
+			size_t Size() const { return size; }
+
+		private:
+			const uint8_t* data = nullptr;
+			size_t size = 0;
+#ifdef _WIN32
+			void* file = nullptr;
+			void* mapping = nullptr;
+#else
+			int file = -1;
+#endif
+		};
+
+		struct Property
+		{
+			char type = 0;
+			const uint8_t* data = nullptr;	// Points into the mapped file
+			uint32_t length = 0;			// Byte length for S/R, element count for arrays
+			uint32_t encoding = 0;			// Arrays only, 1 means zlib compressed
+			uint32_t compressedLength = 0;	// Arrays only
+
+			bool IsArray() const { return type == 'f' || type == 'd' || type == 'l' || type == 'i' || type == 'b'; }
+
+			int64_t AsInt() const;
+			double AsDouble() const;
+			std::string AsString() const; // Object names have the class appended after a "\x00\x01" separator, this strips it
+		};
+
+		struct Node
+		{
+			const char* name = nullptr;
+			uint32_t nameLength = 0;
+			uint32_t firstProperty = 0;
+			uint32_t propertyCount = 0;
+			int firstChild = -1;
+			int nextSibling = -1;
+		};
+
+		class Document
+		{
+		public:
+			bool Open(const char* path); // Map and index the file, return false if it is not a binary FBX
+
+			uint32_t Version() const { return version; }
+
+			int Root() const { return 0; }
+			int FirstChild(int node) const { return nodes[node].firstChild; }
+			int NextSibling(int node) const { return nodes[node].nextSibling; }
+			int FindChild(int node, const char* name) const;
+			bool NameIs(int node, const char* name) const;
+
+			uint32_t PropertyCount(int node) const { return nodes[node].propertyCount; }
+			const Property& GetProperty(int node, uint32_t index) const { return properties[nodes[node].firstProperty + index]; }
+
+			// Decode an array property into out, converting the element type if needed. Supported T: int, int64_t, float, double.
+			template<class T>
+			bool ReadArray(const Property& property, std::vector<T>& out) const;
+			template<class T>
+			bool ReadChildArray(int node, const char* childName, std::vector<T>& out) const;
+
+		private:
+			MappedFile file;
+			uint32_t version = 0;
+			std::vector<Node> nodes;
+			std::vector<Property> properties;
+
+			// Parses the record at offset, which has to end by end, depth is the nesting level of the record
+			bool ParseNode(size_t& offset, size_t end, int depth, int parent, int& previousSibling, bool& isNullRecord);
+			bool ParseProperty(size_t& offset, size_t end);
+		};
+
+		// Curve keys as stored in the file, time is in FBX ticks
+		struct Curve
+		{
+			std::vector<int64_t> times;
+			std::vector<float> values;
+			std::vector<int> flags;				// KeyAttrFlags, one per attribute
+			std::vector<float> attributeData;	// KeyAttrDataFloat, four floats per attribute
+			std::vector<int> keyAttributes;		// Attribute index of each key, expanded from KeyAttrRefCount
+
+			float Evaluate(int64_t time) const;
+		};
+
+		struct Model
+		{
+			int64_t id = 0;
+			std::string name;
+			std::string type;	// "Mesh", "LimbNode", "Null", ...
+			int parent = -1;
+			std::vector<int> children;
+
+			FbxVector4 translation = FbxVector4(0, 0, 0, 0);
+			FbxVector4 rotation = FbxVector4(0, 0, 0, 0);
+			FbxVector4 scaling = FbxVector4(1, 1, 1, 0);
+			FbxVector4 preRotation = FbxVector4(0, 0, 0, 0);
+			FbxVector4 postRotation = FbxVector4(0, 0, 0, 0);
+			FbxVector4 rotationPivot = FbxVector4(0, 0, 0, 0);
+			FbxVector4 scalingPivot = FbxVector4(0, 0, 0, 0);
+			FbxVector4 rotationOffset = FbxVector4(0, 0, 0, 0);
+			FbxVector4 scalingOffset = FbxVector4(0, 0, 0, 0);
+			int rotationOrder = 0;
+			bool rotationActive = false;
+
+			int geometry = -1;				// Index into Scene::geometries
+			std::vector<int> materials;		// Indices into Scene::materialNames, in node material order
+
+			bool IsSkeleton() const { return type == "LimbNode" || type == "Limb" || type == "Root"; }
+		};
+
+		struct Geometry
+		{
+			int64_t id = 0;
+			int node = -1;
+			std::vector<int> skins; // Indices into Scene::skins
+		};
+
+		struct Skin
+		{
+			std::vector<int> clusters; // Nodes of the cluster deformers
+			std::vector<int> links;    // Model index linked to each cluster, -1 if unlinked
+		};
+
+		struct AnimationStack
+		{
+			std::string name;
+			int64_t start = 0;
+			int64_t stop = 0;
+			std::vector<int> channelCurves; // [model * 9 + transform * 3 + axis] -> index into Scene::curves or -1, transform is T/R/S
+		};
+
+		// Object graph resolved from a Document, mirroring the subset of FbxScene the loader uses
+		class Scene
+		{
+		public:
+			static const int64_t TicksPerSecond = 46186158000LL;
+
+			bool Load(const Document& document);
+
+			std::vector<Model> models;
+			std::vector<int> rootModels;
+			std::vector<Geometry> geometries;
+			std::vector<Skin> skins;
+			std::vector<std::string> materialNames;
+			std::vector<Curve> curves;
+			std::vector<AnimationStack> stacks;
+
+			double unitScaleFactor = 1.0; // Centimeters per file unit
+			double frameRate = 30.0;
+			int64_t frameTicks = TicksPerSecond / 30; // Whole ticks per frame, frame times and counts are counted in these like FbxTime does
+			FbxAMatrix axisConversion;    // File axis system to DirectX axis system
+
+			// Local/global node transforms, animated by stack at time when stack is not null
+			FbxAMatrix GetLocalTransform(int model, const AnimationStack* stack = nullptr, int64_t time = 0) const;
+			FbxAMatrix GetGlobalTransform(int model, const AnimationStack* stack = nullptr, int64_t time = 0) const;
+
+			// Gather triangulated, un-welded mesh data for a model, in the same form the SDK path produces
+			bool ReadMesh(int model, const std::unordered_map<std::string, int>& materialNameToIndexMap, const VertexLayout& layout, MeshSource& out) const;
+
+		private:
+			const Document* document = nullptr;
+
+			void ReadGlobalSettings(int node);
+			void ReadModel(int node, Model& model);
+		};
+	}
+}
+
+#endif
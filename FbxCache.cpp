@@ -0,0 +1,558 @@
+#include "FbxBinary.h"
+#include "FbxLoader.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// Baked cache of a processed scene. The file is a fixed header followed by the skeleton, meshes and animations,
+// every array is stored as a count followed by its raw elements on a 64 byte boundary so it can be copied
+// straight out of the mapped file. A cache only hits when the source content hash and the load options match.
+namespace
+{
+	const char cacheMagic[8] = { 'F', 'B', 'X', 'L', 'C', 'A', 'C', 'H' };
+	const uint32_t cacheVersion = 8;
+	const size_t cacheAlignment = 64;
+	const size_t sourceHashChunk = 4 << 20; // Bytes hashed per job, chunk hashes are combined afterwards
+
+	struct CacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t headerSize;
+		uint64_t sourceHash;
+		uint64_t optionsHash;
+		uint64_t fileSize;
+	};
+
+	static_assert(sizeof(FbxAMatrix) == 16 * sizeof(double), "FbxAMatrix is expected to be a plain 4x4 double matrix");
+
+	class CacheWriter
+	{
+	public:
+		std::vector<uint8_t> buffer;
+
+		void Write(const void* data, size_t size)
+		{
+			buffer.insert(buffer.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+		}
+
+		template<class T>
+		void Write(const T& value)
+		{
+			Write(&value, sizeof(T));
+		}
+
+		template<class T, class A>
+		void WriteArray(const std::vector<T, A>& values)
+		{
+			WriteArray(values.data(), values.size());
+		}
+
+		template<class T>
+		void WriteArray(const T* values, size_t count)
+		{
+			Write((uint64_t)count);
+			buffer.resize((buffer.size() + cacheAlignment - 1) / cacheAlignment * cacheAlignment, 0);
+			Write(values, count * sizeof(T));
+		}
+
+		void WriteString(const FbxString& string)
+		{
+			WriteArray(string.Buffer(), string.GetLen());
+		}
+	};
+
+	class CacheReader
+	{
+	public:
+		// Offsets, and with them the array alignment, are measured from data like the writer measures them from the start of the file
+		CacheReader(const uint8_t* _data, size_t _size, size_t _offset) :
+			data(_data), size(_size), offset(std::min(_offset, _size))
+		{
+		}
+
+		bool Failed() const { return failed; }
+		void Fail() { failed = true; }
+
+		bool Read(void* out, size_t count)
+		{
+			if (failed || count > size - offset)
+			{
+				failed = true;
+				return false;
+			}
+			memcpy(out, data + offset, count);
+			offset += count;
+			return true;
+		}
+
+		template<class T>
+		bool Read(T& value)
+		{
+			return Read(&value, sizeof(T));
+		}
+
+		// Points at count elements in the mapped file, or nullptr if the file is too short
+		template<class T>
+		const T* ReadArray(size_t& count)
+		{
+			uint64_t storedCount = 0;
+			if (!Read(storedCount))
+				return nullptr;
+			offset = (offset + cacheAlignment - 1) / cacheAlignment * cacheAlignment;
+			if (offset > size || storedCount > (size - offset) / sizeof(T))
+			{
+				failed = true;
+				return nullptr;
+			}
+			const T* values = (const T*)(data + offset);
+			count = (size_t)storedCount;
+			offset += count * sizeof(T);
+			return values;
+		}
+
+		template<class T, class A>
+		bool ReadArray(std::vector<T, A>& out)
+		{
+			size_t count = 0;
+			const T* values = ReadArray<T>(count);
+			if (!values)
+				return false;
+			out.resize(count);
+			memcpy(out.data(), values, count * sizeof(T));
+			return true;
+		}
+
+		bool ReadString(FbxString& out)
+		{
+			size_t length = 0;
+			const char* chars = ReadArray<char>(length);
+			if (!chars)
+				return false;
+			out = FbxString(chars, length);
+			return true;
+		}
+
+	private:
+		const uint8_t* data;
+		size_t size;
+		size_t offset;
+		bool failed = false;
+	};
+
+	void WriteMesh(CacheWriter& writer, const FbxLoader::Mesh& mesh)
+	{
+		writer.Write((uint32_t)mesh.indices.Width());
+		writer.WriteArray((const uint8_t*)mesh.indices.data(), mesh.indices.ByteSize());
+		writer.WriteArray(mesh.vertices);
+		writer.WriteArray(mesh.extraJoints);
+		writer.WriteArray(mesh.compactVertices);
+		writer.WriteArray(mesh.quantizedVertices);
+		writer.WriteArray(mesh.jointPalette);
+
+		const FbxLoader::VertexStreams& streams = mesh.streams;
+		writer.Write((uint64_t)streams.vertexCount);
+		writer.WriteArray(streams.descriptors);
+		writer.WriteArray(streams.positions);
+		writer.WriteArray(streams.normals);
+		writer.WriteArray(streams.tangents);
+		writer.WriteArray(streams.uvs);
+		writer.WriteArray(streams.colors);
+		writer.WriteArray(streams.jointIndices);
+		writer.WriteArray(streams.jointWeights);
+
+		writer.Write(mesh.attributes);
+		writer.Write(mesh.boundsMin);
+		writer.Write(mesh.boundsMax);
+		writer.Write(mesh.meshToWorld);
+		writer.WriteString(mesh.materialName);
+		writer.Write(mesh.materialIndex);
+		writer.WriteArray(mesh.drawRanges);
+
+		writer.Write((uint32_t)mesh.lods.size());
+		for (const FbxLoader::Mesh::Lod& lod : mesh.lods)
+		{
+			writer.Write((uint32_t)lod.indices.Width());
+			writer.WriteArray((const uint8_t*)lod.indices.data(), lod.indices.ByteSize());
+			writer.WriteArray(lod.drawRanges);
+			writer.Write(lod.error);
+		}
+
+		writer.WriteArray(mesh.meshlets);
+		writer.WriteArray(mesh.meshletVertices);
+		writer.WriteArray(mesh.meshletTriangles);
+	}
+
+	bool ReadMesh(CacheReader& reader, FbxLoader::Mesh& mesh)
+	{
+		uint32_t indexWidth = 0;
+		size_t indexBytes = 0;
+		reader.Read(indexWidth);
+		const uint8_t* indices = reader.ReadArray<uint8_t>(indexBytes);
+		if (!indices || (indexWidth != 2 && indexWidth != 4))
+			return false;
+		mesh.indices.assign(indices, indexBytes / indexWidth, (int)indexWidth);
+
+		reader.ReadArray(mesh.vertices);
+		reader.ReadArray(mesh.extraJoints);
+		reader.ReadArray(mesh.compactVertices);
+		reader.ReadArray(mesh.quantizedVertices);
+		reader.ReadArray(mesh.jointPalette);
+
+		FbxLoader::VertexStreams& streams = mesh.streams;
+		uint64_t vertexCount = 0;
+		reader.Read(vertexCount);
+		streams.vertexCount = (size_t)vertexCount;
+		reader.ReadArray(streams.descriptors);
+		reader.ReadArray(streams.positions);
+		reader.ReadArray(streams.normals);
+		reader.ReadArray(streams.tangents);
+		reader.ReadArray(streams.uvs);
+		reader.ReadArray(streams.colors);
+		reader.ReadArray(streams.jointIndices);
+		reader.ReadArray(streams.jointWeights);
+
+		reader.Read(mesh.attributes);
+		reader.Read(mesh.boundsMin);
+		reader.Read(mesh.boundsMax);
+		reader.Read(mesh.meshToWorld);
+		reader.ReadString(mesh.materialName);
+		reader.Read(mesh.materialIndex);
+		reader.ReadArray(mesh.drawRanges);
+
+		uint32_t lodCount = 0;
+		reader.Read(lodCount);
+		mesh.lods.clear();
+		for (uint32_t level = 0; level < lodCount && !reader.Failed(); level++)
+		{
+			FbxLoader::Mesh::Lod lod;
+			uint32_t lodIndexWidth = 0;
+			size_t lodIndexBytes = 0;
+			reader.Read(lodIndexWidth);
+			const uint8_t* lodIndices = reader.ReadArray<uint8_t>(lodIndexBytes);
+			if (!lodIndices || (lodIndexWidth != 2 && lodIndexWidth != 4))
+				return false;
+			lod.indices.assign(lodIndices, lodIndexBytes / lodIndexWidth, (int)lodIndexWidth);
+			reader.ReadArray(lod.drawRanges);
+			reader.Read(lod.error);
+			mesh.lods.push_back(std::move(lod));
+		}
+
+		reader.ReadArray(mesh.meshlets);
+		reader.ReadArray(mesh.meshletVertices);
+		reader.ReadArray(mesh.meshletTriangles);
+		return !reader.Failed();
+	}
+
+	void WriteTransforms(CacheWriter& writer, const std::vector<std::vector<FbxAMatrix>>& transforms)
+	{
+		writer.Write((uint32_t)transforms.size());
+		for (const std::vector<FbxAMatrix>& jointTransforms : transforms)
+			writer.WriteArray(jointTransforms);
+	}
+
+	bool ReadTransforms(CacheReader& reader, std::vector<std::vector<FbxAMatrix>>& transforms)
+	{
+		uint32_t jointCount = 0;
+		reader.Read(jointCount);
+		for (uint32_t joint = 0; joint < jointCount && !reader.Failed(); joint++)
+		{
+			transforms.emplace_back();
+			reader.ReadArray(transforms.back());
+		}
+		return !reader.Failed();
+	}
+
+	void WriteAnimation(CacheWriter& writer, const FbxLoader::Animation& animation)
+	{
+		writer.WriteString(animation.name);
+		writer.Write(animation.length);
+		writer.Write(animation.frameRate);
+		writer.Write(animation.frameCount);
+		WriteTransforms(writer, animation.localTransforms);
+		WriteTransforms(writer, animation.globalTransforms);
+		writer.WriteArray(animation.animatedJoints);
+
+		const FbxLoader::CompressedClip& clip = animation.compressed;
+		writer.Write(clip.jointCount);
+		writer.Write(clip.frameCount);
+		writer.WriteArray(clip.tracks);
+		writer.WriteArray(clip.keyFrames);
+		writer.WriteArray(clip.data);
+	}
+
+	bool ReadAnimation(CacheReader& reader, FbxLoader::Animation& animation)
+	{
+		reader.ReadString(animation.name);
+		reader.Read(animation.length);
+		reader.Read(animation.frameRate);
+		reader.Read(animation.frameCount);
+		ReadTransforms(reader, animation.localTransforms);
+		ReadTransforms(reader, animation.globalTransforms);
+		reader.ReadArray(animation.animatedJoints);
+
+		FbxLoader::CompressedClip& clip = animation.compressed;
+		reader.Read(clip.jointCount);
+		reader.Read(clip.frameCount);
+		reader.ReadArray(clip.tracks);
+		reader.ReadArray(clip.keyFrames);
+		reader.ReadArray(clip.data);
+		return !reader.Failed();
+	}
+}
+
+uint64_t FbxLoader::HashFile(const char* path, WorkerPool* pool)
+{
+	Binary::MappedFile file;
+	if (!file.Open(path))
+		return 0;
+
+	// Hash fixed size chunks, then hash the chunk hashes together with the file size. HashWords keys every stripe by its
+	// position, so both the order of the stripes in a chunk and the order of the chunks are part of the hash.
+	const size_t chunkCount = (file.Size() + sourceHashChunk - 1) / sourceHashChunk;
+	std::vector<uint64_t> chunkHashes((chunkCount + 1 + 3) / 4 * 4, 0);
+	auto hashChunk = [&](size_t chunk)
+	{
+		const uint8_t* data = file.Data() + chunk * sourceHashChunk;
+		const size_t size = std::min(sourceHashChunk, file.Size() - chunk * sourceHashChunk);
+		if (size % 32 == 0)
+		{
+			chunkHashes[chunk] = HashWords((const uint64_t*)data, size / 8);
+			return;
+		}
+
+		// Only the last chunk can end in a partial stripe, it is hashed from a zero padded copy so the tail keeps its position
+		std::vector<uint64_t> padded((size + 31) / 32 * 4, 0);
+		memcpy(padded.data(), data, size);
+		chunkHashes[chunk] = HashWords(padded.data(), padded.size());
+	};
+	if (pool)
+	{
+		pool->Run(chunkCount, hashChunk);
+	}
+	else
+	{
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+			hashChunk(chunk);
+	}
+	chunkHashes[chunkCount] = file.Size();
+
+	const uint64_t hash = HashWords(chunkHashes.data(), chunkHashes.size());
+	return hash == 0 ? 1 : hash;
+}
+
+uint64_t FbxLoader::Parser::GetSourceHash()
+{
+	if (sourceHash == 0)
+		sourceHash = HashFile(GetFullFbxFile().Buffer(), &GetWorkerPool());
+	return sourceHash;
+}
+
+uint64_t FbxLoader::Parser::GetOptionsHash() const
+{
+	// Everything that changes the processed output other than the source file itself
+	uint64_t options[32] = {};
+	memcpy(&options[0], &weldEpsilon, sizeof(double));
+	options[1] = (uint64_t)vertexFormat;
+	options[2] = splitLargeMeshes;
+	options[3] = (uint64_t)vertexLayout.maxBones;
+	options[4] = vertexLayout.flipUVY;
+	options[5] = splitMeshMaterial;
+	options[6] = sizeof(Mesh::VertexData);
+	options[7] = sizeof(CompactVertex);
+	options[8] = sizeof(QuantizedVertex);
+	options[9] = sizeof(VertexStreams::Descriptor);
+	options[10] = compressAnimations;
+	if (compressAnimations)
+	{
+		memcpy(&options[11], &animationCompression.rotationTolerance, sizeof(float));
+		memcpy(&options[12], &animationCompression.translationTolerance, sizeof(float));
+		memcpy(&options[13], &animationCompression.scaleTolerance, sizeof(float));
+		options[14] = animationCompression.reduceKeys;
+	}
+	options[15] = materialDrawRanges;
+	options[16] = optimizeMeshes;
+	if (optimizeMeshes)
+	{
+		options[17] = (uint64_t)meshOptimization.cacheSize;
+		memcpy(&options[18], &meshOptimization.overdrawThreshold, sizeof(float));
+		options[19] = meshOptimization.reorderVertices;
+	}
+	options[20] = generateLods;
+	if (generateLods)
+	{
+		std::vector<uint64_t> levels((lodGeneration.levels.size() + 3) / 4 * 4, 0);
+		for (size_t level = 0; level < lodGeneration.levels.size(); level++)
+		{
+			memcpy(&levels[level], &lodGeneration.levels[level].ratio, sizeof(float));
+			memcpy((uint8_t*)&levels[level] + sizeof(float), &lodGeneration.levels[level].maxError, sizeof(float));
+		}
+		options[21] = lodGeneration.levels.size();
+		options[22] = HashWords(levels.data(), levels.size());
+		memcpy(&options[23], &lodGeneration.attributeWeight, sizeof(float));
+	}
+	options[24] = generateMeshlets;
+	if (generateMeshlets)
+	{
+		options[25] = (uint64_t)meshletGeneration.maxVertices;
+		options[26] = (uint64_t)meshletGeneration.maxTriangles;
+		memcpy(&options[27], &meshletGeneration.coneWeight, sizeof(float));
+	}
+	options[28] = vertexLayout.attributes;
+	return HashWords(options, 32);
+}
+
+bool FbxLoader::Parser::SaveCache(const char* path)
+{
+	PhaseScope phase(*this, LoadStats::Cache);
+
+	CacheHeader header = {};
+	memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = cacheVersion;
+	header.headerSize = sizeof(CacheHeader);
+	header.sourceHash = GetSourceHash();
+	header.optionsHash = GetOptionsHash();
+	if (header.sourceHash == 0)
+	{
+		FBXSDK_printf("error: unable to hash %s for the cache\n", GetFullFbxFile().Buffer());
+		return false;
+	}
+
+	CacheWriter writer;
+	writer.Write(header);
+
+	writer.Write(scaleFactor);
+	writer.Write(materialCount);
+
+	writer.Write((uint32_t)skeleton.joints.size());
+	for (const Joint& joint : skeleton.joints)
+	{
+		writer.WriteString(joint.jointName);
+		writer.Write(joint.currentIndex);
+		writer.Write(joint.parentIndex);
+		writer.Write(joint.globalMatrix);
+		writer.Write(joint.localMatrix);
+	}
+
+	writer.Write((uint32_t)meshes.size());
+	for (const Mesh& mesh : meshes)
+	{
+		WriteMesh(writer, mesh);
+	}
+
+	writer.Write((uint32_t)animations.size());
+	for (const Animation& animation : animations)
+	{
+		WriteAnimation(writer, animation);
+	}
+
+	CacheHeader* written = (CacheHeader*)writer.buffer.data();
+	written->fileSize = writer.buffer.size();
+
+	// Write next to the destination and rename, so a reader never maps a half written cache
+	FbxString tempPath = FbxString(path) + ".tmp";
+	FILE* file = fopen(tempPath.Buffer(), "wb");
+	if (!file)
+	{
+		FBXSDK_printf("error: unable to create cache file %s\n", tempPath.Buffer());
+		return false;
+	}
+	const bool writeSucceeded = fwrite(writer.buffer.data(), 1, writer.buffer.size(), file) == writer.buffer.size();
+	if (fclose(file) != 0 || !writeSucceeded)
+	{
+		FBXSDK_printf("error: unable to write cache file %s\n", tempPath.Buffer());
+		remove(tempPath.Buffer());
+		return false;
+	}
+
+	remove(path);
+	if (rename(tempPath.Buffer(), path) != 0)
+	{
+		FBXSDK_printf("error: unable to replace cache file %s\n", path);
+		remove(tempPath.Buffer());
+		return false;
+	}
+	return true;
+}
+
+bool FbxLoader::Parser::LoadCache(const char* path)
+{
+	PhaseScope phase(*this, LoadStats::Cache);
+
+	Binary::MappedFile file;
+	if (!file.Open(path) || file.Size() < sizeof(CacheHeader))
+		return false;
+
+	CacheHeader header;
+	memcpy(&header, file.Data(), sizeof(CacheHeader));
+	if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion ||
+		header.headerSize != sizeof(CacheHeader) || header.fileSize != file.Size())
+		return false;
+	if (header.optionsHash != GetOptionsHash() || header.sourceHash != GetSourceHash())
+		return false;
+
+	CacheReader reader(file.Data(), file.Size(), sizeof(CacheHeader));
+
+	Skeleton cachedSkeleton;
+	std::vector<Mesh> cachedMeshes;
+	std::vector<Animation> cachedAnimations;
+	float cachedScaleFactor = 1.0f;
+	int cachedMaterialCount = 0;
+
+	reader.Read(cachedScaleFactor);
+	reader.Read(cachedMaterialCount);
+
+	uint32_t jointCount = 0;
+	reader.Read(jointCount);
+	for (uint32_t i = 0; i < jointCount && !reader.Failed(); i++)
+	{
+		Joint joint;
+		reader.ReadString(joint.jointName);
+		reader.Read(joint.currentIndex);
+		reader.Read(joint.parentIndex);
+		reader.Read(joint.globalMatrix);
+		reader.Read(joint.localMatrix);
+
+		cachedSkeleton.jointMap.emplace(joint.jointName.Buffer(), (int)cachedSkeleton.joints.size());
+		cachedSkeleton.joints.push_back(joint);
+	}
+
+	uint32_t meshCount = 0;
+	reader.Read(meshCount);
+	for (uint32_t i = 0; i < meshCount && !reader.Failed(); i++)
+	{
+		cachedMeshes.emplace_back();
+		if (!ReadMesh(reader, cachedMeshes.back()))
+			reader.Fail();
+	}
+
+	uint32_t animationCount = 0;
+	reader.Read(animationCount);
+	for (uint32_t i = 0; i < animationCount && !reader.Failed(); i++)
+	{
+		cachedAnimations.emplace_back();
+		if (!ReadAnimation(reader, cachedAnimations.back()))
+			reader.Fail();
+	}
+
+	if (reader.Failed())
+	{
+		FBXSDK_printf("error: cache file %s is truncated\n", path);
+		return false;
+	}
+
+	scaleFactor = cachedScaleFactor;
+	materialCount = cachedMaterialCount;
+	skeleton = std::move(cachedSkeleton);
+	animations = std::move(cachedAnimations);
+	if (meshSink)
+	{
+		for (Mesh& mesh : cachedMeshes)
+			meshSink(std::move(mesh));
+	}
+	else
+	{
+		meshes = std::move(cachedMeshes);
+	}
+	return true;
+}
@@ -1,37 +1,203 @@
 #include "FbxLoader.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <unordered_map>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 FbxLoader::Parser::Parser(FbxString fbxFile)
 {
 	this->fbxFile = fbxFile;
-	InitFbxObjects();
+}
+
+FbxLoader::Parser::Parser(FbxString fbxFile, FbxManager* manager)
+{
+	this->fbxFile = fbxFile;
+	pManager = manager;
+	ownsManager = false;
 }
 
 FbxLoader::Parser::~Parser()
 {
-	pManager->Destroy();
+	if (pScene)
+		pScene->Destroy();
+	if (pManager && ownsManager)
+		pManager->Destroy();
+}
+
+FbxLoader::WorkerPool::WorkerPool(int threadCount)
+{
+	if (threadCount <= 0)
+		threadCount = (int)std::thread::hardware_concurrency();
+	if (threadCount < 1)
+		threadCount = 1;
+
+	queues.reset(new Queue[threadCount]);
+	for (int worker = 0; worker < threadCount - 1; worker++)
+	{
+		threads.emplace_back(&WorkerPool::WorkerMain, this, worker);
+	}
+}
+
+FbxLoader::WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void FbxLoader::WorkerPool::Run(size_t jobCount, const std::function<void(size_t)>& _job)
+{
+	if (jobCount == 0)
+		return;
+
+	const size_t queueCount = (size_t)ThreadCount();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t worker = 0; worker < queueCount; worker++)
+		{
+			std::lock_guard<std::mutex> queueLock(queues[worker].mutex);
+			queues[worker].begin = jobCount * worker / queueCount;
+			queues[worker].end = jobCount * (worker + 1) / queueCount;
+		}
+		job = &_job;
+		failure = nullptr;
+		busy = (int)threads.size();
+		generation++;
+	}
+	wake.notify_all();
+
+	// The calling thread works on the last queue
+	Drain((int)queueCount - 1);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return busy == 0; });
+	job = nullptr;
+
+	if (failure)
+		std::rethrow_exception(failure);
+}
+
+void FbxLoader::WorkerPool::WorkerMain(int worker)
+{
+	unsigned long long seenGeneration = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+			if (stopping)
+				return;
+			seenGeneration = generation;
+		}
+
+		Drain(worker);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--busy == 0)
+			done.notify_all();
+	}
+}
+
+void FbxLoader::WorkerPool::Drain(int worker)
+{
+	size_t index;
+	while (Pop(worker, index) || Steal(worker, index))
+	{
+		try
+		{
+			(*job)(index);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!failure)
+				failure = std::current_exception();
+		}
+	}
+}
+
+bool FbxLoader::WorkerPool::Pop(int worker, size_t& index)
+{
+	Queue& queue = queues[worker];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.begin == queue.end)
+		return false;
+	index = queue.begin++;
+	return true;
+}
+
+bool FbxLoader::WorkerPool::Steal(int worker, size_t& index)
+{
+	const int queueCount = ThreadCount();
+	for (int offset = 1; offset < queueCount; offset++)
+	{
+		Queue& queue = queues[(worker + offset) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.begin == queue.end)
+			continue;
+		index = --queue.end;
+		return true;
+	}
+	return false;
+}
+
+FbxLoader::WorkerPool& FbxLoader::Parser::GetWorkerPool()
+{
+	if (!workerPool || (workerCount > 0 && workerPool->ThreadCount() != workerCount))
+		workerPool.reset(new WorkerPool(workerCount));
+	return *workerPool;
 }
 
 void FbxLoader::Parser::InitFbxObjects()
 {
 	// Create the FBX manager which is the object allocator for almost all the classes in the SDK
 	if (!pManager)
+	{
 		pManager = FbxManager::Create();
 
-	if (!pManager)
-	{
-		FBXSDK_printf("error: unable to create FBX manager!\n");
-		exit(1);
+		if (!pManager)
+		{
+			FBXSDK_printf("error: unable to create FBX manager!\n");
+			exit(1);
+		}
+		else
+		{
+			FBXSDK_printf("Autodesk FBX SDK version:%s\n", pManager->GetVersion());
+		}
 	}
-	else
+
+	// Create an IOSettings object. This object holds all import/export settings. A manager shared between parsers already has one
+	ios = pManager->GetIOSettings();
+	if (!ios)
 	{
-		FBXSDK_printf("Autodesk FBX SDK version:%s\n", pManager->GetVersion());
+		ios = FbxIOSettings::Create(pManager, IOSROOT);
+		pManager->SetIOSettings(ios);
 	}
 
-	// Create an IOSettings object. This object holds all import/export settings
-	ios = FbxIOSettings::Create(pManager, IOSROOT);
-	pManager->SetIOSettings(ios);
-
 	/* // NOTE(Eric): THIS IS FUCKED! This causes the manager to take forever during deletion.
 	//load plugins from the executable directory
 	FbxString path = FbxGetApplicationDirectory();
@@ -48,23 +214,68 @@ void FbxLoader::Parser::InitFbxObjects()
 	}
 }
 
-bool FbxLoader::Parser::LoadScene()
+FbxString FbxLoader::Parser::GetFullFbxFile() const
 {
-	FbxString fullFbxFile;
 	if (fbxFile.Find(".fbx") == -1)
 	{
-		fullFbxFile = fbxFile + ".fbx";
-	}
-	else 
-	{
-		fullFbxFile = fbxFile;
+		return fbxFile + ".fbx";
 	}
+	return fbxFile;
+}
+
+bool FbxLoader::Parser::LoadScene()
+{
+	FbxString fullFbxFile = GetFullFbxFile();
 	if (!FbxFileUtils::Exist(fullFbxFile))
 	{
 		return false;
 	}
+
+	BeginStats();
+	if (!cacheFile.IsEmpty() && !lazyAnimations && LoadCache(cacheFile.Buffer()))
+	{
+		EndStats();
+		return true;
+	}
+
+	// The SDK is only set up once the cache missed
+	InitFbxObjects();
 	assert(pManager != nullptr && pScene != nullptr);
 
+	bool status = ImportScene(fullFbxFile);
+
+	if (status)
+	{
+		GenerateTangents();
+		ConvertScene();
+		TriangulateScene();
+		IndexMaterials();
+
+		LoadSkeleton();
+		LoadMeshes();
+		LoadAnimations();
+
+		//skeleton.Print();
+
+		if (!cacheFile.IsEmpty() && !lazyAnimations && !meshSink)
+			SaveCache(cacheFile.Buffer());
+	}
+
+	// Lazily decoded clips still read from the scene
+	if (!status || !lazyAnimations)
+	{
+		pScene->Destroy();
+		pScene = nullptr;
+	}
+
+	EndStats();
+	return status;
+}
+
+bool FbxLoader::Parser::ImportScene(const FbxString& fullFbxFile)
+{
+	PhaseScope phase(*this, LoadStats::Import);
+
 	bool status = false;
 	FbxImporter *importer = FbxImporter::Create(pManager, "");
 
@@ -72,73 +283,248 @@ bool FbxLoader::Parser::LoadScene()
 	if (!imorterStatus) 
 	{
 		FBXSDK_printf("error: initialize importer failed\n");
-		return status;
 	}
-
-	if (!importer->IsFBX())
+	else if (!importer->IsFBX())
 	{
 		FBXSDK_printf("error: file is not a FBX file\n");
-		return status;
 	}
+	else
+	{
+		status = importer->Import(pScene);
+	}
+
+	importer->Destroy();
+	return status;
+}
+
+void FbxLoader::Parser::GenerateTangents()
+{
+	PhaseScope phase(*this, LoadStats::Tangents);
 
-	status = importer->Import(pScene);
+	if (!vertexLayout.Has(VertexAttribute::Tangent))
+		return;
 
-	if (status)
+	std::vector<FbxNode*> _meshes;
+	FindMeshes(pScene->GetRootNode(), _meshes);
+	
+	for (FbxNode* node : _meshes)
 	{
-		std::vector<FbxNode*> _meshes;
-		FindMeshes(pScene->GetRootNode(), _meshes);
+		FbxMesh* mesh = node->GetMesh();
+
 		
-		for (FbxNode* node : _meshes)
-		{
-			FbxMesh* mesh = node->GetMesh();
+		if (mesh->GetElementBinormalCount() == 0 || mesh->GetElementTangentCount() == 0)
+			mesh->GenerateTangentsDataForAllUVSets();
+	}
+}
 
-			
-			if (mesh->GetElementBinormalCount() == 0 || mesh->GetElementTangentCount() == 0)
-				mesh->GenerateTangentsDataForAllUVSets();
-		}
+void FbxLoader::Parser::ConvertScene()
+{
+	PhaseScope phase(*this, LoadStats::AxisConversion);
 
-		// Convert axis system
-		FbxAxisSystem sceneAxisSystem = pScene->GetGlobalSettings().GetAxisSystem();
-		FbxAxisSystem localAxisSystem(FbxAxisSystem::eDirectX);
-		//if (sceneAxisSystem != localAxisSystem)
-		{
-			localAxisSystem.DeepConvertScene(pScene);
-		}
+	// Convert axis system
+	FbxAxisSystem sceneAxisSystem = pScene->GetGlobalSettings().GetAxisSystem();
+	FbxAxisSystem localAxisSystem(FbxAxisSystem::eDirectX);
+	//if (sceneAxisSystem != localAxisSystem)
+	{
+		localAxisSystem.DeepConvertScene(pScene);
+	}
 
-		// Convert unit system
-		FbxSystemUnit sceneSystemUnit = pScene->GetGlobalSettings().GetSystemUnit();
-		/*
-		if (sceneSystemUnit.GetScaleFactor() != FbxSystemUnit::m.GetScaleFactor())
-		{
-			FbxSystemUnit::m.ConvertScene(pScene); // NOTE(Eric): This does not actually seem to work so we do it manually.
-		}
-		*/
-		scaleFactor = (float)FbxSystemUnit::m.GetConversionFactorFrom(sceneSystemUnit);
+	// Convert unit system
+	FbxSystemUnit sceneSystemUnit = pScene->GetGlobalSettings().GetSystemUnit();
+	/*
+	if (sceneSystemUnit.GetScaleFactor() != FbxSystemUnit::m.GetScaleFactor())
+	{
+		FbxSystemUnit::m.ConvertScene(pScene); // NOTE(Eric): This does not actually seem to work so we do it manually.
+	}
+	*/
+	scaleFactor = (float)FbxSystemUnit::m.GetConversionFactorFrom(sceneSystemUnit);
+}
 
-		// Convert mesh, NURBS and patch into triangle mesh
-		FbxGeometryConverter geomConverter(pManager);
-		if (!geomConverter.Triangulate(pScene, true, true)) // Attempt to use faster legacy triangulation algorithm
-			geomConverter.Triangulate(pScene, true, false);
+void FbxLoader::Parser::TriangulateScene()
+{
+	PhaseScope phase(*this, LoadStats::Triangulate);
 
-		
-		for (int i = 0; i < pScene->GetMaterialCount(); i++)
+	// Convert mesh, NURBS and patch into triangle mesh
+	FbxGeometryConverter geomConverter(pManager);
+	if (!geomConverter.Triangulate(pScene, true, true)) // Attempt to use faster legacy triangulation algorithm
+		geomConverter.Triangulate(pScene, true, false);
+}
+
+void FbxLoader::Parser::IndexMaterials()
+{
+	for (int i = 0; i < pScene->GetMaterialCount(); i++)
+	{
+		materialNameToIndexMap[pScene->GetMaterial(i)->GetName()] = i;
+	}
+}
+
+namespace
+{
+	double Milliseconds(std::chrono::steady_clock::duration duration)
+	{
+		return std::chrono::duration<double, std::milli>(duration).count();
+	}
+
+	double Microseconds(std::chrono::steady_clock::duration duration)
+	{
+		return std::chrono::duration<double, std::micro>(duration).count();
+	}
+
+	uint32_t CurrentThreadId()
+	{
+		return (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+	}
+
+	size_t PeakMemoryUsage()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters = {};
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return 0;
+		return counters.PeakWorkingSetSize;
+#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+			return 0;
+#ifdef __APPLE__
+		return (size_t)usage.ru_maxrss; // Bytes on macOS, kilobytes elsewhere
+#else
+		return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+	}
+
+	void WriteJsonString(FILE* file, const char* text)
+	{
+		fputc('"', file);
+		for (const char* c = text; *c; c++)
 		{
-			materialNameToIndexMap[pScene->GetMaterial(i)->GetName()] = i;
+			if (*c == '"' || *c == '\\')
+				fprintf(file, "\\%c", *c);
+			else if ((unsigned char)*c < 0x20)
+				fprintf(file, "\\u%04x", (unsigned char)*c);
+			else
+				fputc(*c, file);
 		}
+		fputc('"', file);
+	}
+}
 
-		LoadSkeleton();
-		LoadMeshes();
-		LoadAnimations();
+const char* FbxLoader::LoadStats::PhaseName(Phase phase)
+{
+	static const char* names[PhaseCount] =
+	{
+		"Cache",
+		"Import",
+		"Tangents",
+		"AxisConversion",
+		"Triangulate",
+		"Skeleton",
+		"MeshRead",
+		"MeshBuild",
+		"MaterialSplit",
+		"Optimize",
+		"Lods",
+		"Meshlets",
+		"Pack",
+		"Animations",
+	};
+	return phase < PhaseCount ? names[phase] : "";
+}
 
-		//skeleton.Print();
+bool FbxLoader::LoadStats::WriteTrace(const char* path) const
+{
+	FILE* file = fopen(path, "w");
+	if (!file)
+	{
+		FBXSDK_printf("error: unable to write trace %s\n", path);
+		return false;
 	}
 
-	pScene->Destroy();
-	importer->Destroy();
-
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		fprintf(file, "{\"name\":");
+		WriteJsonString(file, events[i].name.c_str());
+		fprintf(file, ",\"cat\":\"FbxLoader\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+			events[i].thread, events[i].start, events[i].duration, i + 1 < events.size() ? "," : "");
+	}
+	fprintf(file, "],\n\"displayTimeUnit\":\"ms\",\n\"otherData\":{");
+	fprintf(file, "\"totalMilliseconds\":%.3f,\"meshCount\":%zu,\"polygonCount\":%zu,\"rawVertexCount\":%zu,\"weldedVertexCount\":%zu,"
+		"\"indexCount\":%zu,\"hashProbes\":%zu,\"jointCount\":%zu,\"animationCount\":%zu,\"frameCount\":%zu,\"peakMemory\":%zu,"
+		"\"acmrBefore\":%.4f,\"acmrAfter\":%.4f,\"atvrBefore\":%.4f,\"atvrAfter\":%.4f,\"lodCount\":%zu,\"lodTriangles\":%zu,\"meshletCount\":%zu",
+		totalMilliseconds, meshCount, polygonCount, rawVertexCount, weldedVertexCount, indexCount, hashProbes, jointCount, animationCount, frameCount, peakMemory,
+		acmrBefore, acmrAfter, atvrBefore, atvrAfter, lodCount, lodTriangles, meshletCount);
+	fprintf(file, "}}\n");
+
+	const bool status = ferror(file) == 0;
+	fclose(file);
 	return status;
 }
 
+void FbxLoader::Parser::BeginStats()
+{
+	activeStats = nullptr;
+	if (!collectStats && traceFile.IsEmpty())
+		return;
+
+	stats = LoadStats();
+	statsStart = std::chrono::steady_clock::now();
+	activeStats = &stats;
+}
+
+void FbxLoader::Parser::EndStats()
+{
+	if (!activeStats)
+		return;
+
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	stats.totalMilliseconds = Milliseconds(end - statsStart);
+	stats.meshCount = meshes.size();
+	for (const Mesh& mesh : meshes)
+		stats.indexCount += mesh.indices.size();
+	stats.jointCount = skeleton.joints.size();
+	stats.animationCount = animations.size();
+	for (const Animation& animation : animations)
+		stats.frameCount += (size_t)animation.frameCount;
+	stats.peakMemory = PeakMemoryUsage();
+	if (stats.optimizedTriangles > 0)
+	{
+		stats.acmrBefore = (float)stats.cacheMissesBefore / (float)stats.optimizedTriangles;
+		stats.acmrAfter = (float)stats.cacheMissesAfter / (float)stats.optimizedTriangles;
+		stats.atvrBefore = (float)stats.cacheMissesBefore / (float)stats.optimizedVertices;
+		stats.atvrAfter = (float)stats.cacheMissesAfter / (float)stats.optimizedVertices;
+	}
+
+	if (!traceFile.IsEmpty())
+	{
+		stats.events.push_back(LoadStats::Event{ fbxFile.Buffer(), CurrentThreadId(), 0.0, Microseconds(end - statsStart) });
+		stats.WriteTrace(traceFile.Buffer());
+	}
+	activeStats = nullptr;
+}
+
+void FbxLoader::Parser::RecordPhase(LoadStats::Phase phase, std::chrono::steady_clock::time_point start) const
+{
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	activeStats->phaseMilliseconds[phase] += Milliseconds(end - start);
+	if (!traceFile.IsEmpty())
+		activeStats->events.push_back(LoadStats::Event{ LoadStats::PhaseName(phase), CurrentThreadId(), Microseconds(start - statsStart), Microseconds(end - start) });
+}
+
+void FbxLoader::Parser::RecordEvent(const char* name, std::chrono::steady_clock::time_point start) const
+{
+	if (!activeStats || traceFile.IsEmpty())
+		return;
+
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(statsMutex);
+	activeStats->events.push_back(LoadStats::Event{ name, CurrentThreadId(), Microseconds(start - statsStart), Microseconds(end - start) });
+}
+
 FbxNode* FbxLoader::Parser::FindMesh(FbxNode* _node)
 {
 	if (_node->GetNodeAttribute() && _node->GetNodeAttribute()->GetAttributeType() == FbxNodeAttribute::eMesh) {
@@ -162,355 +548,558 @@ void FbxLoader::Parser::FindMeshes(FbxNode* node, std::vector<FbxNode*>& _meshes
 	}
 }
 
-FbxVector4 ReadNormal(FbxMesh* mesh, int vertexIndex, int vertexCounter)
+namespace
 {
-	if (mesh->GetElementNormalCount() < 1) { return FbxVector4(0, 0, 0, 0); }
+	const uint64_t hashSecret[4] = { 0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL };
+	const uint64_t hashSecretStep[4] = { 0x9E3779B97F4A7C15ULL, 0xD6E8FEB86659FD93ULL, 0xA0761D6478BD642FULL, 0xE7037ED1A0B428DBULL };
 
-	FbxGeometryElementNormal* element = mesh->GetElementNormal(0);
-
-	FbxVector4 normal = {};
-	switch (element->GetMappingMode())
+	inline uint64_t RotateLeft(uint64_t value, int bits)
 	{
-	case FbxGeometryElement::eByControlPoint:
-		switch (element->GetReferenceMode())
-		{
-		case FbxGeometryElement::eDirect:
-		{
-			normal = element->GetDirectArray().GetAt(vertexIndex);
-		}
-		break;
+		return (value << bits) | (value >> (64 - bits));
+	}
+}
 
-		case FbxGeometryElement::eIndexToDirect:
-		{
-			int index = element->GetIndexArray().GetAt(vertexIndex);
-			normal = element->GetDirectArray().GetAt(index);
-		}
-		break;
-		default:
-			throw std::exception("Invalid Reference");
-		}
-		break;
-	case FbxGeometryElement::eByPolygonVertex:
-		switch (element->GetReferenceMode())
-		{
-		case FbxGeometryElement::eDirect:
+// Each lane only needs a 32x32->64 bit multiply, so it maps directly onto SSE2/AVX2 registers. The secret a stripe of
+// four words is keyed with moves on by hashSecretStep every stripe, so the same words at other positions hash differently.
+uint64_t FbxLoader::HashWords(const uint64_t* words, size_t wordCount)
+{
+	uint64_t acc[4] = { 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL };
+
+#if defined(__AVX2__)
+	__m256i vacc = _mm256_loadu_si256((const __m256i*)acc);
+	__m256i vsecret = _mm256_loadu_si256((const __m256i*)hashSecret);
+	const __m256i vstep = _mm256_loadu_si256((const __m256i*)hashSecretStep);
+	for (size_t i = 0; i < wordCount; i += 4)
+	{
+		__m256i data = _mm256_loadu_si256((const __m256i*)(words + i));
+		__m256i keyed = _mm256_xor_si256(data, vsecret);
+		__m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+		vacc = _mm256_add_epi64(vacc, _mm256_add_epi64(product, data));
+		vsecret = _mm256_add_epi64(vsecret, vstep);
+	}
+	_mm256_storeu_si256((__m256i*)acc, vacc);
+#elif defined(__SSE2__) || defined(_M_X64)
+	__m128i vacc[2] = { _mm_loadu_si128((const __m128i*)acc), _mm_loadu_si128((const __m128i*)(acc + 2)) };
+	__m128i vsecret[2] = { _mm_loadu_si128((const __m128i*)hashSecret), _mm_loadu_si128((const __m128i*)(hashSecret + 2)) };
+	const __m128i vstep[2] = { _mm_loadu_si128((const __m128i*)hashSecretStep), _mm_loadu_si128((const __m128i*)(hashSecretStep + 2)) };
+	for (size_t i = 0; i < wordCount; i += 4)
+	{
+		for (int half = 0; half < 2; half++)
 		{
-			normal = element->GetDirectArray().GetAt(vertexCounter);
+			__m128i data = _mm_loadu_si128((const __m128i*)(words + i + half * 2));
+			__m128i keyed = _mm_xor_si128(data, vsecret[half]);
+			__m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+			vacc[half] = _mm_add_epi64(vacc[half], _mm_add_epi64(product, data));
+			vsecret[half] = _mm_add_epi64(vsecret[half], vstep[half]);
 		}
-		break;
-		case FbxGeometryElement::eIndexToDirect:
+	}
+	_mm_storeu_si128((__m128i*)acc, vacc[0]);
+	_mm_storeu_si128((__m128i*)(acc + 2), vacc[1]);
+#else
+	uint64_t secret[4] = { hashSecret[0], hashSecret[1], hashSecret[2], hashSecret[3] };
+	for (size_t i = 0; i < wordCount; i += 4)
+	{
+		for (int lane = 0; lane < 4; lane++)
 		{
-			int index = element->GetIndexArray().GetAt(vertexCounter);
-			normal = element->GetDirectArray().GetAt(index);
-		}
-		break;
-		default: throw std::exception("Invalid Reference");
+			uint64_t keyed = words[i + lane] ^ secret[lane];
+			acc[lane] += (keyed & 0xFFFFFFFFULL) * (keyed >> 32) + words[i + lane];
+			secret[lane] += hashSecretStep[lane];
 		}
-
-		break;
 	}
+#endif
+
+	uint64_t hash = acc[0] ^ RotateLeft(acc[1], 17) ^ RotateLeft(acc[2], 31) ^ RotateLeft(acc[3], 47);
+	hash ^= hash >> 37;
+	hash *= 0x165667919E3779F9ULL;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+FbxLoader::VertexWelder::VertexWelder(std::vector<Mesh::VertexData>& _vertices, size_t expectedCount, double _epsilon,
+	std::vector<Mesh::ExtraJoints>* _extraJoints) :
+	vertices(_vertices),
+	extraJoints(_extraJoints),
+	keyWords(_extraJoints ? KeyWords : InlineKeyWords),
+	epsilon(_epsilon)
+{
+	Reserve(expectedCount);
+}
+
+void FbxLoader::VertexWelder::Reserve(size_t expectedCount)
+{
+	size_t capacity = 16;
+	while (capacity < expectedCount * 2)
+		capacity *= 2;
+
+	if (capacity > slots.size())
+		Rehash(capacity);
+}
 
-	return normal;
+void FbxLoader::VertexWelder::Clear()
+{
+	std::fill(slots.begin(), slots.end(), Slot{ 0, 0 });
+	used = 0;
 }
-FbxVector4 ReadBinormal(FbxMesh* mesh, int vertexIndex, int vertexCounter)
+
+void FbxLoader::VertexWelder::Rehash(size_t capacity)
 {
-	if (mesh->GetElementBinormalCount() < 1) { return FbxVector4(0, 0, 0, 0); }
+	std::vector<Slot> oldSlots(capacity, Slot{ 0, 0 });
+	oldSlots.swap(slots);
+
+	const size_t mask = slots.size() - 1;
+	for (const Slot& slot : oldSlots)
+	{
+		if (slot.index == 0)
+			continue;
 
-	FbxGeometryElementBinormal* element = mesh->GetElementBinormal(0);
+		size_t position = slot.hash & mask;
+		while (slots[position].index != 0)
+			position = (position + 1) & mask;
+		slots[position] = slot;
+	}
+}
 
-	FbxVector4 binormal = {};
-	switch (element->GetMappingMode())
+void FbxLoader::VertexWelder::BuildKey(const Mesh::VertexData& vertex, const Mesh::ExtraJoints* extra, uint64_t* key) const
+{
+	const double attributes[19] = {
+		vertex.position[0], vertex.position[1], vertex.position[2],
+		vertex.normal[0], vertex.normal[1], vertex.normal[2],
+		vertex.binormal[0], vertex.binormal[1], vertex.binormal[2],
+		vertex.tangent[0], vertex.tangent[1], vertex.tangent[2], vertex.tangent[3],
+		vertex.uv[0], vertex.uv[1],
+		vertex.color.mRed, vertex.color.mGreen, vertex.color.mBlue, vertex.color.mAlpha
+	};
+
+	int word = 0;
+	for (double attribute : attributes)
 	{
-	case FbxGeometryElement::eByControlPoint:
-		switch (element->GetReferenceMode())
+		if (epsilon > 0.0)
 		{
-		case FbxGeometryElement::eDirect:
+			key[word++] = (uint64_t)(int64_t)llround(attribute / epsilon);
+		}
+		else
 		{
-			binormal = element->GetDirectArray().GetAt(vertexIndex);
+			double value = attribute + 0.0; // -0.0 and 0.0 compare equal, make them hash equal too
+			memcpy(&key[word++], &value, sizeof(double));
 		}
-		break;
+	}
 
-		case FbxGeometryElement::eIndexToDirect:
+	auto addJoints = [&](const unsigned int* indices, const float* weights, int count)
+	{
+		for (int bone = 0; bone < count; bone += 2)
 		{
-			int index = element->GetIndexArray().GetAt(vertexIndex);
-			binormal = element->GetDirectArray().GetAt(index);
+			uint64_t high = bone + 1 < count ? indices[bone + 1] : 0;
+			key[word++] = (high << 32) | indices[bone];
 		}
-		break;
-		default:
-			throw std::exception("Invalid Reference");
-		}
-		break;
-	case FbxGeometryElement::eByPolygonVertex:
-		switch (element->GetReferenceMode())
-		{
-		case FbxGeometryElement::eDirect:
-		{
-			binormal = element->GetDirectArray().GetAt(vertexCounter);
-		}
-		break;
-		case FbxGeometryElement::eIndexToDirect:
-		{
-			int index = element->GetIndexArray().GetAt(vertexCounter);
-			binormal = element->GetDirectArray().GetAt(index);
-		}
-		break;
-		default: throw std::exception("Invalid Reference");
+		for (int bone = 0; bone < count; bone += 2)
+		{
+			uint32_t low, high = 0;
+			memcpy(&low, &weights[bone], sizeof(float));
+			if (bone + 1 < count)
+				memcpy(&high, &weights[bone + 1], sizeof(float));
+			key[word++] = ((uint64_t)high << 32) | low;
 		}
+	};
 
-		break;
-	}
+	key[word++] = ((uint64_t)(uint32_t)vertex.materialIndex << 32) | (uint32_t)vertex.jointCount;
+	addJoints(vertex.jointIndices, vertex.jointWeights, InlineVertexBones);
+	while (word < InlineKeyWords)
+		key[word++] = 0;
 
-	return binormal;
+	if (extraJoints)
+	{
+		const Mesh::ExtraJoints none;
+		const Mesh::ExtraJoints& joints = extra ? *extra : none;
+		addJoints(joints.jointIndices, joints.jointWeights, MaxVertexBones - InlineVertexBones);
+		while (word < KeyWords)
+			key[word++] = 0;
+	}
 }
-FbxVector4 ReadTangent(FbxMesh* mesh, int vertexIndex, int vertexCounter)
+
+size_t FbxLoader::VertexWelder::Weld(const Mesh::VertexData& vertex, const Mesh::ExtraJoints* extra)
 {
-	if (mesh->GetElementTangentCount() < 1) { return FbxVector4(0, 0, 0, 0); }
+	uint64_t key[KeyWords];
+	BuildKey(vertex, extra, key);
+	const uint32_t hash = (uint32_t)HashWords(key, keyWords);
 
-	FbxGeometryElementTangent* element = mesh->GetElementTangent(0);
+	if ((used + 1) * 2 > slots.size())
+		Rehash(slots.size() * 2);
 
-	FbxVector4 tangent = {};
-	switch (element->GetMappingMode())
+	const size_t mask = slots.size() - 1;
+	for (size_t position = hash & mask;; position = (position + 1) & mask)
 	{
-	case FbxGeometryElement::eByControlPoint:
-		switch (element->GetReferenceMode())
+		probeCount++;
+		Slot& slot = slots[position];
+		if (slot.index == 0)
 		{
-		case FbxGeometryElement::eDirect:
-		{
-			tangent = element->GetDirectArray().GetAt(vertexIndex);
+			slot.hash = hash;
+			slot.index = (uint32_t)vertices.size() + 1;
+			used++;
+			vertices.push_back(vertex);
+			if (extraJoints)
+				extraJoints->push_back(extra ? *extra : Mesh::ExtraJoints());
+			return vertices.size() - 1;
 		}
-		break;
 
-		case FbxGeometryElement::eIndexToDirect:
-		{
-			int index = element->GetIndexArray().GetAt(vertexIndex);
-			tangent = element->GetDirectArray().GetAt(index);
-		}
-		break;
-		default:
-			throw std::exception("Invalid Reference");
-		}
-		break;
-	case FbxGeometryElement::eByPolygonVertex:
-		switch (element->GetReferenceMode())
+		if (slot.hash == hash)
 		{
-		case FbxGeometryElement::eDirect:
-		{
-			tangent = element->GetDirectArray().GetAt(vertexCounter);
-		}
-		break;
-		case FbxGeometryElement::eIndexToDirect:
-		{
-			int index = element->GetIndexArray().GetAt(vertexCounter);
-			tangent = element->GetDirectArray().GetAt(index);
+			uint64_t candidate[KeyWords];
+			BuildKey(vertices[slot.index - 1], extraJoints ? &(*extraJoints)[slot.index - 1] : nullptr, candidate);
+			if (memcmp(key, candidate, keyWords * sizeof(uint64_t)) == 0)
+				return slot.index - 1;
 		}
-		break;
-		default: throw std::exception("Invalid Reference");
-		}
-		break;
 	}
+}
 
-	return tangent;
+FbxLoader::ScratchArena::ScratchArena(size_t _blockSize) :
+	blockSize(_blockSize)
+{
 }
-FbxVector2 ReadUV(FbxMesh* mesh, int vertexIndex, int vertexCounter)
+
+void* FbxLoader::ScratchArena::AllocateBytes(size_t size, size_t alignment)
 {
-	if (mesh->GetElementUVCount() < 1) { return FbxVector2(0, 0); }
+	size_t offset = 0;
+	if (!blocks.empty())
+	{
+		const uintptr_t address = (uintptr_t)blocks.back().get() + used;
+		offset = used + ((alignment - address % alignment) % alignment);
+	}
 
-	FbxGeometryElementUV* element = mesh->GetElementUV(0);
+	if (blocks.empty() || offset + size > capacity)
+	{
+		capacity = std::max(blockSize, size + alignment);
+		blocks.emplace_back(new char[capacity]);
+		const uintptr_t address = (uintptr_t)blocks.back().get();
+		offset = (alignment - address % alignment) % alignment;
+		used = 0;
+	}
+
+	allocated += size + alignment; // Enough for the same allocations in one block, whatever their padding there
+	used = offset + size;
+	return blocks.back().get() + offset;
+}
 
-	FbxVector2 uv = {};
-	switch (element->GetMappingMode())
+void FbxLoader::ScratchArena::Reset()
+{
+	if (blocks.size() > 1)
 	{
-	case FbxGeometryElement::eByControlPoint:
-		switch (element->GetReferenceMode())
-		{
-		case FbxGeometryElement::eDirect:
-		{
-			uv = element->GetDirectArray().GetAt(vertexIndex);
-		}
-		break;
+		blocks.clear();
+		blockSize = std::max(blockSize, allocated);
+		capacity = blockSize;
+		blocks.emplace_back(new char[capacity]);
+	}
+	used = 0;
+	allocated = 0;
+}
 
-		case FbxGeometryElement::eIndexToDirect:
+// Copy a whole layer element array out of the SDK through its locked buffer instead of element by element
+template<class T>
+void CopyLayerArray(const FbxLayerElementArrayTemplate<T>& array, std::vector<T>& out)
+{
+	FbxLayerElementArrayTemplate<T>& lockable = const_cast<FbxLayerElementArrayTemplate<T>&>(array);
+	const int count = array.GetCount();
+	T* data = count > 0 ? lockable.GetLocked(FbxLayerElementArray::eReadLock) : nullptr;
+	if (data)
+	{
+		out.assign(data, data + count);
+		lockable.Release(&data);
+	}
+	else
+	{
+		out.resize(count);
+		for (int i = 0; i < count; i++)
+			out[i] = array.GetAt(i);
+	}
+}
+
+template<class T>
+void ReadLayer(const FbxLayerElementTemplate<T>* element, FbxLoader::MeshSource::Layer<T>& layer)
+{
+	layer.mappingMode = element->GetMappingMode();
+	layer.referenceMode = element->GetReferenceMode();
+
+	CopyLayerArray(element->GetDirectArray(), layer.directArray);
+	if (layer.referenceMode != FbxGeometryElement::eDirect)
+		CopyLayerArray(element->GetIndexArray(), layer.indexArray);
+}
+
+// One value per polygon-vertex, directArray[index(i)] or directArray[indexArray[index(i)]]. References out of range
+// decode to T() instead of reading past the arrays.
+template<class T, class Index>
+void GatherLayer(const FbxLoader::MeshSource::Layer<T>& layer, size_t count, Index index, std::vector<T>& out)
+{
+	const T* values = layer.directArray.data();
+	const size_t valueCount = layer.directArray.size();
+	out.resize(count);
+
+	if (layer.referenceMode == FbxGeometryElement::eDirect)
+	{
+		for (size_t i = 0; i < count; i++)
 		{
-			int index = element->GetIndexArray().GetAt(vertexIndex);
-			uv = element->GetDirectArray().GetAt(index);
+			const size_t at = (size_t)index(i);
+			out[i] = at < valueCount ? values[at] : T();
 		}
-		break;
-		default:
-			throw std::exception("Invalid Reference");
+	}
+	else
+	{
+		const int* references = layer.indexArray.data();
+		const size_t referenceCount = layer.indexArray.size();
+		for (size_t i = 0; i < count; i++)
+		{
+			const size_t reference = (size_t)index(i);
+			const size_t at = reference < referenceCount ? (size_t)(unsigned int)references[reference] : valueCount;
+			out[i] = at < valueCount ? values[at] : T();
 		}
+	}
+}
+
+// Expand a raw layer into one value per polygon-vertex. The mapping and reference modes are resolved once per layer,
+// each combination is a plain gather loop and direct per polygon-vertex layers are a straight copy.
+template<class T>
+void DecodeLayer(FbxLoader::MeshSource::Layer<T>& layer, const std::vector<int>& polygonVertices, std::vector<T>& out)
+{
+	if (layer.mappingMode == FbxGeometryElement::eNone)
+		return;
+	if (layer.referenceMode != FbxGeometryElement::eDirect && layer.referenceMode != FbxGeometryElement::eIndexToDirect)
+		throw std::exception("Invalid Reference");
+
+	const size_t count = polygonVertices.size();
+	switch (layer.mappingMode)
+	{
+	case FbxGeometryElement::eByControlPoint:
+		GatherLayer(layer, count, [&polygonVertices](size_t i) { return (unsigned int)polygonVertices[i]; }, out);
 		break;
 	case FbxGeometryElement::eByPolygonVertex:
-		switch (element->GetReferenceMode())
-		{
-		case FbxGeometryElement::eDirect:
-		{
-			uv = element->GetDirectArray().GetAt(vertexCounter);
-		}
+		if (layer.referenceMode == FbxGeometryElement::eDirect && layer.directArray.size() >= count)
+			out.assign(layer.directArray.begin(), layer.directArray.begin() + count);
+		else
+			GatherLayer(layer, count, [](size_t i) { return i; }, out);
 		break;
-		case FbxGeometryElement::eIndexToDirect:
-		{
-			int index = element->GetIndexArray().GetAt(vertexCounter);
-			uv = element->GetDirectArray().GetAt(index);
-		}
+	case FbxGeometryElement::eByPolygon:
+		GatherLayer(layer, count, [](size_t i) { return i / 3; }, out);
 		break;
-		default: throw std::exception("Invalid Reference");
-		}
+	case FbxGeometryElement::eAllSame:
+	{
+		std::vector<T> first;
+		GatherLayer(layer, 1, [](size_t) { return 0; }, first);
+		out.assign(count, first[0]);
+		break;
+	}
+	default:
+		out.assign(count, T());
 		break;
 	}
 
-#if FLIP_UV_Y
-	uv.mData[1] = 1.0f - uv.mData[1];
-#endif
-
-	return uv;
+	layer = FbxLoader::MeshSource::Layer<T>();
 }
-FbxColor ReadVertexColor(FbxMesh* mesh, int vertexIndex, int vertexCounter)
-{
-	if (mesh->GetElementVertexColorCount() < 1) { return FbxColor(1, 1, 1, 1); }
 
-	FbxGeometryElementVertexColor* element = mesh->GetElementVertexColor(0);
-
-	FbxColor color = {};
-	switch (element->GetMappingMode())
+namespace
+{
+	// result = x * rows[0] + y * rows[1] + z * rows[2] + rows[3], the FbxAMatrix layout with the translation in the last row.
+	// Points pass the translation row, directions a zero row; the w of every vector is kept as it was.
+	void TransformVectors(const double (&rows)[4][4], FbxVector4* vectors, size_t count)
 	{
-	case FbxGeometryElement::eByControlPoint:
-		switch (element->GetReferenceMode())
-		{
-		case FbxGeometryElement::eDirect:
+#if defined(__AVX2__)
+		const __m256d row0 = _mm256_loadu_pd(rows[0]), row1 = _mm256_loadu_pd(rows[1]), row2 = _mm256_loadu_pd(rows[2]), row3 = _mm256_loadu_pd(rows[3]);
+		for (size_t i = 0; i < count; i++)
 		{
-			color = element->GetDirectArray().GetAt(vertexIndex);
+			double* vector = vectors[i].mData;
+			const double w = vector[3];
+			__m256d result = _mm256_add_pd(_mm256_mul_pd(row0, _mm256_set1_pd(vector[0])), row3);
+			result = _mm256_add_pd(result, _mm256_mul_pd(row1, _mm256_set1_pd(vector[1])));
+			result = _mm256_add_pd(result, _mm256_mul_pd(row2, _mm256_set1_pd(vector[2])));
+			_mm256_storeu_pd(vector, result);
+			vector[3] = w;
 		}
-		break;
-
-		case FbxGeometryElement::eIndexToDirect:
+#elif defined(__SSE2__) || defined(_M_X64)
+		const __m128d row0 = _mm_loadu_pd(rows[0]), row1 = _mm_loadu_pd(rows[1]), row2 = _mm_loadu_pd(rows[2]), row3 = _mm_loadu_pd(rows[3]);
+		for (size_t i = 0; i < count; i++)
 		{
-			int index = element->GetIndexArray().GetAt(vertexIndex);
-			color = element->GetDirectArray().GetAt(index);
-		}
-		break;
-		default:
-			throw std::exception("Invalid Reference");
+			double* vector = vectors[i].mData;
+			__m128d result = _mm_add_pd(_mm_mul_pd(row0, _mm_set1_pd(vector[0])), row3);
+			result = _mm_add_pd(result, _mm_mul_pd(row1, _mm_set1_pd(vector[1])));
+			result = _mm_add_pd(result, _mm_mul_pd(row2, _mm_set1_pd(vector[2])));
+			vector[2] = vector[0] * rows[0][2] + vector[1] * rows[1][2] + vector[2] * rows[2][2] + rows[3][2];
+			_mm_storeu_pd(vector, result);
 		}
-		break;
-	case FbxGeometryElement::eByPolygonVertex:
-		switch (element->GetReferenceMode())
+#else
+		for (size_t i = 0; i < count; i++)
 		{
-		case FbxGeometryElement::eDirect:
-		{
-			color = element->GetDirectArray().GetAt(vertexCounter);
+			double* vector = vectors[i].mData;
+			const double x = vector[0], y = vector[1], z = vector[2];
+			for (int col = 0; col < 3; col++)
+				vector[col] = x * rows[0][col] + y * rows[1][col] + z * rows[2][col] + rows[3][col];
 		}
-		break;
-		case FbxGeometryElement::eIndexToDirect:
+#endif
+	}
+
+	void NormalizeDirections(std::vector<FbxVector4>& directions)
+	{
+		for (FbxVector4& direction : directions)
 		{
-			int index = element->GetIndexArray().GetAt(vertexCounter);
-			color = element->GetDirectArray().GetAt(index);
-		}
-		break;
-		default: throw std::exception("Invalid Reference");
+			double* vector = direction.mData;
+			const double length = sqrt(vector[0] * vector[0] + vector[1] * vector[1] + vector[2] * vector[2]);
+			if (length > 0.0)
+			{
+				vector[0] /= length;
+				vector[1] /= length;
+				vector[2] /= length;
+			}
 		}
-		break;
 	}
 
-	return color;
+	void CrossRows(const double* a, const double* b, double sign, double* out)
+	{
+		out[0] = (a[1] * b[2] - a[2] * b[1]) * sign;
+		out[1] = (a[2] * b[0] - a[0] * b[2]) * sign;
+		out[2] = (a[0] * b[1] - a[1] * b[0]) * sign;
+		out[3] = 0.0;
+	}
 }
-int ReadMaterial(FbxMesh* mesh, int polygon)
-{
-	if (mesh->GetElementMaterialCount() < 1) { return 0; }
 
-	//FbxGeometryElementMaterial* element = mesh->GetElementMaterial(0);
+// Bake transform into the geometry once per mesh instead of once per polygon-vertex. Points get the full matrix times
+// scaleFactor, tangents and binormals its 3x3 part and normals the inverse transpose of it, so they stay perpendicular
+// to the surface under non uniform scale. The cofactor matrix is used for the latter, scaled by the sign of the
+// determinant; the directions are renormalized afterwards anyway.
+void FbxLoader::MeshSource::ApplyTransform(double scaleFactor)
+{
+	double rows[4][4];
+	for (int row = 0; row < 4; row++)
+	{
+		for (int col = 0; col < 3; col++)
+			rows[row][col] = transform.Get(row, col) * scaleFactor;
+		rows[row][3] = 0.0;
+	}
+	TransformVectors(rows, controlPoints.data(), controlPoints.size());
 
-	FbxLayerElementArrayTemplate<int>* materialArray;
-	mesh->GetMaterialIndices(&materialArray);
+	bool identity = true;
+	for (int row = 0; row < 3; row++)
+	{
+		for (int col = 0; col < 4; col++)
+		{
+			rows[row][col] = col < 3 ? transform.Get(row, col) : 0.0;
+			identity = identity && fabs(rows[row][col] - (row == col ? 1.0 : 0.0)) < 1e-12;
+		}
+		rows[3][row] = 0.0;
+	}
+	rows[3][3] = 0.0;
+	if (identity)
+		return;
 
-	int material = materialArray->GetAt(polygon);
+	TransformVectors(rows, tangents.data(), tangents.size());
+	TransformVectors(rows, binormals.data(), binormals.size());
+	NormalizeDirections(tangents);
+	NormalizeDirections(binormals);
 
-	return material;
+	if (!normals.empty())
+	{
+		double cofactors[4][4] = {};
+		const double determinant = rows[0][0] * (rows[1][1] * rows[2][2] - rows[1][2] * rows[2][1])
+			- rows[0][1] * (rows[1][0] * rows[2][2] - rows[1][2] * rows[2][0])
+			+ rows[0][2] * (rows[1][0] * rows[2][1] - rows[1][1] * rows[2][0]);
+		const double sign = determinant < 0.0 ? -1.0 : 1.0;
+		CrossRows(rows[1], rows[2], sign, cofactors[0]);
+		CrossRows(rows[2], rows[0], sign, cofactors[1]);
+		CrossRows(rows[0], rows[1], sign, cofactors[2]);
+		TransformVectors(cofactors, normals.data(), normals.size());
+		NormalizeDirections(normals);
+	}
 }
 
-FbxVector4 TransformFbxVector4(const FbxAMatrix& matrix, const FbxVector4& vector)
+void FbxLoader::MeshSource::DecodeLayers(bool flipUVY)
 {
-	// Extract the matrix components
-	FbxVector4 translation = matrix.GetT();
-	FbxVector4 rotation = matrix.GetR();
-	FbxVector4 scaling = matrix.GetS();
-
-	// Convert rotation to radians as FbxVector4 assumes degrees
-	//double pi = 3.14159265358979323846;
-	//FbxVector4 rotationRadians(rotation[0] * pi / 180.0, rotation[1] * pi / 180.0, rotation[2] * pi / 180.0);
-
-	// Create rotation matrices
-	FbxAMatrix rotationMatrix;
-	rotationMatrix.SetR(rotation);
+	DecodeLayer(normalLayer, polygonVertices, normals);
+	DecodeLayer(binormalLayer, polygonVertices, binormals);
+	DecodeLayer(tangentLayer, polygonVertices, tangents);
+	DecodeLayer(uvLayer, polygonVertices, uvs);
+	DecodeLayer(colorLayer, polygonVertices, colors);
 
-	// Create scaling matrix
-	FbxAMatrix scalingMatrix;
-	scalingMatrix.SetS(scaling);
-
-	// Apply rotation and scaling
-	FbxVector4 transformedVector = scalingMatrix.MultT(rotationMatrix.MultT(vector));
+	if (flipUVY)
+	{
+		for (FbxVector2& uv : uvs)
+			uv.mData[1] = 1.0f - uv.mData[1];
+	}
 
-	// Apply translation
-	transformedVector += translation;
+	// Decoded like the other layers, so any mapping works and slots past the end of a short array are 0. The
+	// triangle takes the slot of its first corner.
+	if (materialLayer.mappingMode != FbxGeometryElement::eNone && !materialLayer.directArray.empty())
+	{
+		std::vector<int> cornerMaterials;
+		DecodeLayer(materialLayer, polygonVertices, cornerMaterials);
 
-	return transformedVector;
+		materials.resize(polygonVertices.size() / 3);
+		for (size_t polygon = 0; polygon < materials.size(); polygon++)
+		{
+			int material = cornerMaterials[polygon * 3];
+			if (material >= 0 && material < (int)materialRemap.size())
+				material = materialRemap[material];
+			materials[polygon] = material;
+		}
+	}
+	materialLayer = Layer<int>();
+	materialRemap.clear();
 }
 
-void FbxLoader::Parser::LoadMesh(FbxNode* node)
+bool FbxLoader::Parser::ReadMeshSource(FbxNode* node, MeshSource& source)
 {
 	FbxMesh *mesh = node->GetMesh();
 	if (!mesh) {
-		return;
+		return false;
 	}
 
-	FbxAMatrix transform = node->EvaluateGlobalTransform();
+	source.transform = node->EvaluateGlobalTransform();
 
-	FbxLoader::Mesh result = {};
+	const FbxVector4* controlPoints = mesh->GetControlPoints();
+	if (controlPoints)
+		source.controlPoints.assign(controlPoints, controlPoints + mesh->GetControlPointsCount());
 
+	// The scene is triangulated, so the polygon vertex array is usually three per polygon already and copied whole
 	int polyCount = mesh->GetPolygonCount();
-	int deformerCount = mesh->GetDeformerCount();
-
-	std::unordered_map<size_t, size_t> hashToRealIndex;
-	std::unordered_map<size_t, std::vector<size_t>> controlPointIndexToRealIndex;
-
-	int vertexCounter = 0;
-	for (int polygon = 0; polygon < polyCount; polygon++)
+	const int* polygonVertices = mesh->GetPolygonVertices();
+	if (polygonVertices && mesh->GetPolygonVertexCount() == polyCount * 3)
+	{
+		source.polygonVertices.assign(polygonVertices, polygonVertices + (size_t)polyCount * 3);
+	}
+	else
 	{
-		for (int polygonVertex = 0; polygonVertex < 3; polygonVertex++)
+		source.polygonVertices.resize((size_t)polyCount * 3);
+		for (int polygon = 0; polygon < polyCount; polygon++)
 		{
-			int controlPointIndex = mesh->GetPolygonVertex(polygon, polygonVertex);
-			
-			Mesh::VertexData data = {};
-			data.position = TransformFbxVector4(transform, mesh->GetControlPointAt(controlPointIndex)) * scaleFactor;
-			data.normal = ReadNormal(mesh, controlPointIndex, vertexCounter);
-			data.binormal = ReadBinormal(mesh, controlPointIndex, vertexCounter);
-			data.tangent = ReadTangent(mesh, controlPointIndex, vertexCounter);
-			data.uv = ReadUV(mesh, controlPointIndex, vertexCounter);
-			data.color = ReadVertexColor(mesh, controlPointIndex, vertexCounter);
-			data.materialIndex = ReadMaterial(mesh, vertexCounter);
-			FbxSurfaceMaterial* material = mesh->GetNode()->GetMaterial(data.materialIndex);
-			if (material)
-				data.materialIndex = materialNameToIndexMap[material->GetName()];
+			for (int polygonVertex = 0; polygonVertex < 3; polygonVertex++)
+				source.polygonVertices[polygon * 3 + polygonVertex] = mesh->GetPolygonVertex(polygon, polygonVertex);
+		}
+	}
 
-			size_t hash = Mesh::hash_vert(data);
-			if (hashToRealIndex.count(hash) > 0)
-			{
-				// Has found earlier
-				result.indices.push_back(hashToRealIndex[hash]);
-				controlPointIndexToRealIndex[controlPointIndex].push_back(hashToRealIndex[hash]);
-			}
-			else
-			{
-				// New vertex
-				hashToRealIndex[hash] = result.vertices.size();
-				controlPointIndexToRealIndex[controlPointIndex].push_back(result.vertices.size());
-				result.indices.push_back(result.vertices.size());
-				result.vertices.push_back(data);
-			}
+	// Layers the vertex layout leaves out are never copied
+	if (vertexLayout.Has(VertexAttribute::Normal) && mesh->GetElementNormalCount() > 0)
+		ReadLayer(mesh->GetElementNormal(0), source.normalLayer);
+	if (vertexLayout.Has(VertexAttribute::Tangent) && mesh->GetElementBinormalCount() > 0)
+		ReadLayer(mesh->GetElementBinormal(0), source.binormalLayer);
+	if (vertexLayout.Has(VertexAttribute::Tangent) && mesh->GetElementTangentCount() > 0)
+		ReadLayer(mesh->GetElementTangent(0), source.tangentLayer);
+	if (vertexLayout.Has(VertexAttribute::UV) && mesh->GetElementUVCount() > 0)
+		ReadLayer(mesh->GetElementUV(0), source.uvLayer);
+	if (vertexLayout.Has(VertexAttribute::Color) && mesh->GetElementVertexColorCount() > 0)
+		ReadLayer(mesh->GetElementVertexColor(0), source.colorLayer);
+
+	if (mesh->GetElementMaterialCount() > 0)
+	{
+		FbxLayerElementArrayTemplate<int>* materialArray;
+		mesh->GetMaterialIndices(&materialArray);
 
-			vertexCounter++;
+		source.materialLayer.mappingMode = mesh->GetElementMaterial(0)->GetMappingMode();
+		CopyLayerArray(*materialArray, source.materialLayer.directArray);
+
+		// Node material slot to scene material index, slots without a material keep their own index
+		source.materialRemap.resize(node->GetMaterialCount());
+		for (int slot = 0; slot < node->GetMaterialCount(); slot++)
+		{
+			FbxSurfaceMaterial* material = node->GetMaterial(slot);
+			source.materialRemap[slot] = material ? materialNameToIndexMap[material->GetName()] : slot;
 		}
 	}
 
+	const int deformerCount = vertexLayout.HasSkin() ? mesh->GetDeformerCount() : 0;
 	for (int deformerIndex = 0; deformerIndex < deformerCount; deformerIndex++)
 	{
 		FbxSkin* currSkin = (FbxSkin*)(mesh->GetDeformer(deformerIndex, FbxDeformer::eSkin));
@@ -518,202 +1107,1827 @@ void FbxLoader::Parser::LoadMesh(FbxNode* node)
 			continue;
 		}
 
-		unsigned int numOfClusters = currSkin->GetClusterCount();
-		for (unsigned int clusterIndex = 0; clusterIndex != numOfClusters; ++clusterIndex)
+		for (int clusterIndex = 0; clusterIndex != currSkin->GetClusterCount(); ++clusterIndex)
 		{
 			FbxCluster* currCluster = currSkin->GetCluster(clusterIndex);
-			FbxString currJointName = currCluster->GetLink()->GetName();
-			int currJointIndex = FindJointIndexByName(currJointName);
-			if (currJointIndex == -1)
-			{
-				FBXSDK_printf("error: can't find the joint: %s\n\n", currJointName.Buffer());
-				continue;
-			}
-
-			int numOfIndices = currCluster->GetControlPointIndicesCount();
-			for (int i = 0; i < numOfIndices; ++i)
-			{
-				float weight = (float)currCluster->GetControlPointWeights()[i];
-				int controlPointIndex = currCluster->GetControlPointIndices()[i];
-
-				if (weight < 0.01f)
-					continue;
-
-				for (int vertexIndex = 0; vertexIndex < controlPointIndexToRealIndex[controlPointIndex].size(); vertexIndex++)
-				{
-					Mesh::VertexData& vertex = result.vertices[controlPointIndexToRealIndex[controlPointIndex][vertexIndex]];
-
-					if (vertex.jointCount >= (MAX_VERTEX_BONES - 1))
-						continue;
-
-					bool found = false;
-					for (int vertexBoneIndex = 0; vertexBoneIndex < vertex.jointCount; vertexBoneIndex++)
-					{
-						if ((int)vertex.jointIndices[vertexBoneIndex] == currJointIndex)
-						{
-							found = true;
-							break;
-						}
-					}
-					if (found)
-						continue;
 
-					vertex.jointWeights[vertex.jointCount] = weight;
-					vertex.jointIndices[vertex.jointCount] = currJointIndex;
-					vertex.jointCount++;
-				}
-			}
+			MeshSource::Cluster cluster;
+			cluster.jointName = currCluster->GetLink()->GetName();
+			cluster.indices.assign(currCluster->GetControlPointIndices(), currCluster->GetControlPointIndices() + currCluster->GetControlPointIndicesCount());
+			cluster.weights.assign(currCluster->GetControlPointWeights(), currCluster->GetControlPointWeights() + currCluster->GetControlPointIndicesCount());
+			source.clusters.push_back(std::move(cluster));
 		}
 	}
 
-	meshes.push_back(result);
+	return true;
 }
-void FbxLoader::Parser::LoadMeshes()
-{
-	std::vector<FbxNode*> _meshes;
-	FindMeshes(pScene->GetRootNode(), _meshes);
-	for (auto mesh : _meshes) 
-	{
-		LoadMesh(mesh);
-	}
-
-	materialCount = pScene->GetSrcObjectCount<FbxSurfaceMaterial>();
 
-#if SPLIT_MESH_MATERIAL
-	std::vector<Mesh> _optimized_meshes;
-	for (int materialIndex = 0; materialIndex < materialCount; materialIndex++)
+namespace
+{
+	// Welds every polygon-vertex of source. Instantiated per set of attribute bits, so attributes the mesh or the layout
+	// doesn't have are compiled out of the loop instead of being tested for every vertex.
+	template<unsigned int Attributes>
+	void WeldPolygonVertices(const FbxLoader::MeshSource& source, FbxLoader::VertexWelder& welder, FbxLoader::IndexBuffer& indices)
 	{
-		FbxSurfaceMaterial* material = pScene->GetSrcObject<FbxSurfaceMaterial>(materialIndex);
-		FbxString materialName = material->GetName();
-		Mesh optimizedMesh = {};
-		optimizedMesh.materialName = materialName;
-		optimizedMesh.materialIndex = materialIndex;
+		using FbxLoader::VertexAttribute;
+		constexpr bool hasNormal = (Attributes & (1u << (int)VertexAttribute::Normal)) != 0;
+		constexpr bool hasTangent = (Attributes & (1u << (int)VertexAttribute::Tangent)) != 0;
+		constexpr bool hasUV = (Attributes & (1u << (int)VertexAttribute::UV)) != 0;
+		constexpr bool hasColor = (Attributes & (1u << (int)VertexAttribute::Color)) != 0;
 
-		for (Mesh& mesh : meshes)
+		for (size_t vertexCounter = 0; vertexCounter < source.polygonVertices.size(); vertexCounter++)
 		{
-			std::unordered_map<size_t, size_t> hashToRealIndex;
+			int controlPointIndex = source.polygonVertices[vertexCounter];
 
-			for (int oldIndex = 0; oldIndex < mesh.indices.size(); oldIndex++)
+			FbxLoader::Mesh::VertexData data = {};
+			data.position = source.controlPoints[controlPointIndex];
+			if constexpr (hasNormal)
+				data.normal = source.normals[vertexCounter];
+			else
+				data.normal = FbxVector4(0, 0, 0, 0);
+			if constexpr (hasTangent)
 			{
-				if (mesh.vertices[mesh.indices[oldIndex]].materialIndex != materialIndex)
-					continue;
-
-				size_t hash = Mesh::hash_vert(mesh.vertices[mesh.indices[oldIndex]]);
-				if (hashToRealIndex.count(hash) == 0)
-				{
-					hashToRealIndex[hash] = optimizedMesh.vertices.size();
-					optimizedMesh.indices.push_back(optimizedMesh.vertices.size());
-					optimizedMesh.vertices.push_back(mesh.vertices[mesh.indices[oldIndex]]);
-				}
-				else
-				{
-					optimizedMesh.indices.push_back(hashToRealIndex[hash]);
-				}
+				data.binormal = source.binormals.empty() ? FbxVector4(0, 0, 0, 0) : source.binormals[vertexCounter];
+				data.tangent = source.tangents[vertexCounter];
 			}
-		}
+			else
+			{
+				data.binormal = FbxVector4(0, 0, 0, 0);
+				data.tangent = FbxVector4(0, 0, 0, 0);
+			}
+			if constexpr (hasUV)
+				data.uv = source.uvs[vertexCounter];
+			else
+				data.uv = FbxVector2(0, 0);
+			if constexpr (hasColor)
+				data.color = source.colors[vertexCounter];
+			else
+				data.color = FbxColor(1, 1, 1, 1);
+			data.materialIndex = source.materials.empty() ? 0 : source.materials[vertexCounter / 3];
 
-		if (optimizedMesh.vertices.size() > 0)
-		{
-			_optimized_meshes.push_back(optimizedMesh);
+			indices.push_back((uint32_t)welder.Weld(data));
 		}
 	}
 
-	if (materialCount > 0)
+	typedef void (*WeldFunction)(const FbxLoader::MeshSource&, FbxLoader::VertexWelder&, FbxLoader::IndexBuffer&);
+
+	// Normal through Color are bits 1 to 4, one instantiation for each of the 16 combinations
+	template<size_t... Sets>
+	WeldFunction SelectWeldFunction(unsigned int attributes, std::index_sequence<Sets...>)
 	{
-		meshes.clear();
-		meshes = _optimized_meshes;
+		static const WeldFunction functions[] = { &WeldPolygonVertices<(unsigned int)(Sets << 1)>... };
+		return functions[(attributes >> 1) & 15];
 	}
-#endif
-}
 
-void FbxLoader::Parser::LoadSkeleton(FbxNode* node, int depth, int currIndex, int parentIndex)
-{
-	if (node->GetNodeAttribute() && node->GetNodeAttribute()->GetAttributeType() &&
-		node->GetNodeAttribute()->GetAttributeType() == FbxNodeAttribute::eSkeleton)
+	struct Influence
 	{
-		Joint jointTmp = {};
-		jointTmp.jointName = node->GetName();
-		jointTmp.parentIndex = parentIndex;
-		jointTmp.currentIndex = currIndex;
-
-		jointTmp.localMatrix = GetLocalTransform(node);
-		jointTmp.globalMatrix = GetGlobalTransform(node);
-
-		jointTmp.node = node;
+		float weight;
+		uint32_t joint;
+	};
 
-		std::string name = jointTmp.jointName.Buffer();
-		skeleton.jointMap[name] = (int)skeleton.joints.size();
-
-		skeleton.joints.push_back(jointTmp);
+	// Heavier first, ties broken by joint index so the selection doesn't depend on cluster order
+	inline void CompareExchange(Influence& a, Influence& b)
+	{
+		if (b.weight > a.weight || (b.weight == a.weight && b.joint < a.joint))
+			std::swap(a, b);
 	}
 
-	for (int i = 0; i != node->GetChildCount(); ++i)
+	// Batcher's odd-even merge network for 8 values, a fixed sequence of 19 compare-exchanges
+	void SortInfluences(Influence (&influences)[8])
 	{
-		LoadSkeleton(node->GetChild(i), depth + 1, (int)skeleton.joints.size(), currIndex);
-	}
-}
-void FbxLoader::Parser::LoadSkeleton()
-{
-	FbxNode* rootNode = pScene->GetRootNode();
-	int childCount = rootNode->GetChildCount();
-	for (int i = 0; i != childCount; ++i) {
-		LoadSkeleton(rootNode->GetChild(i), 0, (int)skeleton.joints.size(), -1);
+		static const uint8_t network[19][2] = {
+			{ 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 }, { 1, 2 }, { 5, 6 },
+			{ 0, 4 }, { 3, 7 }, { 1, 5 }, { 2, 6 }, { 1, 4 }, { 3, 6 }, { 2, 4 }, { 3, 5 }, { 3, 4 }
+		};
+		for (const uint8_t* pair : network)
+			CompareExchange(influences[pair[0]], influences[pair[1]]);
 	}
-}
 
-void FbxLoader::Parser::LoadAnimation(Joint* joint, FbxLoader::Animation& result)
-{
-	FbxNode* node = joint->node;
-	int boneIndex = joint->currentIndex;
+	// Reduce the influences of one control point to the maxInfluences heaviest, weights summing to one. Duplicated
+	// joints are merged first. With quantize set the weights are snapped to unorm16 steps that sum to exactly 65535,
+	// the rounding error going to the heaviest, so PackUnorm16 of them adds up to one as well.
+	int SelectInfluences(Influence* influences, size_t count, int maxInfluences, bool quantize, Influence (&top)[8])
+	{
+		size_t unique = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t existing = 0;
+			while (existing < unique && influences[existing].joint != influences[i].joint)
+				existing++;
+			if (existing < unique)
+				influences[existing].weight += influences[i].weight;
+			else
+				influences[unique++] = influences[i];
+		}
 
-	FbxGlobalSettings& globalSettings = pScene->GetGlobalSettings();
-	FbxTime::EMode timeMode = globalSettings.GetTimeMode();
+		for (size_t i = 0; i < 8; i++)
+			top[i] = i < unique ? influences[i] : Influence{ 0.0f, UINT32_MAX };
+		SortInfluences(top);
+		for (size_t i = 8; i < unique; i++)
+		{
+			if (influences[i].weight <= top[7].weight)
+				continue;
+			top[7] = influences[i];
+			for (int slot = 7; slot > 0; slot--)
+				CompareExchange(top[slot - 1], top[slot]);
+		}
 
-	result.globalTransforms[boneIndex] = new FbxAMatrix[result.frameCount];
-	result.localTransforms[boneIndex] = new FbxAMatrix[result.frameCount];
-	for (FbxLongLong frameIndex = 0; frameIndex < result.frameCount; frameIndex++)
-	{
-		FbxTime currTime;
-		currTime.SetFrame(frameIndex, timeMode);
+		int kept = 0;
+		float sum = 0.0f;
+		while (kept < maxInfluences && top[kept].weight > 0.0f)
+			sum += top[kept++].weight;
+		if (kept == 0)
+			return 0;
 
-		result.globalTransforms[boneIndex][frameIndex] = GetGlobalTransform(node, currTime);
-		result.localTransforms[boneIndex][frameIndex] = GetLocalTransform(node, currTime);
+		for (int i = 0; i < kept; i++)
+			top[i].weight /= sum;
+
+		if (quantize)
+		{
+			long remaining = 65535;
+			long steps[8];
+			for (int i = 0; i < kept; i++)
+			{
+				steps[i] = lround(top[i].weight * 65535.0);
+				remaining -= steps[i];
+			}
+			steps[0] += remaining;
+			for (int i = 0; i < kept; i++)
+				top[i].weight = (float)(steps[i] / 65535.0);
+		}
+		return kept;
 	}
 }
-FbxLoader::Animation FbxLoader::Parser::LoadAnimation(FbxAnimStack* animStack)
+
+std::unique_ptr<FbxLoader::ScratchArena> FbxLoader::Parser::AcquireArena() const
 {
-	FbxGlobalSettings& globalSettings = pScene->GetGlobalSettings();
-	FbxTime::EMode timeMode = globalSettings.GetTimeMode();
+	std::lock_guard<std::mutex> lock(arenaMutex);
+	if (arenas.empty())
+		return std::unique_ptr<ScratchArena>(new ScratchArena());
 
-	FbxLoader::Animation result = {};
-	result.name = animStack->GetName();
-	result.length = animStack->GetLocalTimeSpan().GetDuration().GetSecondDouble();
-	result.frameRate = animStack->GetLocalTimeSpan().GetDuration().GetFrameCountPrecise(timeMode) / result.length;
-	result.frameCount = animStack->GetLocalTimeSpan().GetDuration().GetFrameCount(timeMode);
+	std::unique_ptr<ScratchArena> arena = std::move(arenas.back());
+	arenas.pop_back();
+	return arena;
+}
 
-	result.localTransforms = new FbxAMatrix * [skeleton.joints.size()];
-	result.globalTransforms = new FbxAMatrix * [skeleton.joints.size()];
+void FbxLoader::Parser::ReleaseArena(std::unique_ptr<ScratchArena> arena) const
+{
+	arena->Reset();
+	std::lock_guard<std::mutex> lock(arenaMutex);
+	arenas.push_back(std::move(arena));
+}
 
-	for (int i = 0; i < skeleton.joints.size(); i++)
+void FbxLoader::Parser::BuildMesh(MeshSource& source, Mesh& result) const
+{
+	const std::chrono::steady_clock::time_point start = activeStats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+	source.DecodeLayers(vertexLayout.flipUVY);
+	source.ApplyTransform(scaleFactor);
+
+	result.attributes = 1u << (int)VertexAttribute::Position;
+	if (!source.normals.empty())
+		result.attributes |= 1u << (int)VertexAttribute::Normal;
+	if (!source.tangents.empty())
+		result.attributes |= 1u << (int)VertexAttribute::Tangent;
+	if (!source.uvs.empty())
+		result.attributes |= 1u << (int)VertexAttribute::UV;
+	if (!source.colors.empty())
+		result.attributes |= 1u << (int)VertexAttribute::Color;
+	if (!source.clusters.empty() && vertexLayout.HasSkin())
+		result.attributes |= (1u << (int)VertexAttribute::JointIndices) | (1u << (int)VertexAttribute::JointWeights);
+	result.attributes &= vertexLayout.attributes | (1u << (int)VertexAttribute::Position);
+
+	VertexWelder welder(result.vertices, source.polygonVertices.size(), weldEpsilon);
+	result.indices.reserve(source.polygonVertices.size());
+	SelectWeldFunction(result.attributes, std::make_index_sequence<16>())(source, welder, result.indices);
+
+	if ((result.attributes & (1u << (int)VertexAttribute::JointIndices)) == 0)
+		source.clusters.clear();
+	const int maxBones = std::min(vertexLayout.maxBones, MaxVertexBones);
+
+	if (!source.clusters.empty())
 	{
-		LoadAnimation(&skeleton.joints[i], result);
+		std::unique_ptr<ScratchArena> arena = AcquireArena();
+
+		// Welded vertices of every control point in one flat array, control point c owns
+		// controlPointVertices[controlPointOffsets[c]] up to controlPointVertices[controlPointOffsets[c + 1]]
+		const size_t controlPointCount = source.controlPoints.size();
+		uint32_t* controlPointOffsets = arena->Allocate<uint32_t>(controlPointCount + 1);
+		uint32_t* controlPointVertices = arena->Allocate<uint32_t>(source.polygonVertices.size());
+		std::fill(controlPointOffsets, controlPointOffsets + controlPointCount + 1, 0u);
+		for (int controlPointIndex : source.polygonVertices)
+			controlPointOffsets[controlPointIndex + 1]++;
+		for (size_t controlPointIndex = 0; controlPointIndex < controlPointCount; controlPointIndex++)
+			controlPointOffsets[controlPointIndex + 1] += controlPointOffsets[controlPointIndex];
+
+		uint32_t* fill = arena->Allocate<uint32_t>(controlPointCount);
+		std::copy(controlPointOffsets, controlPointOffsets + controlPointCount, fill);
+		for (size_t vertexCounter = 0; vertexCounter < source.polygonVertices.size(); vertexCounter++)
+			controlPointVertices[fill[source.polygonVertices[vertexCounter]]++] = result.indices[vertexCounter];
+
+		// Every polygon using a welded vertex listed it again, keep it once per control point
+		uint32_t* lastControlPoint = arena->Allocate<uint32_t>(result.vertices.size());
+		std::fill(lastControlPoint, lastControlPoint + result.vertices.size(), UINT32_MAX);
+		uint32_t unique = 0;
+		for (uint32_t controlPointIndex = 0; controlPointIndex < (uint32_t)controlPointCount; controlPointIndex++)
+		{
+			const uint32_t begin = controlPointOffsets[controlPointIndex], end = controlPointOffsets[controlPointIndex + 1];
+			controlPointOffsets[controlPointIndex] = unique;
+			for (uint32_t at = begin; at < end; at++)
+			{
+				const uint32_t vertex = controlPointVertices[at];
+				if (lastControlPoint[vertex] != controlPointIndex)
+				{
+					lastControlPoint[vertex] = controlPointIndex;
+					controlPointVertices[unique++] = vertex;
+				}
+			}
+		}
+		controlPointOffsets[controlPointCount] = unique;
+
+		// Skeleton joint of every cluster, looked up once per skin instead of once per influence
+		int* clusterJoints = arena->Allocate<int>(source.clusters.size());
+		for (size_t clusterIndex = 0; clusterIndex < source.clusters.size(); clusterIndex++)
+		{
+			clusterJoints[clusterIndex] = FindJointIndexByName(source.clusters[clusterIndex].jointName);
+			if (clusterJoints[clusterIndex] == -1)
+				FBXSDK_printf("error: can't find the joint: %s\n\n", source.clusters[clusterIndex].jointName.Buffer());
+		}
+
+		// Every influence in one flat array grouped by control point, laid out like controlPointVertices
+		auto isInfluence = [&](size_t clusterIndex, size_t i)
+		{
+			const int controlPointIndex = source.clusters[clusterIndex].indices[i];
+			return clusterJoints[clusterIndex] != -1 && source.clusters[clusterIndex].weights[i] >= 0.01 &&
+				controlPointIndex >= 0 && controlPointIndex < (int)controlPointCount;
+		};
+		uint32_t* influenceOffsets = arena->Allocate<uint32_t>(controlPointCount + 1);
+		std::fill(influenceOffsets, influenceOffsets + controlPointCount + 1, 0u);
+		for (size_t clusterIndex = 0; clusterIndex < source.clusters.size(); clusterIndex++)
+		{
+			for (size_t i = 0; i < source.clusters[clusterIndex].indices.size(); i++)
+			{
+				if (isInfluence(clusterIndex, i))
+					influenceOffsets[source.clusters[clusterIndex].indices[i] + 1]++;
+			}
+		}
+		for (size_t controlPointIndex = 0; controlPointIndex < controlPointCount; controlPointIndex++)
+			influenceOffsets[controlPointIndex + 1] += influenceOffsets[controlPointIndex];
+
+		Influence* influences = arena->Allocate<Influence>(influenceOffsets[controlPointCount]);
+		std::copy(influenceOffsets, influenceOffsets + controlPointCount, fill);
+		for (size_t clusterIndex = 0; clusterIndex < source.clusters.size(); clusterIndex++)
+		{
+			const MeshSource::Cluster& cluster = source.clusters[clusterIndex];
+			for (size_t i = 0; i < cluster.indices.size(); i++)
+			{
+				if (isInfluence(clusterIndex, i))
+					influences[fill[cluster.indices[i]]++] = Influence{ (float)cluster.weights[i], (uint32_t)clusterJoints[clusterIndex] };
+			}
+		}
+
+		// Selected once per control point and copied to its welded vertices. The packed formats only have
+		// PackedVertexBones slots of unorm16 weights, so they get the selection and quantization they can store.
+		const bool packed = vertexFormat == VertexFormat::Compact || vertexFormat == VertexFormat::Quantized;
+		const int maxInfluences = packed ? std::min(maxBones, PackedVertexBones) : maxBones;
+		if (maxInfluences > InlineVertexBones)
+			result.extraJoints.resize(result.vertices.size());
+		for (size_t controlPointIndex = 0; controlPointIndex < controlPointCount; controlPointIndex++)
+		{
+			const uint32_t begin = influenceOffsets[controlPointIndex];
+			Influence top[8];
+			const int kept = SelectInfluences(influences + begin, influenceOffsets[controlPointIndex + 1] - begin, maxInfluences, packed, top);
+
+			for (uint32_t at = controlPointOffsets[controlPointIndex]; at < controlPointOffsets[controlPointIndex + 1]; at++)
+			{
+				Mesh::VertexData& vertex = result.vertices[controlPointVertices[at]];
+				vertex.jointCount = kept;
+				for (int bone = 0; bone < InlineVertexBones; bone++)
+				{
+					vertex.jointIndices[bone] = bone < kept ? top[bone].joint : 0;
+					vertex.jointWeights[bone] = bone < kept ? top[bone].weight : 0.0f;
+				}
+				if (!result.extraJoints.empty())
+				{
+					Mesh::ExtraJoints& extra = result.extraJoints[controlPointVertices[at]];
+					for (int bone = InlineVertexBones; bone < MaxVertexBones; bone++)
+					{
+						extra.jointIndices[bone - InlineVertexBones] = bone < kept ? top[bone].joint : 0;
+						extra.jointWeights[bone - InlineVertexBones] = bone < kept ? top[bone].weight : 0.0f;
+					}
+				}
+			}
+		}
+
+		ReleaseArena(std::move(arena));
+	}
+
+	if (activeStats)
+	{
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			activeStats->polygonCount += source.polygonVertices.size() / 3;
+			activeStats->rawVertexCount += source.polygonVertices.size();
+			activeStats->weldedVertexCount += result.vertices.size();
+			activeStats->hashProbes += welder.ProbeCount();
+		}
+		RecordEvent("BuildMesh", start);
+	}
+}
+void FbxLoader::Parser::LoadMeshes()
+{
+	std::vector<Mesh> built;
+	BuildMeshes(built);
+	SplitMeshesByMaterial(built, LoadMaterialNames());
+}
+void FbxLoader::Parser::BuildMeshes(std::vector<Mesh>& built)
+{
+	std::vector<FbxNode*> _meshes;
+	FindMeshes(pScene->GetRootNode(), _meshes);
+
+	if (workerCount == 1)
+	{
+		for (auto mesh : _meshes)
+		{
+			MeshSource source;
+			{
+				PhaseScope phase(*this, LoadStats::MeshRead);
+				if (!ReadMeshSource(mesh, source))
+					continue;
+			}
+
+			PhaseScope phase(*this, LoadStats::MeshBuild);
+			built.push_back(Mesh{});
+			BuildMesh(source, built.back());
+		}
+	}
+	else
+	{
+		// The SDK is only touched here on the calling thread, workers decode, weld and skin from the snapshots
+		std::vector<MeshSource> sources(_meshes.size());
+		std::vector<char> valid(_meshes.size());
+		{
+			PhaseScope phase(*this, LoadStats::MeshRead);
+			for (size_t i = 0; i < _meshes.size(); i++)
+			{
+				valid[i] = ReadMeshSource(_meshes[i], sources[i]);
+			}
+		}
+
+		PhaseScope phase(*this, LoadStats::MeshBuild);
+		std::vector<Mesh> results(_meshes.size());
+		GetWorkerPool().Run(_meshes.size(), [&](size_t i)
+		{
+			if (valid[i])
+				BuildMesh(sources[i], results[i]);
+			sources[i] = MeshSource();
+		});
+
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			if (valid[i])
+				built.push_back(std::move(results[i]));
+		}
+	}
+	arenas.clear();
+}
+std::vector<FbxString> FbxLoader::Parser::LoadMaterialNames()
+{
+	materialCount = pScene->GetSrcObjectCount<FbxSurfaceMaterial>();
+
+	std::vector<FbxString> materialNames;
+	for (int materialIndex = 0; materialIndex < materialCount; materialIndex++)
+	{
+		materialNames.push_back(pScene->GetSrcObject<FbxSurfaceMaterial>(materialIndex)->GetName());
+	}
+	return materialNames;
+}
+void FbxLoader::Parser::SplitMeshesByMaterial(std::vector<Mesh>& built, const std::vector<FbxString>& materialNames)
+{
+	if (splitMeshMaterial && materialCount > 0 && materialDrawRanges)
+	{
+		{
+			PhaseScope phase(*this, LoadStats::MaterialSplit);
+			if (workerCount == 1)
+			{
+				for (Mesh& mesh : built)
+					GroupTrianglesByMaterial(mesh);
+			}
+			else
+			{
+				GetWorkerPool().Run(built.size(), [&](size_t meshIndex) { GroupTrianglesByMaterial(built[meshIndex]); });
+			}
+		}
+		FinishMeshes(built);
+		return;
+	}
+
+	if (splitMeshMaterial && materialCount > 0)
+	{
+		struct BucketEntry
+		{
+			uint32_t mesh;
+			uint32_t vertex;
+		};
+
+		// Single counting sort pass puts every index in the bucket of its vertex material, in mesh then index order
+		std::vector<size_t> bucketStart(materialCount + 1, 0);
+		std::vector<int> lastMaterial(built.size(), -1);
+		std::vector<BucketEntry> entries;
+		{
+			PhaseScope phase(*this, LoadStats::MaterialSplit);
+
+			for (size_t meshIndex = 0; meshIndex < built.size(); meshIndex++)
+			{
+				const Mesh& mesh = built[meshIndex];
+				for (size_t index = 0; index < mesh.indices.size(); index++)
+				{
+					const int materialIndex = mesh.vertices[mesh.indices[index]].materialIndex;
+					if (materialIndex < 0 || materialIndex >= materialCount)
+						continue;
+
+					bucketStart[materialIndex + 1]++;
+					lastMaterial[meshIndex] = std::max(lastMaterial[meshIndex], materialIndex);
+				}
+			}
+			for (int materialIndex = 0; materialIndex < materialCount; materialIndex++)
+				bucketStart[materialIndex + 1] += bucketStart[materialIndex];
+
+			entries.resize(bucketStart[materialCount]);
+			std::vector<size_t> cursor(bucketStart.begin(), bucketStart.end() - 1);
+			for (size_t meshIndex = 0; meshIndex < built.size(); meshIndex++)
+			{
+				const Mesh& mesh = built[meshIndex];
+				for (size_t index = 0; index < mesh.indices.size(); index++)
+				{
+					const uint32_t vertex = mesh.indices[index];
+					const int materialIndex = mesh.vertices[vertex].materialIndex;
+					if (materialIndex >= 0 && materialIndex < materialCount)
+						entries[cursor[materialIndex]++] = BucketEntry{ (uint32_t)meshIndex, vertex };
+				}
+			}
+		}
+
+		// A material mixes vertices of several built meshes, its extra joints are kept if any of them has them
+		const bool extraJoints = std::any_of(built.begin(), built.end(), [](const Mesh& mesh) { return !mesh.extraJoints.empty(); });
+		auto weldBucket = [&](int materialIndex, Mesh& optimizedMesh)
+		{
+			optimizedMesh.materialName = materialNames[materialIndex];
+			optimizedMesh.materialIndex = materialIndex;
+			optimizedMesh.indices.reserve(bucketStart[materialIndex + 1] - bucketStart[materialIndex]);
+
+			// Vertices are only welded with vertices of the same built mesh, so each run of a mesh gets its own welder
+			size_t runStart = bucketStart[materialIndex];
+			while (runStart < bucketStart[materialIndex + 1])
+			{
+				const uint32_t meshIndex = entries[runStart].mesh;
+				size_t runEnd = runStart;
+				while (runEnd < bucketStart[materialIndex + 1] && entries[runEnd].mesh == meshIndex)
+					runEnd++;
+
+				const Mesh& mesh = built[meshIndex];
+				VertexWelder welder(optimizedMesh.vertices, runEnd - runStart, weldEpsilon, extraJoints ? &optimizedMesh.extraJoints : nullptr);
+				for (size_t entry = runStart; entry < runEnd; entry++)
+				{
+					const uint32_t vertex = entries[entry].vertex;
+					optimizedMesh.indices.push_back((uint32_t)welder.Weld(mesh.vertices[vertex], mesh.extraJoints.empty() ? nullptr : &mesh.extraJoints[vertex]));
+				}
+				optimizedMesh.attributes |= mesh.attributes;
+
+				runStart = runEnd;
+			}
+		};
+
+		// Buckets are welded a worker pool's worth at a time and finished in material order on this thread. A built mesh
+		// is released once the last material it uses is done, so only the remaining built meshes and one group are held.
+		const int groupSize = workerCount == 1 ? 1 : GetWorkerPool().ThreadCount();
+		for (int firstMaterial = 0; firstMaterial < materialCount; firstMaterial += groupSize)
+		{
+			const int count = std::min(groupSize, materialCount - firstMaterial);
+			std::vector<Mesh> batch(count);
+			{
+				PhaseScope phase(*this, LoadStats::MaterialSplit);
+				if (count == 1)
+					weldBucket(firstMaterial, batch[0]);
+				else
+					GetWorkerPool().Run(count, [&](size_t i) { weldBucket(firstMaterial + (int)i, batch[i]); });
+			}
+
+			batch.erase(std::remove_if(batch.begin(), batch.end(), [](const Mesh& mesh) { return mesh.vertices.empty(); }), batch.end());
+			for (size_t meshIndex = 0; meshIndex < built.size(); meshIndex++)
+			{
+				if (lastMaterial[meshIndex] < firstMaterial + count)
+					built[meshIndex] = Mesh();
+			}
+
+			FinishMeshes(batch);
+		}
+
+		built.clear();
+		return;
+	}
+	FinishMeshes(built);
+}
+void FbxLoader::Parser::GroupTrianglesByMaterial(Mesh& mesh) const
+{
+	// Counting sort of the triangles by the material of their first vertex, triangles keep their order within a material
+	std::vector<uint32_t> triangleStart(materialCount + 1, 0);
+	const size_t triangleCount = mesh.indices.size() / 3;
+	for (size_t triangle = 0; triangle < triangleCount; triangle++)
+	{
+		const int materialIndex = mesh.vertices[mesh.indices[triangle * 3]].materialIndex;
+		if (materialIndex >= 0 && materialIndex < materialCount)
+			triangleStart[materialIndex + 1]++;
+	}
+	for (int materialIndex = 0; materialIndex < materialCount; materialIndex++)
+		triangleStart[materialIndex + 1] += triangleStart[materialIndex];
+
+	std::vector<uint32_t> order(triangleStart[materialCount]);
+	std::vector<uint32_t> cursor(triangleStart.begin(), triangleStart.end() - 1);
+	for (size_t triangle = 0; triangle < triangleCount; triangle++)
+	{
+		const int materialIndex = mesh.vertices[mesh.indices[triangle * 3]].materialIndex;
+		if (materialIndex >= 0 && materialIndex < materialCount)
+			order[cursor[materialIndex]++] = (uint32_t)triangle;
+	}
+
+	IndexBuffer grouped;
+	grouped.reserve(order.size() * 3);
+	for (uint32_t triangle : order)
+	{
+		for (int corner = 0; corner < 3; corner++)
+			grouped.push_back(mesh.indices[triangle * 3 + corner]);
+	}
+	mesh.indices = std::move(grouped);
+
+	mesh.drawRanges.clear();
+	for (int materialIndex = 0; materialIndex < materialCount; materialIndex++)
+	{
+		const uint32_t triangles = triangleStart[materialIndex + 1] - triangleStart[materialIndex];
+		if (triangles > 0)
+			mesh.drawRanges.push_back(Mesh::DrawRange{ materialIndex, triangleStart[materialIndex] * 3, triangles * 3 });
+	}
+}
+void FbxLoader::Parser::FinishMeshes(std::vector<Mesh>& batch)
+{
+	OptimizeMeshes(batch);
+	SplitLargeMeshes(batch);
+	GenerateLods(batch);
+	BuildMeshlets(batch);
+	PackVertices(batch);
+
+	for (Mesh& mesh : batch)
+	{
+		if (meshSink)
+			meshSink(std::move(mesh));
+		else
+			meshes.push_back(std::move(mesh));
+	}
+	batch.clear();
+}
+void FbxLoader::Parser::SplitLargeMeshes(std::vector<Mesh>& batch)
+{
+	PhaseScope phase(*this, LoadStats::Pack);
+
+	if (!splitLargeMeshes)
+		return;
+
+	std::vector<Mesh> splitMeshes;
+	for (Mesh& mesh : batch)
+	{
+		if (mesh.vertices.size() <= IndexBuffer::ShortVertexLimit)
+		{
+			splitMeshes.push_back(std::move(mesh));
+			continue;
+		}
+
+		// Greedily fill parts triangle by triangle, starting a new part when the next triangle would not fit
+		const uint32_t unused = 0xFFFFFFFF;
+		std::vector<uint32_t> remap(mesh.vertices.size(), unused);
+		std::vector<uint32_t> partVertices;
+
+		auto newPart = [&mesh]()
+		{
+			Mesh part = {};
+			part.materialName = mesh.materialName;
+			part.materialIndex = mesh.materialIndex;
+			part.meshToWorld = mesh.meshToWorld;
+			part.attributes = mesh.attributes;
+			return part;
+		};
+
+		Mesh part = newPart();
+		size_t range = 0;
+		for (size_t triangle = 0; triangle + 2 < mesh.indices.size(); triangle += 3)
+		{
+			const uint32_t a = mesh.indices[triangle], b = mesh.indices[triangle + 1], c = mesh.indices[triangle + 2];
+			const size_t newVertices = (remap[a] == unused) + (remap[b] == unused && b != a) + (remap[c] == unused && c != a && c != b);
+
+			if (part.vertices.size() + newVertices > IndexBuffer::ShortVertexLimit)
+			{
+				for (uint32_t vertex : partVertices)
+					remap[vertex] = unused;
+				partVertices.clear();
+				splitMeshes.push_back(std::move(part));
+				part = newPart();
+			}
+
+			// Parts get their own draw ranges, a range that straddles two parts is split with them
+			if (!mesh.drawRanges.empty())
+			{
+				while (range + 1 < mesh.drawRanges.size() && triangle >= mesh.drawRanges[range].firstIndex + mesh.drawRanges[range].indexCount)
+					range++;
+
+				const int materialIndex = mesh.drawRanges[range].materialIndex;
+				if (part.drawRanges.empty() || part.drawRanges.back().materialIndex != materialIndex)
+					part.drawRanges.push_back(Mesh::DrawRange{ materialIndex, (uint32_t)part.indices.size(), 0 });
+				part.drawRanges.back().indexCount += 3;
+			}
+
+			for (uint32_t vertex : { a, b, c })
+			{
+				if (remap[vertex] == unused)
+				{
+					remap[vertex] = (uint32_t)part.vertices.size();
+					part.vertices.push_back(mesh.vertices[vertex]);
+					if (!mesh.extraJoints.empty())
+						part.extraJoints.push_back(mesh.extraJoints[vertex]);
+					partVertices.push_back(vertex);
+				}
+				part.indices.push_back(remap[vertex]);
+			}
+		}
+
+		if (!part.indices.empty())
+			splitMeshes.push_back(std::move(part));
+	}
+
+	batch = std::move(splitMeshes);
+}
+
+namespace
+{
+	int16_t PackSnorm16(double value)
+	{
+		value = value < -1.0 ? -1.0 : (value > 1.0 ? 1.0 : value);
+		return (int16_t)lround(value * 32767.0);
+	}
+
+	uint8_t PackUnorm8(double value)
+	{
+		value = value < 0.0 ? 0.0 : (value > 1.0 ? 1.0 : value);
+		return (uint8_t)lround(value * 255.0);
+	}
+
+	uint16_t PackUnorm16(double value)
+	{
+		value = value < 0.0 ? 0.0 : (value > 1.0 ? 1.0 : value);
+		return (uint16_t)lround(value * 65535.0);
+	}
+
+	// IEEE 754 binary16, rounded to nearest even
+	uint16_t PackHalf(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+
+		const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+		const uint32_t magnitude = bits & 0x7FFFFFFF;
+
+		if (magnitude >= 0x7F800000) // Inf or NaN
+			return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+		if (magnitude >= 0x477FF000) // Rounds past the largest half
+			return sign | 0x7C00;
+		if (magnitude < 0x38800000) // Subnormal half or zero
+		{
+			if (magnitude < 0x33000000)
+				return sign;
+			const uint32_t mantissa = (magnitude & 0x007FFFFF) | 0x00800000;
+			const int shift = 126 - (int)(magnitude >> 23);
+			uint32_t half = mantissa >> shift;
+			const uint32_t remainder = mantissa & ((1u << shift) - 1);
+			const uint32_t halfway = 1u << (shift - 1);
+			if (remainder > halfway || (remainder == halfway && (half & 1)))
+				half++;
+			return sign | (uint16_t)half;
+		}
+
+		uint32_t half = (magnitude - 0x38000000) >> 13;
+		const uint32_t remainder = magnitude & 0x1FFF;
+		if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+			half++;
+		return sign | (uint16_t)half;
+	}
+
+	// Octahedral mapping of a direction onto the [-1, 1] square
+	void PackOctahedral(const FbxVector4& direction, int16_t* out)
+	{
+		double x = direction[0], y = direction[1], z = direction[2];
+		const double length = fabs(x) + fabs(y) + fabs(z);
+		if (length <= 0.0)
+		{
+			out[0] = 0;
+			out[1] = 0;
+			return;
+		}
+		x /= length;
+		y /= length;
+		if (z < 0.0)
+		{
+			const double foldedX = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+			const double foldedY = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+			x = foldedX;
+			y = foldedY;
+		}
+		out[0] = PackSnorm16(x);
+		out[1] = PackSnorm16(y);
+	}
+
+	template<class PackedVertex>
+	void PackAttributes(const FbxLoader::Mesh::VertexData& vertex, const std::unordered_map<unsigned int, uint8_t>& paletteIndices, PackedVertex& packed)
+	{
+		PackOctahedral(vertex.normal, packed.normal);
+		PackOctahedral(vertex.tangent, packed.tangent);
+		const bool flipped = vertex.normal.CrossProduct(vertex.tangent).DotProduct(vertex.binormal) < 0.0;
+		packed.tangent[1] = (int16_t)((packed.tangent[1] & ~1) | (flipped ? 1 : 0));
+
+		packed.uv[0] = PackHalf((float)vertex.uv[0]);
+		packed.uv[1] = PackHalf((float)vertex.uv[1]);
+
+		packed.color[0] = PackUnorm8(vertex.color.mRed);
+		packed.color[1] = PackUnorm8(vertex.color.mGreen);
+		packed.color[2] = PackUnorm8(vertex.color.mBlue);
+		packed.color[3] = PackUnorm8(vertex.color.mAlpha);
+
+		for (int bone = 0; bone < FbxLoader::PackedVertexBones; bone++)
+		{
+			auto paletteIndex = bone < vertex.jointCount ? paletteIndices.find(vertex.jointIndices[bone]) : paletteIndices.end();
+			packed.jointIndices[bone] = paletteIndex != paletteIndices.end() ? paletteIndex->second : 0;
+			packed.jointWeights[bone] = paletteIndex != paletteIndices.end() ? PackUnorm16(vertex.jointWeights[bone]) : 0;
+		}
+	}
+
+	// Fill the structure of arrays streams from the welded vertices, only attributes the source mesh had get a stream
+	void PackStreams(FbxLoader::Mesh& mesh, int boneCount)
+	{
+		using FbxLoader::VertexAttribute;
+		FbxLoader::VertexStreams& streams = mesh.streams;
+		const size_t vertexCount = mesh.vertices.size();
+
+		streams = FbxLoader::VertexStreams();
+		streams.vertexCount = vertexCount;
+
+		auto has = [&mesh](VertexAttribute attribute) { return (mesh.attributes & (1u << (int)attribute)) != 0; };
+		auto describe = [&streams](VertexAttribute attribute, int componentCount, size_t componentSize)
+		{
+			streams.descriptors.push_back({ attribute, componentCount, componentSize });
+		};
+
+		streams.positions.resize(vertexCount * 3);
+		describe(VertexAttribute::Position, 3, sizeof(float));
+		for (size_t i = 0; i < vertexCount; i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+				streams.positions[i * 3 + axis] = (float)mesh.vertices[i].position[axis];
+		}
+
+		if (has(VertexAttribute::Normal))
+		{
+			streams.normals.resize(vertexCount * 3);
+			describe(VertexAttribute::Normal, 3, sizeof(float));
+			for (size_t i = 0; i < vertexCount; i++)
+			{
+				for (int axis = 0; axis < 3; axis++)
+					streams.normals[i * 3 + axis] = (float)mesh.vertices[i].normal[axis];
+			}
+		}
+
+		if (has(VertexAttribute::Tangent))
+		{
+			streams.tangents.resize(vertexCount * 4);
+			describe(VertexAttribute::Tangent, 4, sizeof(float));
+			for (size_t i = 0; i < vertexCount; i++)
+			{
+				const FbxLoader::Mesh::VertexData& vertex = mesh.vertices[i];
+				for (int axis = 0; axis < 3; axis++)
+					streams.tangents[i * 4 + axis] = (float)vertex.tangent[axis];
+				streams.tangents[i * 4 + 3] = vertex.normal.CrossProduct(vertex.tangent).DotProduct(vertex.binormal) < 0.0 ? -1.0f : 1.0f;
+			}
+		}
+
+		if (has(VertexAttribute::UV))
+		{
+			streams.uvs.resize(vertexCount * 2);
+			describe(VertexAttribute::UV, 2, sizeof(float));
+			for (size_t i = 0; i < vertexCount; i++)
+			{
+				streams.uvs[i * 2 + 0] = (float)mesh.vertices[i].uv[0];
+				streams.uvs[i * 2 + 1] = (float)mesh.vertices[i].uv[1];
+			}
+		}
+
+		if (has(VertexAttribute::Color))
+		{
+			streams.colors.resize(vertexCount * 4);
+			describe(VertexAttribute::Color, 4, sizeof(float));
+			for (size_t i = 0; i < vertexCount; i++)
+			{
+				const FbxColor& color = mesh.vertices[i].color;
+				streams.colors[i * 4 + 0] = (float)color.mRed;
+				streams.colors[i * 4 + 1] = (float)color.mGreen;
+				streams.colors[i * 4 + 2] = (float)color.mBlue;
+				streams.colors[i * 4 + 3] = (float)color.mAlpha;
+			}
+		}
+
+		if (has(VertexAttribute::JointIndices))
+		{
+			streams.jointIndices.resize(vertexCount * boneCount);
+			streams.jointWeights.resize(vertexCount * boneCount);
+			describe(VertexAttribute::JointIndices, boneCount, sizeof(uint16_t));
+			describe(VertexAttribute::JointWeights, boneCount, sizeof(float));
+			for (size_t i = 0; i < vertexCount; i++)
+			{
+				const int jointCount = mesh.vertices[i].jointCount;
+				for (int bone = 0; bone < boneCount; bone++)
+				{
+					streams.jointIndices[i * boneCount + bone] = bone < jointCount ? (uint16_t)mesh.JointIndex(i, bone) : 0;
+					streams.jointWeights[i * boneCount + bone] = bone < jointCount ? mesh.JointWeight(i, bone) : 0.0f;
+				}
+			}
+		}
+	}
+}
+
+void FbxLoader::Parser::PackVertices(std::vector<Mesh>& batch)
+{
+	PhaseScope phase(*this, LoadStats::Pack);
+
+	if (vertexFormat == VertexFormat::Full)
+		return;
+
+	auto packMesh = [this, &batch](size_t meshIndex)
+	{
+		Mesh& mesh = batch[meshIndex];
+
+		if (vertexFormat == VertexFormat::Streams)
+		{
+			PackStreams(mesh, std::min(std::max(vertexLayout.maxBones, 1), MaxVertexBones));
+			std::vector<Mesh::VertexData>().swap(mesh.vertices);
+			std::vector<Mesh::ExtraJoints>().swap(mesh.extraJoints);
+			return;
+		}
+
+		// Joint indices are stored in 8 bits, so each mesh gets its own palette of the joints it references
+		std::unordered_map<unsigned int, uint8_t> paletteIndices;
+		mesh.jointPalette.clear();
+		for (const Mesh::VertexData& vertex : mesh.vertices)
+		{
+			for (int bone = 0; bone < vertex.jointCount; bone++)
+			{
+				if (paletteIndices.count(vertex.jointIndices[bone]) > 0)
+					continue;
+				if (mesh.jointPalette.size() > 255)
+				{
+					FBXSDK_printf("error: mesh %s uses more than 256 joints, dropping joint %u\n", mesh.materialName.Buffer(), vertex.jointIndices[bone]);
+					continue;
+				}
+				paletteIndices[vertex.jointIndices[bone]] = (uint8_t)mesh.jointPalette.size();
+				mesh.jointPalette.push_back((int)vertex.jointIndices[bone]);
+			}
+		}
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			mesh.boundsMin[axis] = mesh.vertices.empty() ? 0.0f : (float)mesh.vertices[0].position[axis];
+			mesh.boundsMax[axis] = mesh.boundsMin[axis];
+		}
+		for (const Mesh::VertexData& vertex : mesh.vertices)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				mesh.boundsMin[axis] = std::min(mesh.boundsMin[axis], (float)vertex.position[axis]);
+				mesh.boundsMax[axis] = std::max(mesh.boundsMax[axis], (float)vertex.position[axis]);
+			}
+		}
+
+		if (vertexFormat == VertexFormat::Compact)
+		{
+			mesh.compactVertices.resize(mesh.vertices.size());
+			for (size_t i = 0; i < mesh.vertices.size(); i++)
+			{
+				CompactVertex& packed = mesh.compactVertices[i];
+				for (int axis = 0; axis < 3; axis++)
+					packed.position[axis] = (float)mesh.vertices[i].position[axis];
+				PackAttributes(mesh.vertices[i], paletteIndices, packed);
+			}
+		}
+		else
+		{
+			mesh.quantizedVertices.resize(mesh.vertices.size());
+			for (size_t i = 0; i < mesh.vertices.size(); i++)
+			{
+				QuantizedVertex& packed = mesh.quantizedVertices[i];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					const double extent = (double)mesh.boundsMax[axis] - (double)mesh.boundsMin[axis];
+					packed.position[axis] = extent > 0.0 ? PackUnorm16((mesh.vertices[i].position[axis] - mesh.boundsMin[axis]) / extent) : 0;
+				}
+				packed.position[3] = 0;
+				PackAttributes(mesh.vertices[i], paletteIndices, packed);
+			}
+		}
+
+		std::vector<Mesh::VertexData>().swap(mesh.vertices);
+		std::vector<Mesh::ExtraJoints>().swap(mesh.extraJoints);
+	};
+
+	if (workerCount == 1)
+	{
+		for (size_t i = 0; i < batch.size(); i++)
+			packMesh(i);
+	}
+	else
+	{
+		GetWorkerPool().Run(batch.size(), packMesh);
+	}
+}
+
+void FbxLoader::Parser::LoadSkeleton(FbxNode* node, int depth, int currIndex, int parentIndex)
+{
+	const bool isJoint = node->GetNodeAttribute() && node->GetNodeAttribute()->GetAttributeType() &&
+		node->GetNodeAttribute()->GetAttributeType() == FbxNodeAttribute::eSkeleton;
+	if (isJoint)
+	{
+		Joint jointTmp = {};
+		jointTmp.jointName = node->GetName();
+		jointTmp.parentIndex = parentIndex;
+		jointTmp.currentIndex = currIndex;
+
+		jointTmp.localMatrix = GetLocalTransform(node);
+		jointTmp.globalMatrix = GetGlobalTransform(node);
+
+		jointTmp.node = node;
+
+		std::string name = jointTmp.jointName.Buffer();
+		skeleton.jointMap.emplace(name, (int)skeleton.joints.size());
+
+		skeleton.joints.push_back(jointTmp);
+	}
+
+	for (int i = 0; i != node->GetChildCount(); ++i)
+	{
+		// Nodes that aren't joints (an armature Null, a group) pass their own parent joint down
+		LoadSkeleton(node->GetChild(i), depth + 1, (int)skeleton.joints.size(), isJoint ? currIndex : parentIndex);
+	}
+}
+void FbxLoader::Parser::LoadSkeleton()
+{
+	PhaseScope phase(*this, LoadStats::Skeleton);
+
+	FbxNode* rootNode = pScene->GetRootNode();
+	int childCount = rootNode->GetChildCount();
+	for (int i = 0; i != childCount; ++i) {
+		LoadSkeleton(rootNode->GetChild(i), 0, (int)skeleton.joints.size(), -1);
+	}
+}
+
+void FbxLoader::Parser::LoadAnimation(Joint* joint, FbxLoader::Animation& result)
+{
+	FbxNode* node = joint->node;
+	int boneIndex = joint->currentIndex;
+
+	FbxGlobalSettings& globalSettings = pScene->GetGlobalSettings();
+	FbxTime::EMode timeMode = globalSettings.GetTimeMode();
+
+	result.globalTransforms[boneIndex].resize((size_t)result.frameCount);
+	result.localTransforms[boneIndex].resize((size_t)result.frameCount);
+	for (FbxLongLong frameIndex = 0; frameIndex < result.frameCount; frameIndex++)
+	{
+		FbxTime currTime;
+		currTime.SetFrame(frameIndex, timeMode);
+
+		result.globalTransforms[boneIndex][frameIndex] = GetGlobalTransform(node, currTime);
+		result.localTransforms[boneIndex][frameIndex] = GetLocalTransform(node, currTime);
+	}
+}
+namespace
+{
+	FbxAMatrix TranslationMatrix(const FbxVector4& translation)
+	{
+		FbxAMatrix matrix;
+		matrix.SetT(translation);
+		return matrix;
+	}
+
+	// Static transform properties and T/R/S curves of a node in one animation layer. The curves are baked to per frame
+	// values on the main thread, after which the local transforms can be rebuilt on any thread.
+	struct NodeChannels
+	{
+		FbxNode* node = nullptr;
+		int parent = -1;				// Index of the parent node's channels
+		FbxAnimCurve* curves[9] = {};	// T/R/S xyz, null when not animated
+		std::vector<float> samples[9];	// Per frame value of each animated curve
+		FbxVector4 values[3];			// Static T/R/S
+		FbxVector4 rotationOffset, rotationPivot, scalingOffset, scalingPivot;
+		FbxAMatrix preRotation, postRotationInverse;
+		EFbxRotationOrder rotationOrder = eEulerXYZ;
+
+		// Constrained or inheriting scale differently, only the scene evaluator gets those right so its results are baked instead
+		bool evaluate = false;
+		std::vector<FbxAMatrix> evaluatedLocals;
+		std::vector<FbxAMatrix> evaluatedGlobals;
+
+		void Init(FbxNode* _node, FbxAnimLayer* layer)
+		{
+			node = _node;
+
+			FbxPropertyT<FbxDouble3>* properties[3] = { &node->LclTranslation, &node->LclRotation, &node->LclScaling };
+			const char* components[3] = { FBXSDK_CURVENODE_COMPONENT_X, FBXSDK_CURVENODE_COMPONENT_Y, FBXSDK_CURVENODE_COMPONENT_Z };
+			for (int channel = 0; channel < 3; channel++)
+			{
+				values[channel] = FbxVector4(properties[channel]->Get());
+				for (int axis = 0; axis < 3; axis++)
+					curves[channel * 3 + axis] = properties[channel]->GetCurve(layer, components[axis]);
+			}
+
+			rotationOffset = node->GetRotationOffset(FbxNode::eSourcePivot);
+			rotationPivot = node->GetRotationPivot(FbxNode::eSourcePivot);
+			scalingOffset = node->GetScalingOffset(FbxNode::eSourcePivot);
+			scalingPivot = node->GetScalingPivot(FbxNode::eSourcePivot);
+
+			// Pre/post rotation and rotation order are only applied when RotationActive is set
+			preRotation.SetIdentity();
+			postRotationInverse.SetIdentity();
+			if (node->GetRotationActive())
+			{
+				preRotation.SetR(node->GetPreRotation(FbxNode::eSourcePivot));
+				FbxAMatrix postRotation;
+				postRotation.SetR(node->GetPostRotation(FbxNode::eSourcePivot));
+				postRotationInverse = postRotation.Inverse();
+				node->GetRotationOrder(FbxNode::eSourcePivot, rotationOrder);
+			}
+
+			FbxTransform::EInheritType inheritType;
+			node->GetTransformationInheritType(inheritType);
+			if (inheritType != FbxTransform::eInheritRSrs)
+				evaluate = true;
+		}
+
+		// Needs the stack to be the scene's current animation stack
+		void Bake(FbxLongLong frameCount, FbxTime::EMode timeMode)
+		{
+			if (evaluate)
+			{
+				evaluatedLocals.resize((size_t)frameCount);
+				evaluatedGlobals.resize((size_t)frameCount);
+			}
+			for (int curve = 0; curve < 9 && !evaluate; curve++)
+			{
+				if (curves[curve])
+					samples[curve].resize((size_t)frameCount);
+			}
+
+			int lastKeys[9] = {}; // Key search hints, frames are evaluated in order
+			for (FbxLongLong frameIndex = 0; frameIndex < frameCount; frameIndex++)
+			{
+				FbxTime currTime;
+				currTime.SetFrame(frameIndex, timeMode);
+
+				if (evaluate)
+				{
+					evaluatedLocals[frameIndex] = node->EvaluateLocalTransform(currTime);
+					evaluatedGlobals[frameIndex] = node->EvaluateGlobalTransform(currTime);
+					continue;
+				}
+				for (int curve = 0; curve < 9; curve++)
+				{
+					if (curves[curve])
+						samples[curve][frameIndex] = curves[curve]->Evaluate(currTime, &lastKeys[curve]);
+				}
+			}
+		}
+
+		FbxAMatrix LocalTransform(FbxLongLong frameIndex) const
+		{
+			FbxVector4 channels[3] = { values[0], values[1], values[2] };
+			for (int curve = 0; curve < 9; curve++)
+			{
+				if (!samples[curve].empty())
+					channels[curve / 3][curve % 3] = samples[curve][frameIndex];
+			}
+
+			FbxAMatrix rotation, scaling;
+			FbxRotationOrder(rotationOrder).V2M(rotation, channels[1]);
+			scaling.SetS(channels[2]);
+
+			// FBX transform chain: T * Roff * Rp * Rpre * R * Rpost^-1 * Rp^-1 * Soff * Sp * S * Sp^-1
+			return TranslationMatrix(channels[0] + rotationOffset + rotationPivot) * preRotation * rotation * postRotationInverse *
+				TranslationMatrix(scalingOffset + scalingPivot - rotationPivot) * scaling * TranslationMatrix(-scalingPivot);
+		}
+	};
+}
+
+// Baked curves of every joint and all of their ancestors for one stack, a parent always comes before its children
+struct FbxLoader::AnimationCurves
+{
+	std::vector<NodeChannels> channels;
+	std::vector<int> jointChannels;
+};
+
+void FbxLoader::Parser::BakeAnimationCurves(FbxAnimLayer* layer, const FbxLoader::Animation& result, AnimationCurves& curves)
+{
+	FbxGlobalSettings& globalSettings = pScene->GetGlobalSettings();
+	FbxTime::EMode timeMode = globalSettings.GetTimeMode();
+
+	std::vector<FbxObject*> constrained;
+	for (int i = 0; i < pScene->GetSrcObjectCount<FbxConstraint>(); i++)
+	{
+		FbxConstraint* constraint = pScene->GetSrcObject<FbxConstraint>(i);
+		for (int j = 0; j < constraint->GetConstrainedObjectCount(); j++)
+			constrained.push_back(constraint->GetConstrainedObject(j));
+	}
+
+	std::vector<NodeChannels>& channels = curves.channels;
+	std::unordered_map<FbxNode*, int> channelIndices;
+	std::function<int(FbxNode*)> addNode = [&](FbxNode* node)
+	{
+		if (!node)
+			return -1;
+		auto found = channelIndices.find(node);
+		if (found != channelIndices.end())
+			return found->second;
+
+		const int parent = addNode(node->GetParent());
+		channels.emplace_back();
+		NodeChannels& nodeChannels = channels.back();
+		nodeChannels.Init(node, layer);
+		nodeChannels.parent = parent;
+		if (std::find(constrained.begin(), constrained.end(), node) != constrained.end())
+			nodeChannels.evaluate = true;
+		nodeChannels.Bake(result.frameCount, timeMode);
+
+		channelIndices[node] = (int)channels.size() - 1;
+		return (int)channels.size() - 1;
+	};
+
+	curves.jointChannels.resize(skeleton.joints.size());
+	for (size_t boneIndex = 0; boneIndex < skeleton.joints.size(); boneIndex++)
+	{
+		curves.jointChannels[boneIndex] = addNode(skeleton.joints[boneIndex].node);
+	}
+}
+
+void FbxLoader::Parser::SampleAnimationCurves(const AnimationCurves& curves, FbxLoader::Animation& result) const
+{
+	const std::vector<NodeChannels>& channels = curves.channels;
+	for (size_t boneIndex = 0; boneIndex < skeleton.joints.size(); boneIndex++)
+	{
+		result.localTransforms[boneIndex].resize((size_t)result.frameCount);
+		result.globalTransforms[boneIndex].resize((size_t)result.frameCount);
+	}
+
+	std::vector<FbxAMatrix> locals(channels.size());
+	std::vector<FbxAMatrix> globals(channels.size());
+	for (FbxLongLong frameIndex = 0; frameIndex < result.frameCount; frameIndex++)
+	{
+		for (size_t i = 0; i < channels.size(); i++)
+		{
+			const NodeChannels& nodeChannels = channels[i];
+			if (nodeChannels.evaluate)
+			{
+				locals[i] = nodeChannels.evaluatedLocals[frameIndex];
+				globals[i] = nodeChannels.evaluatedGlobals[frameIndex];
+				continue;
+			}
+
+			locals[i] = nodeChannels.LocalTransform(frameIndex);
+			globals[i] = nodeChannels.parent == -1 ? locals[i] : globals[nodeChannels.parent] * locals[i];
+		}
+
+		for (size_t boneIndex = 0; boneIndex < skeleton.joints.size(); boneIndex++)
+		{
+			FbxAMatrix& local = result.localTransforms[boneIndex][frameIndex];
+			FbxAMatrix& global = result.globalTransforms[boneIndex][frameIndex];
+			local = locals[curves.jointChannels[boneIndex]];
+			global = globals[curves.jointChannels[boneIndex]];
+			local.SetT(local.GetT() * scaleFactor);
+			global.SetT(global.GetT() * scaleFactor);
+		}
+	}
+}
+
+FbxLoader::Animation FbxLoader::Parser::LoadAnimationInfo(FbxAnimStack* animStack) const
+{
+	FbxGlobalSettings& globalSettings = pScene->GetGlobalSettings();
+	FbxTime::EMode timeMode = globalSettings.GetTimeMode();
+
+	FbxLoader::Animation result = {};
+	result.name = animStack->GetName();
+	result.length = animStack->GetLocalTimeSpan().GetDuration().GetSecondDouble();
+	result.frameRate = animStack->GetLocalTimeSpan().GetDuration().GetFrameCountPrecise(timeMode) / result.length;
+	result.frameCount = animStack->GetLocalTimeSpan().GetDuration().GetFrameCount(timeMode);
+
+	const char* components[3] = { FBXSDK_CURVENODE_COMPONENT_X, FBXSDK_CURVENODE_COMPONENT_Y, FBXSDK_CURVENODE_COMPONENT_Z };
+	for (int i = 0; i < skeleton.joints.size(); i++)
+	{
+		FbxNode* node = skeleton.joints[i].node;
+		bool animated = false;
+		for (int layer = 0; layer < animStack->GetMemberCount<FbxAnimLayer>() && !animated; layer++)
+		{
+			FbxAnimLayer* animLayer = animStack->GetMember<FbxAnimLayer>(layer);
+			for (int axis = 0; axis < 3 && !animated; axis++)
+			{
+				animated = node->LclTranslation.GetCurve(animLayer, components[axis]) || node->LclRotation.GetCurve(animLayer, components[axis]) ||
+					node->LclScaling.GetCurve(animLayer, components[axis]);
+			}
+		}
+		if (animated)
+			result.animatedJoints.push_back(i);
+	}
+
+	return result;
+}
+FbxLoader::Animation FbxLoader::Parser::LoadAnimation(FbxAnimStack* animStack, AnimationCurves& curves)
+{
+	FbxLoader::Animation result = LoadAnimationInfo(animStack);
+
+	result.localTransforms.resize(skeleton.joints.size());
+	result.globalTransforms.resize(skeleton.joints.size());
+
+	// Blending several layers is left to the scene evaluator, a single layer can be read straight from its curves
+	if (animStack->GetMemberCount<FbxAnimLayer>() == 1)
+	{
+		BakeAnimationCurves(animStack->GetMember<FbxAnimLayer>(0), result, curves);
+		return result;
+	}
+
+	for (int i = 0; i < skeleton.joints.size(); i++)
+	{
+		LoadAnimation(&skeleton.joints[i], result);
 	}
 
 	return result;
 }
 void FbxLoader::Parser::LoadAnimations()
 {
+	PhaseScope phase(*this, LoadStats::Animations);
+
 	int animStackCount = pScene->GetSrcObjectCount<FbxAnimStack>();
 	animations.resize(animStackCount);
+
+	if (lazyAnimations)
+	{
+		for (int animIndex = 0; animIndex < animStackCount; animIndex++)
+		{
+			animations[animIndex] = LoadAnimationInfo(pScene->GetSrcObject<FbxAnimStack>(animIndex));
+		}
+
+		// The scene is kept alive for this, see LoadScene
+		decodeAnimation = [this](size_t animIndex, Animation& result)
+		{
+			FbxAnimStack* animStack = pScene->GetSrcObject<FbxAnimStack>((int)animIndex);
+			pScene->SetCurrentAnimationStack(animStack);
+
+			AnimationCurves curves;
+			result = LoadAnimation(animStack, curves);
+			if (!curves.jointChannels.empty())
+				SampleAnimationCurves(curves, result);
+			CompressAnimation(result);
+		};
+		return;
+	}
+
+	// Curves and the scene evaluator are only touched on this thread, building transforms from the baked curves
+	// and compressing is independent per stack and runs on the worker pool
+	std::vector<AnimationCurves> curves(animStackCount);
 	for (int animIndex = 0; animIndex < animStackCount; animIndex++)
 	{
 		FbxAnimStack* animStack = pScene->GetSrcObject<FbxAnimStack>(animIndex);
 		pScene->SetCurrentAnimationStack(animStack);
 
-		animations[animIndex] = LoadAnimation(animStack);
+		animations[animIndex] = LoadAnimation(animStack, curves[animIndex]);
+	}
+
+	GetWorkerPool().Run(animStackCount, [&](size_t animIndex)
+	{
+		const std::chrono::steady_clock::time_point start = activeStats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+		if (!curves[animIndex].jointChannels.empty())
+			SampleAnimationCurves(curves[animIndex], animations[animIndex]);
+		curves[animIndex] = AnimationCurves();
+		CompressAnimation(animations[animIndex]);
+
+		RecordEvent(animations[animIndex].name.Buffer(), start);
+	});
+}
+
+std::shared_ptr<const FbxLoader::Animation> FbxLoader::Parser::GetAnimation(size_t index)
+{
+	if (index >= animations.size())
+		return nullptr;
+	if (!lazyAnimations || !decodeAnimation)
+		return std::shared_ptr<const Animation>(std::shared_ptr<const Animation>(), &animations[index]);
+
+	std::lock_guard<std::mutex> lock(clipCacheMutex);
+
+	auto found = clipCache.find(index);
+	if (found != clipCache.end())
+	{
+		clipLru.splice(clipLru.begin(), clipLru, found->second.lruPosition);
+		return found->second.animation;
+	}
+
+	std::shared_ptr<Animation> animation = std::make_shared<Animation>();
+	decodeAnimation(index, *animation);
+
+	CachedClip clip;
+	clip.animation = animation;
+	clip.bytes = animation->compressed.ByteSize();
+	for (size_t joint = 0; joint < animation->localTransforms.size(); joint++)
+		clip.bytes += animation->localTransforms[joint].size() * sizeof(FbxAMatrix);
+	for (size_t joint = 0; joint < animation->globalTransforms.size(); joint++)
+		clip.bytes += animation->globalTransforms[joint].size() * sizeof(FbxAMatrix);
+
+	clipLru.push_front(index);
+	clip.lruPosition = clipLru.begin();
+	clipCacheBytes += clip.bytes;
+	clipCache[index] = clip;
+
+	// Evict the least recently used clips, the one just decoded always stays. Callers still holding an evicted clip keep it alive.
+	while (clipCacheBytes > animationCacheBudget && clipLru.size() > 1)
+	{
+		auto evicted = clipCache.find(clipLru.back());
+		clipCacheBytes -= evicted->second.bytes;
+		clipCache.erase(evicted);
+		clipLru.pop_back();
+	}
+
+	return animation;
+}
+
+void FbxLoader::Parser::CompressAnimation(Animation& animation) const
+{
+	if (!compressAnimations)
+		return;
+
+	animation.compressed.Compress(animation.localTransforms, animationCompression);
+	std::vector<std::vector<FbxAMatrix>>().swap(animation.localTransforms);
+	animation.DiscardGlobalTransforms();
+}
+
+namespace
+{
+	const int trackComponentCount[FbxLoader::CompressedClip::TrackKindCount] = { 4, 3, 3 };
+	const uint32_t maxKeyGap = 1024; // Bounds the cost of key reduction on long, nearly linear tracks
+
+	// Only rotations have four components, they are renormalized after interpolating (nlerp)
+	void InterpolateKey(const float* a, const float* b, float t, int componentCount, float* out)
+	{
+		float lengthSquared = 0.0f;
+		for (int c = 0; c < componentCount; c++)
+		{
+			out[c] = a[c] + (b[c] - a[c]) * t;
+			lengthSquared += out[c] * out[c];
+		}
+		if (componentCount == 4 && lengthSquared > 0.0f)
+		{
+			const float scale = 1.0f / std::sqrt(lengthSquared);
+			for (int c = 0; c < componentCount; c++)
+				out[c] *= scale;
+		}
+	}
+
+	bool WithinTolerance(const float* a, const float* b, int componentCount, float tolerance)
+	{
+		for (int c = 0; c < componentCount; c++)
+		{
+			if (std::fabs(a[c] - b[c]) > tolerance)
+				return false;
+		}
+		return true;
+	}
+
+	// Frames to keep a key on, dropping every frame that interpolating the kept keys around it reproduces within tolerance
+	std::vector<uint32_t> ReduceKeys(const std::vector<float>& values, uint32_t frameCount, int componentCount, float tolerance)
+	{
+		std::vector<uint32_t> keys(1, 0);
+		uint32_t start = 0;
+		float interpolated[4];
+		for (uint32_t end = 2; end < frameCount; end++)
+		{
+			bool fits = end - start <= maxKeyGap;
+			for (uint32_t frame = start + 1; frame < end && fits; frame++)
+			{
+				InterpolateKey(&values[start * componentCount], &values[end * componentCount], (float)(frame - start) / (float)(end - start), componentCount, interpolated);
+				fits = WithinTolerance(interpolated, &values[frame * componentCount], componentCount, tolerance);
+			}
+			if (!fits)
+			{
+				start = end - 1;
+				keys.push_back(start);
+			}
+		}
+		if (frameCount > 1)
+			keys.push_back(frameCount - 1);
+		return keys;
+	}
+
+	void DecodeKey(const FbxLoader::CompressedClip::Track& track, const uint8_t* data, uint32_t key, float* out)
+	{
+		typedef FbxLoader::CompressedClip::Encoding Encoding;
+		const uint8_t* keyData = data + track.dataOffset;
+		for (int c = 0; c < track.componentCount; c++)
+		{
+			const size_t component = (size_t)key * track.componentCount + c;
+			if (track.encoding == Encoding::Quantized8)
+			{
+				out[c] = track.minimum[c] + keyData[component] * track.range[c];
+			}
+			else if (track.encoding == Encoding::Quantized16)
+			{
+				uint16_t quantized;
+				memcpy(&quantized, keyData + component * 2, 2);
+				out[c] = track.minimum[c] + quantized * track.range[c];
+			}
+			else
+			{
+				memcpy(&out[c], keyData + component * 4, 4);
+			}
+		}
+	}
+}
+
+void FbxLoader::CompressedClip::Compress(const std::vector<std::vector<FbxAMatrix>>& localTransforms, const AnimationCompression& settings)
+{
+	jointCount = (uint32_t)localTransforms.size();
+	frameCount = localTransforms.empty() ? 0 : (uint32_t)localTransforms[0].size();
+	tracks.assign((size_t)jointCount * TrackKindCount, Track());
+	keyFrames.clear();
+	data.clear();
+
+	const float tolerances[TrackKindCount] = { settings.rotationTolerance, settings.translationTolerance, settings.scaleTolerance };
+	const uint32_t sampleCount = std::max(frameCount, 1u); // A clip without frames still gets one identity key
+
+	std::vector<float> values[TrackKindCount];
+	for (uint32_t joint = 0; joint < jointCount; joint++)
+	{
+		for (int kind = 0; kind < TrackKindCount; kind++)
+			values[kind].assign((size_t)sampleCount * trackComponentCount[kind], 0.0f);
+		for (uint32_t frame = 0; frame < sampleCount; frame++)
+		{
+			float* rotation = &values[Rotation][frame * 4];
+			float* translation = &values[Translation][frame * 3];
+			float* scale = &values[Scale][frame * 3];
+			if (frame >= frameCount)
+			{
+				rotation[3] = 1.0f;
+				scale[0] = scale[1] = scale[2] = 1.0f;
+				continue;
+			}
+
+			const FbxAMatrix& transform = localTransforms[joint][frame];
+			const FbxQuaternion q = transform.GetQ();
+			const FbxVector4 t = transform.GetT();
+			const FbxVector4 s = transform.GetS();
+
+			float dot = 0.0f;
+			for (int c = 0; c < 4; c++)
+			{
+				rotation[c] = (float)q[c];
+				if (frame > 0)
+					dot += rotation[c] * rotation[c - 4];
+			}
+			// Keep neighbouring rotations in the same hemisphere so interpolating them takes the short way round
+			if (dot < 0.0f)
+			{
+				for (int c = 0; c < 4; c++)
+					rotation[c] = -rotation[c];
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				translation[c] = (float)t[c];
+				scale[c] = (float)s[c];
+			}
+		}
+
+		for (int kind = 0; kind < TrackKindCount; kind++)
+			CompressTrack(tracks[joint * TrackKindCount + kind], values[kind], trackComponentCount[kind], tolerances[kind], settings.reduceKeys);
+	}
+}
+
+void FbxLoader::CompressedClip::CompressTrack(Track& track, const std::vector<float>& values, int componentCount, float tolerance, bool reduceKeys)
+{
+	track.componentCount = (uint8_t)componentCount;
+
+	bool constant = true;
+	for (uint32_t frame = 1; frame < frameCount && constant; frame++)
+		constant = WithinTolerance(&values[frame * componentCount], &values[0], componentCount, tolerance);
+	if (constant)
+	{
+		track.encoding = Encoding::Constant;
+		track.keyCount = 1;
+		memcpy(track.minimum, values.data(), componentCount * sizeof(float));
+		return;
+	}
+
+	// With key reduction, half of the tolerance goes to dropping keys and the other half to quantizing the rest
+	const float quantizeTolerance = reduceKeys ? tolerance * 0.5f : tolerance;
+	std::vector<uint32_t> keys;
+	if (reduceKeys)
+		keys = ReduceKeys(values, frameCount, componentCount, tolerance * 0.5f);
+	if (reduceKeys && keys.size() < frameCount)
+	{
+		track.firstKeyFrame = (int32_t)keyFrames.size();
+		keyFrames.insert(keyFrames.end(), keys.begin(), keys.end());
+	}
+	else
+	{
+		keys.resize(frameCount);
+		for (uint32_t frame = 0; frame < frameCount; frame++)
+			keys[frame] = frame;
+	}
+	track.keyCount = (uint32_t)keys.size();
+
+	float maximum[4];
+	float largestRange = 0.0f;
+	for (int c = 0; c < componentCount; c++)
+	{
+		track.minimum[c] = maximum[c] = values[keys[0] * componentCount + c];
+		for (uint32_t key : keys)
+		{
+			track.minimum[c] = std::min(track.minimum[c], values[key * componentCount + c]);
+			maximum[c] = std::max(maximum[c], values[key * componentCount + c]);
+		}
+		largestRange = std::max(largestRange, maximum[c] - track.minimum[c]);
+	}
+
+	// Fewest bits whose rounding error (half a step) stays within tolerance
+	uint32_t steps = 0;
+	size_t componentSize = 4;
+	if (largestRange / 255.0f * 0.5f <= quantizeTolerance)
+	{
+		track.encoding = Encoding::Quantized8;
+		steps = 255;
+		componentSize = 1;
+	}
+	else if (largestRange / 65535.0f * 0.5f <= quantizeTolerance)
+	{
+		track.encoding = Encoding::Quantized16;
+		steps = 65535;
+		componentSize = 2;
+	}
+	else
+	{
+		track.encoding = Encoding::Raw;
+	}
+	for (int c = 0; c < componentCount; c++)
+		track.range[c] = steps ? (maximum[c] - track.minimum[c]) / steps : 0.0f;
+
+	data.resize((data.size() + 3) & ~(size_t)3);
+	track.dataOffset = (uint32_t)data.size();
+	data.resize(data.size() + keys.size() * componentCount * componentSize);
+	uint8_t* out = &data[track.dataOffset];
+	for (size_t key = 0; key < keys.size(); key++)
+	{
+		for (int c = 0; c < componentCount; c++)
+		{
+			const float value = values[keys[key] * componentCount + c];
+			const size_t component = key * componentCount + c;
+			if (steps == 0)
+			{
+				memcpy(out + component * 4, &value, 4);
+				continue;
+			}
+
+			long quantized = track.range[c] > 0.0f ? std::lround((value - track.minimum[c]) / track.range[c]) : 0;
+			quantized = std::min(std::max(quantized, 0L), (long)steps);
+			if (steps == 255)
+			{
+				out[component] = (uint8_t)quantized;
+			}
+			else
+			{
+				const uint16_t quantized16 = (uint16_t)quantized;
+				memcpy(out + component * 2, &quantized16, 2);
+			}
+		}
+	}
+}
+
+void FbxLoader::CompressedClip::SampleTrack(const Track& track, double frame, float* out) const
+{
+	if (track.encoding == Encoding::Constant)
+	{
+		memcpy(out, track.minimum, track.componentCount * sizeof(float));
+		return;
+	}
+
+	frame = std::min(std::max(frame, 0.0), (double)(frameCount - 1));
+
+	uint32_t key0, key1;
+	float t;
+	if (track.firstKeyFrame < 0)
+	{
+		key0 = (uint32_t)frame;
+		key1 = std::min(key0 + 1, track.keyCount - 1);
+		t = (float)(frame - key0);
+	}
+	else
+	{
+		// Reduced tracks always keep the first and last frame, so the frame is bracketed by two keys
+		const uint32_t* frames = &keyFrames[track.firstKeyFrame];
+		key1 = (uint32_t)(std::upper_bound(frames, frames + track.keyCount, (uint32_t)frame) - frames);
+		key1 = std::min(key1, track.keyCount - 1);
+		key0 = key1 - 1;
+		t = (float)((frame - frames[key0]) / (double)(frames[key1] - frames[key0]));
+	}
+
+	float a[4], b[4];
+	DecodeKey(track, data.data(), key0, a);
+	DecodeKey(track, data.data(), key1, b);
+	InterpolateKey(a, b, t, track.componentCount, out);
+}
+
+void FbxLoader::CompressedClip::SampleJoint(int joint, double frame, FbxQuaternion& rotation, FbxVector4& translation, FbxVector4& scale) const
+{
+	const Track* jointTracks = &tracks[(size_t)joint * TrackKindCount];
+	float values[4];
+
+	SampleTrack(jointTracks[Rotation], frame, values);
+	rotation = FbxQuaternion(values[0], values[1], values[2], values[3]);
+	SampleTrack(jointTracks[Translation], frame, values);
+	translation = FbxVector4(values[0], values[1], values[2]);
+	SampleTrack(jointTracks[Scale], frame, values);
+	scale = FbxVector4(values[0], values[1], values[2]);
+}
+
+FbxAMatrix FbxLoader::CompressedClip::SampleLocal(int joint, double frame) const
+{
+	FbxQuaternion rotation;
+	FbxVector4 translation, scale;
+	SampleJoint(joint, frame, rotation, translation, scale);
+
+	FbxAMatrix transform;
+	transform.SetTQS(translation, rotation, scale);
+	return transform;
+}
+
+void FbxLoader::CompressedClip::Sample(double frame, JointPose* out) const
+{
+	for (uint32_t joint = 0; joint < jointCount; joint++)
+	{
+		const Track* jointTracks = &tracks[(size_t)joint * TrackKindCount];
+		SampleTrack(jointTracks[Rotation], frame, out[joint].rotation);
+		SampleTrack(jointTracks[Translation], frame, out[joint].translation);
+		SampleTrack(jointTracks[Scale], frame, out[joint].scale);
+		out[joint].translation[3] = 0.0f;
+		out[joint].scale[3] = 0.0f;
+	}
+}
+
+namespace
+{
+	void DecomposeTransform(const FbxAMatrix& transform, FbxLoader::JointPose& out)
+	{
+		const FbxQuaternion rotation = transform.GetQ();
+		const FbxVector4 translation = transform.GetT();
+		const FbxVector4 scale = transform.GetS();
+		for (int c = 0; c < 4; c++)
+			out.rotation[c] = (float)rotation[c];
+		for (int c = 0; c < 3; c++)
+		{
+			out.translation[c] = (float)translation[c];
+			out.scale[c] = (float)scale[c];
+		}
+		out.translation[3] = 0.0f;
+		out.scale[3] = 0.0f;
+	}
+
+	// Same as FbxAMatrix::SetTQS, rows 0-2 are the rotated and scaled axes, row 3 the translation
+	void ComposeTransform(const FbxLoader::JointPose& pose, FbxLoader::Float4x4& out)
+	{
+		const float x = pose.rotation[0], y = pose.rotation[1], z = pose.rotation[2], w = pose.rotation[3];
+		const float xx = x * x, yy = y * y, zz = z * z;
+		const float xy = x * y, xz = x * z, yz = y * z;
+		const float wx = w * x, wy = w * y, wz = w * z;
+		const float sx = pose.scale[0], sy = pose.scale[1], sz = pose.scale[2];
+
+		float* m = out.m;
+		m[0] = (1.0f - 2.0f * (yy + zz)) * sx;	m[1] = 2.0f * (xy + wz) * sx;			m[2] = 2.0f * (xz - wy) * sx;			m[3] = 0.0f;
+		m[4] = 2.0f * (xy - wz) * sy;			m[5] = (1.0f - 2.0f * (xx + zz)) * sy;	m[6] = 2.0f * (yz + wx) * sy;			m[7] = 0.0f;
+		m[8] = 2.0f * (xz + wy) * sz;			m[9] = 2.0f * (yz - wx) * sz;			m[10] = (1.0f - 2.0f * (xx + yy)) * sz;	m[11] = 0.0f;
+		m[12] = pose.translation[0];			m[13] = pose.translation[1];			m[14] = pose.translation[2];			m[15] = 1.0f;
+	}
+
+	// out = parent * local in FbxAMatrix terms, each output row is the local row's components weighting the parent rows
+	void MultiplyTransforms(const FbxLoader::Float4x4& parent, const FbxLoader::Float4x4& local, FbxLoader::Float4x4& out)
+	{
+#if defined(__SSE2__) || defined(_M_X64)
+		const __m128 parent0 = _mm_load_ps(parent.m);
+		const __m128 parent1 = _mm_load_ps(parent.m + 4);
+		const __m128 parent2 = _mm_load_ps(parent.m + 8);
+		const __m128 parent3 = _mm_load_ps(parent.m + 12);
+		for (int row = 0; row < 4; row++)
+		{
+			const float* l = local.m + row * 4;
+			__m128 result = _mm_mul_ps(parent0, _mm_set1_ps(l[0]));
+			result = _mm_add_ps(result, _mm_mul_ps(parent1, _mm_set1_ps(l[1])));
+			result = _mm_add_ps(result, _mm_mul_ps(parent2, _mm_set1_ps(l[2])));
+			result = _mm_add_ps(result, _mm_mul_ps(parent3, _mm_set1_ps(l[3])));
+			_mm_store_ps(out.m + row * 4, result);
+		}
+#else
+		for (int row = 0; row < 4; row++)
+		{
+			for (int column = 0; column < 4; column++)
+			{
+				out.m[row * 4 + column] = parent.m[column] * local.m[row * 4] + parent.m[4 + column] * local.m[row * 4 + 1] +
+					parent.m[8 + column] * local.m[row * 4 + 2] + parent.m[12 + column] * local.m[row * 4 + 3];
+			}
+		}
+#endif
+	}
+}
+
+void FbxLoader::Animation::Sample(double time, Pose& pose) const
+{
+	double frame = time * frameRate;
+	if (!compressed.Empty())
+	{
+		pose.Resize(compressed.jointCount);
+		compressed.Sample(frame, pose.local.data());
+		return;
+	}
+
+	pose.Resize(localTransforms.size());
+	if (frameCount <= 0)
+	{
+		for (JointPose& joint : pose.local)
+			joint = { { 0.0f, 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f, 1.0f, 0.0f } };
+		return;
+	}
+
+	frame = std::min(std::max(frame, 0.0), (double)(frameCount - 1));
+	const size_t frame0 = (size_t)frame;
+	const size_t frame1 = std::min(frame0 + 1, (size_t)frameCount - 1);
+	const float t = (float)(frame - frame0);
+
+	for (size_t joint = 0; joint < localTransforms.size(); joint++)
+	{
+		JointPose a, b;
+		DecomposeTransform(localTransforms[joint][frame0], a);
+		DecomposeTransform(localTransforms[joint][frame1], b);
+
+		float dot = 0.0f;
+		for (int c = 0; c < 4; c++)
+			dot += a.rotation[c] * b.rotation[c];
+		if (dot < 0.0f)
+		{
+			for (int c = 0; c < 4; c++)
+				b.rotation[c] = -b.rotation[c];
+		}
+
+		JointPose& out = pose.local[joint];
+		InterpolateKey(a.rotation, b.rotation, t, 4, out.rotation);
+		InterpolateKey(a.translation, b.translation, t, 3, out.translation);
+		InterpolateKey(a.scale, b.scale, t, 3, out.scale);
+		out.translation[3] = 0.0f;
+		out.scale[3] = 0.0f;
+	}
+}
+
+void FbxLoader::Skeleton::LocalToModel(Pose& pose) const
+{
+	LocalToModel(&pose, 1);
+}
+
+void FbxLoader::Skeleton::LocalToModel(Pose* poses, size_t poseCount) const
+{
+	std::vector<int> parents(joints.size());
+	for (size_t joint = 0; joint < joints.size(); joint++)
+	{
+		parents[joint] = joints[joint].parentIndex;
+		assert(parents[joint] < (int)joint);
+	}
+
+	for (size_t poseIndex = 0; poseIndex < poseCount; poseIndex++)
+	{
+		Pose& pose = poses[poseIndex];
+		const size_t jointCount = std::min(parents.size(), pose.local.size());
+		pose.model.resize(pose.local.size());
 
-		if (animStackCount > 1)
-			break;
+		Float4x4 local;
+		for (size_t joint = 0; joint < jointCount; joint++)
+		{
+			if (parents[joint] < 0)
+			{
+				ComposeTransform(pose.local[joint], pose.model[joint]);
+				continue;
+			}
+			ComposeTransform(pose.local[joint], local);
+			MultiplyTransforms(pose.model[parents[joint]], local, pose.model[joint]);
+		}
 	}
 }
 
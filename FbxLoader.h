@@ -1,16 +1,27 @@
 #ifndef FBXPARSER_H
 #define FBXPARSER_H
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
 #include <vector>
+#include <unordered_map>
 #include "fbxsdk.h"
 
-// Configuration
-#define MAX_VERTEX_BONES 4
-#define FLIP_UV_Y 1
-#define SPLIT_MESH_MATERIAL 1
-
 namespace FbxLoader
 {
+	const int MaxVertexBones = 8;		// Joint slots a VertexLayout can ask for through maxBones
+	const int InlineVertexBones = 4;	// Joint slots of Mesh::VertexData, the rest are kept in Mesh::extraJoints
+	const int PackedVertexBones = 4;	// Joint slots of CompactVertex and QuantizedVertex
+
 	struct Joint 
 	{
 		fbxsdk::FbxString jointName;
@@ -29,10 +40,17 @@ namespace FbxLoader
 		}
 	};
 
+	struct Pose;
+
 	struct Skeleton
 	{
-		std::vector<Joint> joints;
-		std::unordered_map<std::string, int> jointMap;
+		std::vector<Joint> joints;	// Parents always come before their children
+		std::unordered_map<std::string, int> jointMap; // Joint index by name, the first one when names repeat
+
+		// Fill Pose::model from Pose::local with one pass over the joints, the batch version shares the hierarchy walk setup between poses
+		void LocalToModel(Pose& pose) const;
+		void LocalToModel(Pose* poses, size_t poseCount) const;
+
 		void Print()
 		{
 			for (int i = 0; i < joints.size(); i++)
@@ -61,6 +79,242 @@ namespace FbxLoader
 		}
 	};
 
+	enum class VertexFormat
+	{
+		Full,		// Mesh::vertices, double precision VertexData
+		Compact,	// Mesh::compactVertices, float positions
+		Quantized,	// Mesh::quantizedVertices, 16 bit positions within the mesh bounds
+		Streams		// Mesh::streams, one aligned array per attribute
+	};
+
+	enum class VertexAttribute
+	{
+		Position,
+		Normal,
+		Tangent,
+		UV,
+		Color,
+		JointIndices,
+		JointWeights
+	};
+
+	// Vertex attributes a Parser reads and keeps, and how many joints may influence a vertex. Attributes left out are never read
+	// from the file, and the per polygon-vertex build loop is instantiated for each attribute set so they cost nothing there.
+	// Parsers with different layouts can be used side by side.
+	struct VertexLayout
+	{
+		unsigned int attributes = 0x7F;	// Bit (1 << VertexAttribute) per attribute, Position is always kept
+		int maxBones = 4;				// Up to MaxVertexBones, 0 drops skinning
+		bool flipUVY = true;			// Flip V so the UV origin is the top left
+
+		bool Has(VertexAttribute attribute) const { return (attributes & (1u << (int)attribute)) != 0; }
+		bool HasSkin() const { return maxBones > 0 && Has(VertexAttribute::JointIndices); }
+
+		// Position, normal and UV only
+		static VertexLayout StaticProp()
+		{
+			VertexLayout layout;
+			layout.attributes = (1u << (int)VertexAttribute::Position) | (1u << (int)VertexAttribute::Normal) | (1u << (int)VertexAttribute::UV);
+			layout.maxBones = 0;
+			return layout;
+		}
+
+		// Every attribute with MaxVertexBones influences
+		static VertexLayout Character()
+		{
+			VertexLayout layout;
+			layout.maxBones = MaxVertexBones;
+			return layout;
+		}
+	};
+
+	// Allocator for SIMD friendly arrays, storage starts on an Alignment byte boundary
+	template<class T, size_t Alignment = 64>
+	struct AlignedAllocator
+	{
+		typedef T value_type;
+		template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+		AlignedAllocator() = default;
+		template<class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+		T* allocate(size_t count) { return (T*)::operator new(count * sizeof(T), std::align_val_t(Alignment)); }
+		void deallocate(T* pointer, size_t) { ::operator delete(pointer, std::align_val_t(Alignment)); }
+
+		bool operator==(const AlignedAllocator&) const { return true; }
+		bool operator!=(const AlignedAllocator&) const { return false; }
+	};
+	template<class T>
+	using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+	// Joint transform as a float rotation quaternion (xyzw), translation and scale. w of translation and scale is unused.
+	struct alignas(16) JointPose
+	{
+		float rotation[4];
+		float translation[4];
+		float scale[4];
+	};
+
+	// Float matrix in the same memory layout as FbxAMatrix, four 16 byte rows with the translation in the last one
+	struct alignas(64) Float4x4
+	{
+		float m[16];
+	};
+
+	// Skeleton pose at one point in time, see Animation::Sample and Skeleton::LocalToModel
+	struct Pose
+	{
+		std::vector<JointPose, AlignedAllocator<JointPose>> local;	// Joint to parent
+		std::vector<Float4x4, AlignedAllocator<Float4x4>> model;	// Joint to model
+
+		void Resize(size_t jointCount)
+		{
+			local.resize(jointCount);
+			model.resize(jointCount);
+		}
+	};
+
+	// Structure of arrays vertex storage used by VertexFormat::Streams. Each attribute is its own contiguous,
+	// 64 byte aligned array and only the attributes listed in descriptors are filled.
+	struct VertexStreams
+	{
+		struct Descriptor
+		{
+			VertexAttribute attribute;
+			int componentCount;		// Components per vertex
+			size_t componentSize;	// Bytes per component
+		};
+
+		size_t vertexCount = 0;
+		std::vector<Descriptor> descriptors;
+
+		AlignedVector<float> positions;			// xyz
+		AlignedVector<float> normals;			// xyz
+		AlignedVector<float> tangents;			// xyz, w is the binormal sign
+		AlignedVector<float> uvs;				// uv
+		AlignedVector<float> colors;			// rgba
+		AlignedVector<uint16_t> jointIndices;	// VertexLayout::maxBones skeleton joint indices per vertex
+		AlignedVector<float> jointWeights;		// VertexLayout::maxBones per vertex
+
+		bool Has(VertexAttribute attribute) const
+		{
+			for (const Descriptor& descriptor : descriptors)
+			{
+				if (descriptor.attribute == attribute)
+					return true;
+			}
+			return false;
+		}
+
+		const void* Data(VertexAttribute attribute) const
+		{
+			switch (attribute)
+			{
+			case VertexAttribute::Position: return positions.data();
+			case VertexAttribute::Normal: return normals.data();
+			case VertexAttribute::Tangent: return tangents.data();
+			case VertexAttribute::UV: return uvs.data();
+			case VertexAttribute::Color: return colors.data();
+			case VertexAttribute::JointIndices: return jointIndices.data();
+			case VertexAttribute::JointWeights: return jointWeights.data();
+			}
+			return nullptr;
+		}
+	};
+
+	// Packed vertex layouts shared by VertexFormat::Compact and VertexFormat::Quantized.
+	// Normals and tangents are octahedral encoded snorm16 pairs. Bit 0 of tangent[1] is set when the binormal
+	// is -cross(normal, tangent) instead of cross(normal, tangent). UVs are half floats, colors are unorm8,
+	// joint indices point into Mesh::jointPalette and joint weights are unorm16.
+	struct CompactVertex
+	{
+		float position[3];
+		int16_t normal[2];
+		int16_t tangent[2];
+		uint16_t uv[2];
+		uint8_t color[4];
+		uint8_t jointIndices[PackedVertexBones];
+		uint16_t jointWeights[PackedVertexBones];
+	};
+	struct QuantizedVertex
+	{
+		uint16_t position[4];	// unorm16 between Mesh::boundsMin and Mesh::boundsMax, w is unused
+		int16_t normal[2];
+		int16_t tangent[2];
+		uint16_t uv[2];
+		uint8_t color[4];
+		uint8_t jointIndices[PackedVertexBones];
+		uint16_t jointWeights[PackedVertexBones];
+	};
+
+	// Triangle index storage. Indices are kept as 16 bit until one doesn't fit, then the whole buffer is widened to 32 bit,
+	// so a mesh only ever holds one copy in the narrowest width that works for it.
+	class IndexBuffer
+	{
+	public:
+		static const size_t ShortVertexLimit = 65535; // Vertex count Parser::splitLargeMeshes keeps meshes below, 0xFFFF stays free for primitive restart
+
+		size_t size() const { return wide ? indices32.size() : indices16.size(); }
+		bool empty() const { return size() == 0; }
+		uint32_t operator[](size_t index) const { return wide ? indices32[index] : indices16[index]; }
+
+		int Width() const { return wide ? 4 : 2; } // Bytes per index
+		size_t ByteSize() const { return size() * Width(); }
+		const void* data() const { return wide ? (const void*)indices32.data() : (const void*)indices16.data(); }
+		const uint16_t* Data16() const { return wide ? nullptr : indices16.data(); }
+		const uint32_t* Data32() const { return wide ? indices32.data() : nullptr; }
+
+		void reserve(size_t count)
+		{
+			if (wide)
+				indices32.reserve(count);
+			else
+				indices16.reserve(count);
+		}
+
+		void assign(const void* indices, size_t count, int width)
+		{
+			clear();
+			wide = width == 4;
+			if (wide)
+				indices32.assign((const uint32_t*)indices, (const uint32_t*)indices + count);
+			else
+				indices16.assign((const uint16_t*)indices, (const uint16_t*)indices + count);
+		}
+
+		void clear()
+		{
+			std::vector<uint16_t>().swap(indices16);
+			std::vector<uint32_t>().swap(indices32);
+			wide = false;
+		}
+
+		void push_back(uint32_t index)
+		{
+			if (!wide && index > 0xFFFF)
+				Widen();
+			if (wide)
+				indices32.push_back(index);
+			else
+				indices16.push_back((uint16_t)index);
+		}
+
+		void Widen()
+		{
+			if (wide)
+				return;
+			indices32.reserve(indices16.capacity());
+			indices32.assign(indices16.begin(), indices16.end());
+			std::vector<uint16_t>().swap(indices16);
+			wide = true;
+		}
+
+	private:
+		std::vector<uint16_t> indices16;
+		std::vector<uint32_t> indices32;
+		bool wide = false;
+	};
+
 	struct Mesh
 	{
 		struct VertexData
@@ -74,27 +328,173 @@ namespace FbxLoader
 			int materialIndex = 0;
 
 			int jointCount = {};
-			unsigned int jointIndices[MAX_VERTEX_BONES] = {};
-			float jointWeights[MAX_VERTEX_BONES] = {};
+			unsigned int jointIndices[InlineVertexBones] = {};
+			float jointWeights[InlineVertexBones] = {};
 		};
-		static inline size_t hash_vert(VertexData& data) // This is one ghetto ass hashing function. Should probably use something already available.
-		{
-			char* byte_array = (char*)&data;
-			size_t hash = 0;
-
-			for (int i = 0; i < sizeof(data); i++)
-				hash = hash * 31 + byte_array[i];
 
-			return hash;
-		}
+		// Joint slots InlineVertexBones and up of a vertex
+		struct ExtraJoints
+		{
+			unsigned int jointIndices[MaxVertexBones - InlineVertexBones] = {};
+			float jointWeights[MaxVertexBones - InlineVertexBones] = {};
+		};
 
-		std::vector<size_t> indices;
-		std::vector<VertexData> vertices;
+		IndexBuffer indices;
+		std::vector<VertexData> vertices;			// Emptied when a packed vertex format is selected
+		std::vector<ExtraJoints> extraJoints;		// Parallel to vertices when VertexLayout::maxBones is above InlineVertexBones, empty otherwise
+		std::vector<CompactVertex> compactVertices;
+		std::vector<QuantizedVertex> quantizedVertices;
+		std::vector<int> jointPalette;				// Skeleton joint index of each packed joint index
+		VertexStreams streams;
+		unsigned int attributes = 0;				// Bit (1 << VertexAttribute) for every attribute the source mesh had
+		float boundsMin[3] = {};
+		float boundsMax[3] = {};
 
 		fbxsdk::FbxAMatrix meshToWorld;
 
 		fbxsdk::FbxString materialName;
 		int materialIndex;
+
+		// Joint slot bone of a vertex, bone must be below its jointCount
+		unsigned int JointIndex(size_t vertex, int bone) const
+		{
+			return bone < InlineVertexBones ? vertices[vertex].jointIndices[bone] : extraJoints[vertex].jointIndices[bone - InlineVertexBones];
+		}
+		float JointWeight(size_t vertex, int bone) const
+		{
+			return bone < InlineVertexBones ? vertices[vertex].jointWeights[bone] : extraJoints[vertex].jointWeights[bone - InlineVertexBones];
+		}
+
+		// Index range drawn with one scene material
+		struct DrawRange
+		{
+			int materialIndex;
+			uint32_t firstIndex;
+			uint32_t indexCount;
+		};
+		std::vector<DrawRange> drawRanges; // With Parser::materialDrawRanges, triangles are grouped by material in this order
+
+		// Coarser triangle list over the same vertices
+		struct Lod
+		{
+			IndexBuffer indices;
+			std::vector<DrawRange> drawRanges; // Ranges of Mesh::drawRanges in the same order, a range the level lost entirely is dropped
+			float error; // Largest surface deviation of the level relative to the mesh extent
+		};
+		std::vector<Lod> lods; // With Parser::generateLods, finest first
+
+		// Triangle cluster for GPU culling, never spans draw ranges
+		struct Meshlet
+		{
+			uint32_t vertexOffset;		// First entry in meshletVertices
+			uint32_t triangleOffset;	// First byte in meshletTriangles
+			uint32_t vertexCount;
+			uint32_t triangleCount;
+			int materialIndex;
+			float center[3];			// Bounding sphere
+			float radius;
+			float coneApex[3];			// Every triangle faces away from a camera at p when dot(normalize(coneApex - p), coneAxis) >= coneCutoff
+			float coneAxis[3];
+			float coneCutoff;
+		};
+		std::vector<Meshlet> meshlets;			// With Parser::generateMeshlets, built from indices
+		std::vector<uint32_t> meshletVertices;	// Mesh vertex of each meshlet local vertex
+		std::vector<uint8_t> meshletTriangles;	// Three meshlet local vertices per triangle, each meshlet padded to four bytes
+	};
+
+	// Index and vertex order optimization run on every mesh after welding, see FbxOptimize.cpp
+	struct MeshOptimization
+	{
+		int cacheSize = 16; // FIFO post-transform cache entries assumed by Tipsify and by the ACMR/ATVR figures
+		float overdrawThreshold = 1.05f; // Triangle clusters are sorted for overdraw while their ACMR stays within this factor of the mesh, 0 keeps the Tipsify order
+		bool reorderVertices = true; // Renumber vertices in first use order so fetches are sequential, unreferenced vertices are dropped
+	};
+
+	// Level of detail chain built from every mesh with Parser::generateLods, see FbxOptimize.cpp
+	struct LodLevel
+	{
+		float ratio;	// Target triangle count as a fraction of the full mesh
+		float maxError;	// The level stops short of ratio once a collapse would move the surface further than this, relative to the mesh extent
+	};
+	struct LodGeneration
+	{
+		std::vector<LodLevel> levels = { { 0.5f, 0.01f }, { 0.25f, 0.02f }, { 0.125f, 0.05f } }; // Each level continues from the one before
+		float attributeWeight = 0.01f; // Cost of normal, UV, color and skin weight changes against the squared relative position error
+	};
+
+	// Limits of the clusters built with Parser::generateMeshlets, see FbxOptimize.cpp
+	struct MeshletGeneration
+	{
+		int maxVertices = 64;	// Up to 256, local indices are 8 bit
+		int maxTriangles = 124;	// Up to 512
+		float coneWeight = 0.25f; // Favor triangles facing like the rest of the meshlet for tighter normal cones, 0 only looks at distance
+	};
+
+	// Post-transform cache efficiency of an index buffer under a FIFO cache
+	struct VertexCacheStats
+	{
+		size_t misses = 0;
+		size_t referencedVertices = 0;
+		float acmr = 0.0f; // Cache misses per triangle, 3 at worst
+		float atvr = 0.0f; // Cache misses per referenced vertex, 1 at best
+	};
+	VertexCacheStats AnalyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, int cacheSize);
+
+	// Error bounds used when compressing animation clips, in loader units (quaternion components for rotation)
+	struct AnimationCompression
+	{
+		float rotationTolerance = 0.0001f;
+		float translationTolerance = 0.0001f;
+		float scaleTolerance = 0.0001f;
+		bool reduceKeys = false; // Drop keys that interpolating their neighbours reproduces within the tolerance
+	};
+
+	// Animation clip stored as a rotation, translation and scale track per joint. A track is constant when every frame
+	// is within tolerance of the first one, otherwise its keys are quantized to the fewest bits that stay within tolerance.
+	// Tracks are sampled directly, rotation keys are nlerped.
+	struct CompressedClip
+	{
+		enum TrackKind { Rotation, Translation, Scale, TrackKindCount };
+
+		enum class Encoding : uint8_t
+		{
+			Constant,		// Value is Track::minimum
+			Quantized8,		// unorm8 per component, value = minimum + q * range
+			Quantized16,	// unorm16 per component
+			Raw				// float per component
+		};
+
+		struct Track
+		{
+			Encoding encoding = Encoding::Constant;
+			uint8_t componentCount = 0;		// 4 for rotation xyzw, 3 for translation/scale
+			uint32_t keyCount = 0;
+			int32_t firstKeyFrame = -1;		// Offset into keyFrames when keys were reduced, -1 when every frame has a key
+			uint32_t dataOffset = 0;		// Byte offset into data
+			float minimum[4] = {};
+			float range[4] = {};			// Per unit of the quantized value
+		};
+
+		uint32_t jointCount = 0;
+		uint32_t frameCount = 0;
+		std::vector<Track> tracks;			// [joint * TrackKindCount + kind]
+		std::vector<uint32_t> keyFrames;	// Frame of each key of reduced tracks
+		std::vector<uint8_t> data;
+
+		bool Empty() const { return tracks.empty(); }
+		size_t ByteSize() const { return tracks.size() * sizeof(Track) + keyFrames.size() * sizeof(uint32_t) + data.size(); }
+
+		// Build from [joint][frame] local transforms, which are decomposed into TRS
+		void Compress(const std::vector<std::vector<fbxsdk::FbxAMatrix>>& localTransforms, const AnimationCompression& settings);
+
+		// Sample at a fractional frame, clamped to the clip
+		void SampleJoint(int joint, double frame, fbxsdk::FbxQuaternion& rotation, fbxsdk::FbxVector4& translation, fbxsdk::FbxVector4& scale) const;
+		fbxsdk::FbxAMatrix SampleLocal(int joint, double frame) const;
+		void Sample(double frame, JointPose* out) const; // Every joint at once, out holds jointCount entries
+
+	private:
+		void CompressTrack(Track& track, const std::vector<float>& values, int componentCount, float tolerance, bool reduceKeys);
+		void SampleTrack(const Track& track, double frame, float* out) const;
 	};
 
 	struct Animation
@@ -104,8 +504,19 @@ namespace FbxLoader
 		fbxsdk::FbxDouble frameRate;
 		fbxsdk::FbxLongLong frameCount;
 		
-		fbxsdk::FbxAMatrix** localTransforms;	// [boneIndex][frameIndex]
-		fbxsdk::FbxAMatrix** globalTransforms;	// [boneIndex][frameIndex]
+		std::vector<std::vector<fbxsdk::FbxAMatrix>> localTransforms;	// [boneIndex][frameIndex], empty when compressed
+		std::vector<std::vector<fbxsdk::FbxAMatrix>> globalTransforms;	// [boneIndex][frameIndex], empty when compressed or discarded
+		CompressedClip compressed;										// Filled instead of the matrices when Parser::compressAnimations is set
+		std::vector<int> animatedJoints;								// Joints with at least one animated channel
+
+		void DiscardGlobalTransforms()
+		{
+			std::vector<std::vector<fbxsdk::FbxAMatrix>>().swap(globalTransforms);
+		}
+
+		// Local joint transforms at time seconds, interpolated between frames with rotations nlerped. Follow with
+		// Skeleton::LocalToModel for model space matrices.
+		void Sample(double time, Pose& pose) const;
 
 		fbxsdk::FbxAMatrix CalcGlobalTransform(int boneIndex, fbxsdk::FbxLongLong frameIndex, Skeleton* skeleton) // Manual way of calculating global transform for a bone.
 		{
@@ -116,62 +527,425 @@ namespace FbxLoader
 				return identity;
 			}
 
-			fbxsdk::FbxAMatrix local = localTransforms[boneIndex][frameIndex];
+			fbxsdk::FbxAMatrix local = compressed.Empty() ? localTransforms[boneIndex][frameIndex] : compressed.SampleLocal(boneIndex, (double)frameIndex);
 			fbxsdk::FbxAMatrix parentGlobal = CalcGlobalTransform(skeleton->joints[boneIndex].parentIndex, frameIndex, skeleton);
-			globalTransforms[boneIndex][frameIndex] = parentGlobal * local;
+			fbxsdk::FbxAMatrix global = parentGlobal * local;
+			if (!globalTransforms.empty())
+				globalTransforms[boneIndex][frameIndex] = global;
 
-			return globalTransforms[boneIndex][frameIndex];
+			return global;
 		}
 	};
 
+	// Four lane multiply-accumulate hash in the style of XXH3, wordCount must be a multiple of four
+	uint64_t HashWords(const uint64_t* words, size_t wordCount);
+
+	// Deduplicates vertices through an open addressing table. Only attribute values are hashed, never struct padding,
+	// and candidates with a matching hash are compared in full, so a collision can't merge two different vertices.
+	// With a non zero epsilon attributes are snapped to a grid of that step, vertices in the same cell are welded.
+	class VertexWelder
+	{
+	public:
+		// With extraJoints, the extra joint slots are welded too and kept parallel to vertices
+		VertexWelder(std::vector<Mesh::VertexData>& vertices, size_t expectedCount = 0, double epsilon = 0.0,
+			std::vector<Mesh::ExtraJoints>* extraJoints = nullptr);
+
+		void Reserve(size_t expectedCount);
+		void Clear(); // Forget the welded vertices, the vertex array itself is left untouched
+
+		// Index of an equal vertex welded earlier, or of vertex after appending it to the vertex array
+		size_t Weld(const Mesh::VertexData& vertex, const Mesh::ExtraJoints* extra = nullptr);
+
+		size_t ProbeCount() const { return probeCount; }
+
+	private:
+		// Position, normal and binormal xyz, tangent xyzw, uv, color, then material/joint count, joint indices and weights, padded to
+		// whole hash lanes. The extra joint indices and weights follow in their own lanes when extra joints are welded.
+		static const int InlineKeyWords = (19 + 1 + (InlineVertexBones + 1) / 2 * 2 + 3) / 4 * 4;
+		static const int KeyWords = InlineKeyWords + ((MaxVertexBones - InlineVertexBones + 1) / 2 * 2 + 3) / 4 * 4;
+
+		struct Slot
+		{
+			uint32_t hash;
+			uint32_t index; // Vertex index + 1, 0 marks an empty slot
+		};
+
+		std::vector<Mesh::VertexData>& vertices;
+		std::vector<Mesh::ExtraJoints>* extraJoints;
+		int keyWords;
+		std::vector<Slot> slots;
+		size_t used = 0;
+		size_t probeCount = 0;
+		double epsilon;
+
+		void BuildKey(const Mesh::VertexData& vertex, const Mesh::ExtraJoints* extra, uint64_t* key) const;
+		void Rehash(size_t capacity);
+	};
+
+	// Bump allocator for the temporaries of a mesh build. Allocations are never freed one by one, Reset drops them all
+	// and keeps the memory, merged into a single block when they didn't fit in one, so a thread building mesh after
+	// mesh stops allocating once it has built its largest one.
+	class ScratchArena
+	{
+	public:
+		explicit ScratchArena(size_t blockSize = 1 << 16);
+
+		ScratchArena(const ScratchArena&) = delete;
+		ScratchArena& operator=(const ScratchArena&) = delete;
+
+		// Uninitialized storage for count values of a trivially copyable type, valid until the next Reset
+		template<class T>
+		T* Allocate(size_t count) { return static_cast<T*>(AllocateBytes(count * sizeof(T), alignof(T))); }
+
+		void Reset();
+
+	private:
+		std::vector<std::unique_ptr<char[]>> blocks;
+		size_t blockSize;
+		size_t capacity = 0;	// Of the last block
+		size_t used = 0;		// In the last block
+		size_t allocated = 0;	// Since the last reset, with room for alignment
+
+		void* AllocateBytes(size_t size, size_t alignment);
+	};
+
+	// Triangulated, un-welded mesh data gathered from a scene. Attribute arrays hold one entry per polygon-vertex
+	// (three per triangle) and are left empty when the mesh has no such layer.
+	// The SDK path only copies the raw layers out of the scene, DecodeLayers expands them so it can run off the main thread.
+	struct MeshSource
+	{
+		struct Cluster
+		{
+			fbxsdk::FbxString jointName;
+			std::vector<int> indices;
+			std::vector<double> weights;
+		};
+
+		template<class T>
+		struct Layer
+		{
+			FbxLayerElement::EMappingMode mappingMode = FbxLayerElement::eNone;
+			FbxLayerElement::EReferenceMode referenceMode = FbxLayerElement::eDirect;
+			std::vector<T> directArray;
+			std::vector<int> indexArray;
+		};
+
+		fbxsdk::FbxAMatrix transform;
+		std::vector<FbxVector4> controlPoints;
+		std::vector<int> polygonVertices;	// Control point index per polygon-vertex
+		std::vector<FbxVector4> normals;
+		std::vector<FbxVector4> binormals;
+		std::vector<FbxVector4> tangents;
+		std::vector<FbxVector2> uvs;
+		std::vector<FbxColor> colors;
+		std::vector<int> materials;			// Scene material index per triangle
+		std::vector<Cluster> clusters;
+
+		Layer<FbxVector4> normalLayer;
+		Layer<FbxVector4> binormalLayer;
+		Layer<FbxVector4> tangentLayer;
+		Layer<FbxVector2> uvLayer;
+		Layer<FbxColor> colorLayer;
+		Layer<int> materialLayer;			// Node material slot per polygon
+		std::vector<int> materialRemap;		// Node material slot to scene material index
+
+		void DecodeLayers(bool flipUVY); // Fill the per polygon-vertex arrays from the raw layers and release them
+		void ApplyTransform(double scaleFactor); // Bake transform into the control points and the per polygon-vertex directions
+	};
+
+	// Fixed set of threads running indexed jobs. Each thread starts on its own contiguous range of job indices
+	// and steals from the back of the other ranges once it runs dry, so uneven jobs still balance out.
+	class WorkerPool
+	{
+	public:
+		explicit WorkerPool(int threadCount); // Total threads including the caller of Run, 0 for hardware concurrency
+		~WorkerPool();
+
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+
+		int ThreadCount() const { return (int)threads.size() + 1; }
+
+		// Call job(index) for every index in [0, jobCount) and wait for all of them. The first exception thrown by a job is rethrown here.
+		void Run(size_t jobCount, const std::function<void(size_t)>& job);
+
+	private:
+		struct Queue
+		{
+			std::mutex mutex;
+			size_t begin = 0;
+			size_t end = 0;
+		};
+
+		std::vector<std::thread> threads;
+		std::unique_ptr<Queue[]> queues;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+		const std::function<void(size_t)>* job = nullptr;
+		std::exception_ptr failure;
+		unsigned long long generation = 0;
+		int busy = 0;
+		bool stopping = false;
+
+		void WorkerMain(int worker);
+		void Drain(int worker);
+		bool Pop(int worker, size_t& index);
+		bool Steal(int worker, size_t& index);
+	};
+
+	// Content hash of a whole file built from HashWords, chunks are hashed in parallel when a pool is given. Returns 0 if the file can't be read.
+	// Defined in FbxCache.cpp, which also needs FbxBinary.cpp for memory mapping.
+	uint64_t HashFile(const char* path, WorkerPool* pool = nullptr);
+
+	namespace Binary
+	{
+		class Scene;
+	}
+
+	struct AnimationCurves;
+
+	// Where the time of the last load went, filled in when Parser::collectStats is set or a trace file is given
+	struct LoadStats
+	{
+		enum Phase
+		{
+			Cache,			// LoadCache and SaveCache
+			Import,			// FbxImporter::Import, or mapping and indexing the file on the native path
+			Tangents,		// GenerateTangentsDataForAllUVSets
+			AxisConversion,	// DeepConvertScene and unit conversion
+			Triangulate,
+			Skeleton,
+			MeshRead,		// Copying mesh layers out of the SDK scene
+			MeshBuild,		// Decoding, welding and skinning, also the reads on the native path
+			MaterialSplit,
+			Optimize,		// Vertex cache, overdraw and vertex fetch ordering
+			Lods,			// Quadric error simplification
+			Meshlets,
+			Pack,			// SplitLargeMeshes and PackVertices
+			Animations,
+			PhaseCount
+		};
+
+		// One complete event of the trace, times are microseconds since the start of the load
+		struct Event
+		{
+			std::string name;
+			uint32_t thread;
+			double start;
+			double duration;
+		};
+
+		static const char* PhaseName(Phase phase);
+
+		double totalMilliseconds = 0.0;
+		double phaseMilliseconds[PhaseCount] = {}; // Wall time, phases run on the worker pool are timed around the whole pool run
+
+		size_t meshCount = 0;
+		size_t polygonCount = 0;		// Triangles read from the source meshes
+		size_t rawVertexCount = 0;		// Polygon vertices before welding
+		size_t weldedVertexCount = 0;	// Vertices left after welding, before the material split
+		size_t indexCount = 0;
+		size_t hashProbes = 0;			// VertexWelder::ProbeCount over all meshes
+		size_t jointCount = 0;
+		size_t animationCount = 0;
+		size_t frameCount = 0;			// Over all animations
+		size_t optimizedTriangles = 0;	// Triangles and referenced vertices of the meshes optimizeMeshes ran on
+		size_t optimizedVertices = 0;
+		size_t cacheMissesBefore = 0;	// FIFO vertex cache misses over those meshes, before and after optimizing
+		size_t cacheMissesAfter = 0;
+		float acmrBefore = 0.0f;		// Cache misses per triangle and per referenced vertex over those meshes
+		float acmrAfter = 0.0f;
+		float atvrBefore = 0.0f;
+		float atvrAfter = 0.0f;
+		size_t lodCount = 0;			// Levels generated over all meshes and the triangles in them
+		size_t lodTriangles = 0;
+		size_t meshletCount = 0;
+		size_t peakMemory = 0;			// Peak resident memory of the process in bytes as reported by the OS, 0 if unknown
+
+		std::vector<Event> events; // Phases plus one event per mesh and per sampled animation, only recorded for a trace file
+
+		// Chrome trace event JSON, opens in chrome://tracing and Perfetto
+		bool WriteTrace(const char* path) const;
+	};
+
+
 	class Parser
 	{
 	public:
 		Parser(FbxString fbxFile);
+		Parser(FbxString fbxFile, fbxsdk::FbxManager* manager); // Use a long lived manager owned by the caller instead of creating one per parser
 		~Parser();
 
 		Parser(const Parser&) = delete;
 		Parser& operator=(const Parser&) = delete;
 
 		bool LoadScene(); // Load scene, return false if failed
+		bool LoadSceneNative(); // Load a binary FBX without the SDK importer, return false if failed
+
+		// Baked cache of the processed skeleton, meshes and animations. LoadCache only succeeds when the cache was written
+		// from a source file with the same content and with the same load options, it never touches the SDK.
+		bool SaveCache(const char* path);
+		bool LoadCache(const char* path);
+		void SetSourceHash(uint64_t hash) { sourceHash = hash; } // HashFile of the source, when the caller already has it, so the cache doesn't hash the file again
 
 		Skeleton skeleton;
 		std::vector<FbxLoader::Mesh> meshes;
+
+		// When set, every finished mesh (one per material with splitMeshMaterial) is moved into the sink as soon as it is complete
+		// instead of being added to meshes, so it can be uploaded and dropped while the rest of the scene loads. Called on the loading
+		// thread in the order meshes would have had. The cache is read into the sink but never written while a sink is set.
+		std::function<void(FbxLoader::Mesh&&)> meshSink;
 		std::vector<FbxLoader::Animation> animations;
 
 		float scaleFactor = 1.0f;
+		int workerCount = 1; // Threads used to build meshes, 0 uses all hardware threads
+		double weldEpsilon = 0.0; // Grid step vertex attributes are snapped to when welding, 0 only welds exact matches
+		VertexFormat vertexFormat = VertexFormat::Full;
+		VertexLayout vertexLayout;
+		bool splitMeshMaterial = true; // Merge the meshes of all nodes into one mesh per material
+		bool materialDrawRanges = false; // With splitMeshMaterial, keep one mesh per node and group its triangles into Mesh::drawRanges instead of merging all nodes into one mesh per material
+		bool optimizeMeshes = false; // Reorder triangles for the vertex cache and overdraw and vertices for fetch locality
+		MeshOptimization meshOptimization;
+		bool generateLods = false; // Add Mesh::lods, simplified with quadric error edge collapses that keep UV, normal and material seams intact
+		LodGeneration lodGeneration;
+		bool generateMeshlets = false; // Add Mesh::meshlets with bounding spheres and normal cones
+		MeshletGeneration meshletGeneration;
+		bool splitLargeMeshes = false; // Split meshes with more than IndexBuffer::ShortVertexLimit vertices so all indices are 16 bit
+		bool compressAnimations = false; // Store animations as CompressedClip tracks instead of local/global matrices
+		AnimationCompression animationCompression;
+
+		bool lazyAnimations = false; // Only read clip info (name, length, frame rate, frame count, animated joints) into animations, GetAnimation decodes clips on demand
+		size_t animationCacheBudget = (size_t)256 << 20; // Bytes of decoded clips GetAnimation keeps with lazyAnimations, least recently used clips are evicted past it
+
+		// Clip with its transforms. With lazyAnimations the clip is decoded on first use, and stays valid for as long as the caller
+		// holds on to it even once evicted. The SDK backend decodes from the scene, so call it from the thread that loaded it.
+		std::shared_ptr<const Animation> GetAnimation(size_t index);
+
+		FbxString cacheFile; // When set, LoadScene and LoadSceneNative load from this cache if it is valid and write it after importing. Ignored with lazyAnimations
+
+		bool collectStats = false; // Fill stats during LoadScene and LoadSceneNative, a disabled load only pays for a branch per phase
+		FbxString traceFile; // When set, stats are collected and written there as a Chrome trace after loading
+		LoadStats stats;
 
 		int materialCount = 0;
 	private:
 		fbxsdk::FbxManager* pManager = nullptr;
+		bool ownsManager = true;
 		fbxsdk::FbxIOSettings* ios = nullptr;
-		fbxsdk::FbxScene* pScene;
+		fbxsdk::FbxScene* pScene = nullptr;
 		fbxsdk::FbxString fbxFile;
 		std::unordered_map<std::string, int> materialNameToIndexMap;
+		std::unique_ptr<WorkerPool> workerPool;
+		uint64_t sourceHash = 0;
 
-		void InitFbxObjects();
+		struct CachedClip
+		{
+			std::shared_ptr<const Animation> animation;
+			size_t bytes = 0;
+			std::list<size_t>::iterator lruPosition;
+		};
+		std::function<void(size_t, Animation&)> decodeAnimation; // Set by the backend that loaded the scene when lazyAnimations is set
+		std::mutex clipCacheMutex;
+		std::list<size_t> clipLru; // Most recently used first
+		std::unordered_map<size_t, CachedClip> clipCache;
+		size_t clipCacheBytes = 0;
+
+		LoadStats* activeStats = nullptr; // &stats while a load is collecting them
+		std::chrono::steady_clock::time_point statsStart;
+		mutable std::mutex statsMutex;
 
-		int Parser::FindJointIndexByName(const FbxString& jointName)
+		// Idle mesh build arenas of the running load, one for every thread that built a mesh at the same time
+		mutable std::mutex arenaMutex;
+		mutable std::vector<std::unique_ptr<ScratchArena>> arenas;
+		std::unique_ptr<ScratchArena> AcquireArena() const;
+		void ReleaseArena(std::unique_ptr<ScratchArena> arena) const; // Resets it for the next mesh
+
+		// Adds the time until the end of the scope to a phase, without touching the clock when no stats are collected
+		class PhaseScope
 		{
-			for (int index = 0; index != skeleton.joints.size(); ++index) {
-				if (skeleton.joints[index].jointName == jointName)
-					return index;
+		public:
+			PhaseScope(const Parser& parser, LoadStats::Phase phase) : parser(parser.activeStats ? &parser : nullptr), phase(phase)
+			{
+				if (this->parser)
+					start = std::chrono::steady_clock::now();
+			}
+			~PhaseScope()
+			{
+				if (parser)
+					parser->RecordPhase(phase, start);
 			}
-			return -1;
+
+			PhaseScope(const PhaseScope&) = delete;
+			PhaseScope& operator=(const PhaseScope&) = delete;
+
+		private:
+			const Parser* parser;
+			LoadStats::Phase phase;
+			std::chrono::steady_clock::time_point start;
+		};
+
+		void BeginStats();
+		void EndStats();
+		void RecordPhase(LoadStats::Phase phase, std::chrono::steady_clock::time_point start) const;
+		void RecordEvent(const char* name, std::chrono::steady_clock::time_point start) const; // Trace only
+
+		void InitFbxObjects();
+		WorkerPool& GetWorkerPool();
+		FbxString GetFullFbxFile() const;
+		uint64_t GetSourceHash(); // Content hash of the source file, 0 if it can't be read
+		uint64_t GetOptionsHash() const;
+
+		int FindJointIndexByName(const FbxString& jointName) const
+		{
+			auto joint = skeleton.jointMap.find(jointName.Buffer());
+			return joint != skeleton.jointMap.end() ? joint->second : -1;
 		}
 
+		// LoadScene stages, in order
+		bool ImportScene(const FbxString& fullFbxFile);
+		void GenerateTangents();
+		void ConvertScene(); // Axis and unit conversion
+		void TriangulateScene();
+		void IndexMaterials();
+
 		FbxNode* FindMesh(FbxNode* node);
 		void FindMeshes(FbxNode* node, std::vector<FbxNode*>& meshes);
 
-		void LoadMesh(FbxNode* node);
+		bool ReadMeshSource(FbxNode* node, MeshSource& source);
+		void BuildMesh(MeshSource& source, Mesh& result) const;
 		void LoadMeshes();
+		void BuildMeshes(std::vector<Mesh>& built);
+		std::vector<FbxString> LoadMaterialNames();
+		void SplitMeshesByMaterial(std::vector<Mesh>& built, const std::vector<FbxString>& materialNames); // Consumes built, finishing one batch per material
+		void GroupTrianglesByMaterial(Mesh& mesh) const;
+		void FinishMeshes(std::vector<Mesh>& batch); // Split, pack and hand the batch to meshSink or meshes
+		void OptimizeMeshes(std::vector<Mesh>& batch);
+		void OptimizeMesh(Mesh& mesh) const;
+		void GenerateLods(std::vector<Mesh>& batch);
+		void GenerateLods(Mesh& mesh) const;
+		void BuildMeshlets(std::vector<Mesh>& batch);
+		void BuildMeshlets(Mesh& mesh) const;
+		void SplitLargeMeshes(std::vector<Mesh>& batch);
+		void PackVertices(std::vector<Mesh>& batch);
 
 		void LoadSkeleton(FbxNode* node, int depth, int currIndex, int parentIndex);
 		void LoadSkeleton();
 
 		void LoadAnimation(Joint* joint, FbxLoader::Animation& result);
-		FbxLoader::Animation Parser::LoadAnimation(FbxAnimStack* animStack);
+		void BakeAnimationCurves(FbxAnimLayer* layer, const FbxLoader::Animation& result, AnimationCurves& curves);
+		void SampleAnimationCurves(const AnimationCurves& curves, FbxLoader::Animation& result) const;
+		FbxLoader::Animation LoadAnimationInfo(FbxAnimStack* animStack) const;
+		FbxLoader::Animation Parser::LoadAnimation(FbxAnimStack* animStack, AnimationCurves& curves);
 		void LoadAnimations();
+		void CompressAnimation(Animation& animation) const;
+
+		// Native backend, see FbxBinary.cpp
+		void LoadSkeleton(const Binary::Scene& scene, int model, int currIndex, int parentIndex, std::vector<int>& jointModels);
+		void LoadMeshes(const Binary::Scene& scene);
+		void LoadAnimationInfo(const Binary::Scene& scene, const std::vector<int>& jointModels, size_t animIndex, FbxLoader::Animation& result) const;
+		void LoadAnimation(const Binary::Scene& scene, const std::vector<int>& jointModels, size_t animIndex, FbxLoader::Animation& result) const;
+		void LoadAnimations(const Binary::Scene& scene, const std::vector<int>& jointModels);
 
 		// Internal helper functions for getting transform matrices with correct scale on translation
 		fbxsdk::FbxAMatrix GetGlobalTransform(fbxsdk::FbxNode* node, fbxsdk::FbxTime time = FBXSDK_TIME_INFINITE);
@@ -0,0 +1,1170 @@
+#include "FbxLoader.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+
+// Post-load mesh optimization: Tipsify triangle ordering for the post-transform vertex cache (Sander, Nehab and Barczak,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"), the overdraw sort of the clusters it produces and
+// a first use renumbering of the vertices. Draw ranges are optimized one by one, triangles never leave their range.
+// Also the level of detail chain, simplified with quadric error metrics (Garland and Heckbert, "Surface Simplification
+// Using Quadric Error Metrics") through half edge collapses, so every level indexes the vertices of the full mesh.
+// Meshlets are grown greedily from the triangles around the ones already taken, so they stay compact and share vertices.
+namespace
+{
+	const uint32_t noVertex = 0xFFFFFFFF;
+
+	struct Adjacency
+	{
+		std::vector<uint32_t> offsets;		// Per vertex start into triangles, vertexCount + 1 entries
+		std::vector<uint32_t> triangles;
+	};
+
+	void BuildAdjacency(const uint32_t* indices, size_t indexCount, size_t vertexCount, Adjacency& adjacency)
+	{
+		adjacency.offsets.assign(vertexCount + 1, 0);
+		for (size_t i = 0; i < indexCount; i++)
+			adjacency.offsets[indices[i] + 1]++;
+		for (size_t vertex = 0; vertex < vertexCount; vertex++)
+			adjacency.offsets[vertex + 1] += adjacency.offsets[vertex];
+
+		adjacency.triangles.resize(indexCount);
+		std::vector<uint32_t> cursor(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+		for (size_t i = 0; i < indexCount; i++)
+			adjacency.triangles[cursor[indices[i]]++] = (uint32_t)(i / 3);
+	}
+
+	// Next fanning vertex: the candidate that stays in the cache the longest after fanning it, or a dead end fallback
+	uint32_t NextVertex(const std::vector<uint32_t>& candidates, const std::vector<uint32_t>& cacheTime, uint32_t time,
+		const std::vector<uint32_t>& liveTriangles, std::vector<uint32_t>& deadEnds, uint32_t& cursor, int cacheSize, bool& restarted)
+	{
+		uint32_t best = noVertex;
+		int bestPriority = -1;
+		for (uint32_t vertex : candidates)
+		{
+			if (liveTriangles[vertex] == 0)
+				continue;
+
+			// Vertices that would still be cached after emitting all their triangles are preferred, the oldest first
+			int priority = 0;
+			if (time - cacheTime[vertex] + 2 * liveTriangles[vertex] <= (uint32_t)cacheSize)
+				priority = (int)(time - cacheTime[vertex]);
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				best = vertex;
+			}
+		}
+		if (best != noVertex)
+			return best;
+
+		restarted = true;
+		while (!deadEnds.empty())
+		{
+			const uint32_t vertex = deadEnds.back();
+			deadEnds.pop_back();
+			if (liveTriangles[vertex] > 0)
+				return vertex;
+		}
+		while (cursor < liveTriangles.size())
+		{
+			if (liveTriangles[cursor] > 0)
+				return cursor;
+			cursor++;
+		}
+		return noVertex;
+	}
+
+	// Reorders the triangles of indices in place. clusterStarts receives the first triangle of every run that
+	// started from a dead end, the hard boundaries the overdraw sort may move around.
+	void Tipsify(uint32_t* indices, size_t indexCount, size_t vertexCount, int cacheSize, std::vector<uint32_t>& clusterStarts)
+	{
+		const size_t triangleCount = indexCount / 3;
+		Adjacency adjacency;
+		BuildAdjacency(indices, indexCount, vertexCount, adjacency);
+
+		std::vector<uint32_t> liveTriangles(vertexCount);
+		for (size_t vertex = 0; vertex < vertexCount; vertex++)
+			liveTriangles[vertex] = adjacency.offsets[vertex + 1] - adjacency.offsets[vertex];
+
+		std::vector<uint32_t> cacheTime(vertexCount, 0);
+		std::vector<char> emitted(triangleCount, 0);
+		std::vector<uint32_t> deadEnds;
+		std::vector<uint32_t> candidates;
+		std::vector<uint32_t> result;
+		result.reserve(indexCount);
+		clusterStarts.clear();
+
+		uint32_t time = (uint32_t)cacheSize + 1;
+		uint32_t cursor = 0;
+		bool restarted = true;
+		uint32_t fanning = 0;
+		while (cursor < vertexCount && liveTriangles[cursor] == 0)
+			cursor++;
+		fanning = cursor < vertexCount ? cursor : noVertex;
+
+		while (fanning != noVertex)
+		{
+			if (restarted)
+			{
+				clusterStarts.push_back((uint32_t)(result.size() / 3));
+				restarted = false;
+			}
+
+			candidates.clear();
+			for (uint32_t i = adjacency.offsets[fanning]; i < adjacency.offsets[fanning + 1]; i++)
+			{
+				const uint32_t triangle = adjacency.triangles[i];
+				if (emitted[triangle])
+					continue;
+				emitted[triangle] = 1;
+
+				for (int corner = 0; corner < 3; corner++)
+				{
+					const uint32_t vertex = indices[triangle * 3 + corner];
+					result.push_back(vertex);
+					deadEnds.push_back(vertex);
+					candidates.push_back(vertex);
+					liveTriangles[vertex]--;
+					if (time - cacheTime[vertex] > (uint32_t)cacheSize)
+						cacheTime[vertex] = time++;
+				}
+			}
+
+			fanning = NextVertex(candidates, cacheTime, time, liveTriangles, deadEnds, cursor, cacheSize, restarted);
+		}
+
+		std::copy(result.begin(), result.end(), indices);
+	}
+
+	// Splits the Tipsify clusters further wherever a cluster on its own already has a vertex cache miss rate within
+	// threshold of the whole range, then draws clusters facing away from the mesh center first
+	void SortForOverdraw(uint32_t* indices, size_t indexCount, const std::vector<FbxLoader::Mesh::VertexData>& vertices,
+		const std::vector<uint32_t>& hardStarts, int cacheSize, float threshold)
+	{
+		const size_t triangleCount = indexCount / 3;
+		if (hardStarts.empty() || triangleCount < 2)
+			return;
+
+		const FbxLoader::VertexCacheStats total = FbxLoader::AnalyzeVertexCache(indices, indexCount, vertices.size(), cacheSize);
+		const float missThreshold = total.acmr * threshold;
+
+		std::vector<uint32_t> clusterStarts;
+		std::vector<uint32_t> cacheTime(vertices.size(), 0);
+		uint32_t time = 0;
+		for (size_t cluster = 0; cluster < hardStarts.size(); cluster++)
+		{
+			const size_t end = cluster + 1 < hardStarts.size() ? hardStarts[cluster + 1] : triangleCount;
+			size_t start = hardStarts[cluster];
+			size_t misses = 0;
+			time += cacheSize + 1;
+			clusterStarts.push_back((uint32_t)start);
+
+			for (size_t triangle = start; triangle < end; triangle++)
+			{
+				for (int corner = 0; corner < 3; corner++)
+				{
+					const uint32_t vertex = indices[triangle * 3 + corner];
+					if (time - cacheTime[vertex] > (uint32_t)cacheSize)
+					{
+						cacheTime[vertex] = time++;
+						misses++;
+					}
+				}
+
+				if (triangle + 1 < end && misses <= missThreshold * (triangle - start + 1))
+				{
+					start = triangle + 1;
+					misses = 0;
+					time += cacheSize + 1;
+					clusterStarts.push_back((uint32_t)start);
+				}
+			}
+		}
+
+		struct Cluster
+		{
+			uint32_t start;
+			uint32_t end;
+			double sortKey;
+		};
+
+		auto position = [&vertices](uint32_t vertex, int axis) { return vertices[vertex].position[axis]; };
+
+		// Area weighted centroid and normal of each cluster and of the whole range
+		std::vector<Cluster> clusters(clusterStarts.size());
+		std::vector<double> clusterData(clusterStarts.size() * 7, 0.0); // Centroid times area, area, normal
+		double meshCentroid[3] = {};
+		double meshArea = 0.0;
+		for (size_t cluster = 0; cluster < clusterStarts.size(); cluster++)
+		{
+			clusters[cluster].start = clusterStarts[cluster];
+			clusters[cluster].end = cluster + 1 < clusterStarts.size() ? clusterStarts[cluster + 1] : (uint32_t)triangleCount;
+
+			double* data = &clusterData[cluster * 7];
+			for (uint32_t triangle = clusters[cluster].start; triangle < clusters[cluster].end; triangle++)
+			{
+				const uint32_t a = indices[triangle * 3], b = indices[triangle * 3 + 1], c = indices[triangle * 3 + 2];
+				double ab[3], ac[3], normal[3];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					ab[axis] = position(b, axis) - position(a, axis);
+					ac[axis] = position(c, axis) - position(a, axis);
+				}
+				normal[0] = ab[1] * ac[2] - ab[2] * ac[1];
+				normal[1] = ab[2] * ac[0] - ab[0] * ac[2];
+				normal[2] = ab[0] * ac[1] - ab[1] * ac[0];
+				const double area = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+				for (int axis = 0; axis < 3; axis++)
+				{
+					data[axis] += (position(a, axis) + position(b, axis) + position(c, axis)) / 3.0 * area;
+					data[4 + axis] += normal[axis];
+				}
+				data[3] += area;
+			}
+
+			for (int axis = 0; axis < 3; axis++)
+				meshCentroid[axis] += data[axis];
+			meshArea += data[3];
+		}
+		if (meshArea <= 0.0)
+			return;
+		for (int axis = 0; axis < 3; axis++)
+			meshCentroid[axis] /= meshArea;
+
+		for (size_t cluster = 0; cluster < clusters.size(); cluster++)
+		{
+			const double* data = &clusterData[cluster * 7];
+			const double normalLength = std::sqrt(data[4] * data[4] + data[5] * data[5] + data[6] * data[6]);
+			double key = 0.0;
+			if (data[3] > 0.0 && normalLength > 0.0)
+			{
+				for (int axis = 0; axis < 3; axis++)
+					key += (data[axis] / data[3] - meshCentroid[axis]) * data[4 + axis] / normalLength;
+			}
+			clusters[cluster].sortKey = key;
+		}
+
+		std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.sortKey > b.sortKey; });
+
+		std::vector<uint32_t> sorted;
+		sorted.reserve(indexCount);
+		for (const Cluster& cluster : clusters)
+			sorted.insert(sorted.end(), indices + cluster.start * 3, indices + cluster.end * 3);
+		std::copy(sorted.begin(), sorted.end(), indices);
+	}
+
+	// Symmetric 4x4 quadric of the area weighted planes around a point, Error is the mean squared distance to them
+	struct Quadric
+	{
+		double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0, b2 = 0.0, bc = 0.0, bd = 0.0, c2 = 0.0, cd = 0.0, d2 = 0.0;
+		double weight = 0.0;
+
+		void AddPlane(const double* normal, double d, double planeWeight)
+		{
+			a2 += normal[0] * normal[0] * planeWeight;
+			ab += normal[0] * normal[1] * planeWeight;
+			ac += normal[0] * normal[2] * planeWeight;
+			ad += normal[0] * d * planeWeight;
+			b2 += normal[1] * normal[1] * planeWeight;
+			bc += normal[1] * normal[2] * planeWeight;
+			bd += normal[1] * d * planeWeight;
+			c2 += normal[2] * normal[2] * planeWeight;
+			cd += normal[2] * d * planeWeight;
+			d2 += d * d * planeWeight;
+			weight += planeWeight;
+		}
+
+		void Add(const Quadric& other)
+		{
+			a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+			b2 += other.b2; bc += other.bc; bd += other.bd;
+			c2 += other.c2; cd += other.cd; d2 += other.d2;
+			weight += other.weight;
+		}
+
+		double Error(const double* p) const
+		{
+			if (weight <= 0.0)
+				return 0.0;
+			const double x = p[0], y = p[1], z = p[2];
+			const double error = a2 * x * x + b2 * y * y + c2 * z * z + 2.0 * (ab * x * y + ac * x * z + bc * y * z + ad * x + bd * y + cd * z) + d2;
+			return std::max(error, 0.0) / weight;
+		}
+	};
+
+	void TriangleNormal(const double* a, const double* b, const double* c, double* normal)
+	{
+		const double ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		const double ac[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		normal[0] = ab[1] * ac[2] - ab[2] * ac[1];
+		normal[1] = ab[2] * ac[0] - ab[0] * ac[2];
+		normal[2] = ab[0] * ac[1] - ab[1] * ac[0];
+	}
+
+	// Vertices at the same position make up a point, quadrics live on points. A collapse moves every vertex of a point onto
+	// the vertex of the target point it shares an edge with, so UV and normal seams only collapse along themselves and never
+	// tear. Points on open borders, on non-manifold edges or between materials are locked, which keeps the meshes of a material
+	// split and the ranges of a draw range mesh closed against each other. Positions are normalized to the largest bounds extent.
+	class Simplifier
+	{
+	public:
+		Simplifier(const std::vector<FbxLoader::Mesh::VertexData>& vertices, const uint32_t* indices, size_t indexCount, float attributeWeight);
+
+		// Collapses edges, cheapest first, until targetTriangles remain or every collapse left would move the surface further than
+		// maxError. Returns the largest error of the collapses done so far.
+		float Simplify(size_t targetTriangles, float maxError);
+
+		const std::vector<uint32_t>& Indices() const { return indices; } // Surviving triangles in their original order
+		const std::vector<uint32_t>& SourceTriangles() const { return sourceTriangles; } // Triangle of the full mesh each one was
+
+	private:
+		struct Collapse
+		{
+			uint32_t from;	// Points
+			uint32_t to;
+			double cost;
+		};
+
+		bool MapVertices(uint32_t from, uint32_t to, std::vector<std::pair<uint32_t, uint32_t>>& vertexMap) const;
+		double AttributeDistance(uint32_t a, uint32_t b) const;
+		bool FlipsTriangle(uint32_t from, uint32_t to) const;
+		void RemoveDegenerates();
+
+		const std::vector<FbxLoader::Mesh::VertexData>& vertices;
+		std::vector<uint32_t> indices;
+		std::vector<uint32_t> sourceTriangles;
+		std::vector<uint32_t> vertexPoints;
+		std::vector<uint32_t> pointOffsets;		// Start of each point in pointVertices, pointCount + 1 entries
+		std::vector<uint32_t> pointVertices;
+		std::vector<double> positions;			// Three per point
+		std::vector<Quadric> quadrics;
+		std::vector<char> locked;
+		Adjacency adjacency;					// Vertex to triangles of indices, rebuilt every pass
+		double attributeWeight;
+		double error = 0.0;						// Squared
+	};
+
+	Simplifier::Simplifier(const std::vector<FbxLoader::Mesh::VertexData>& vertices, const uint32_t* sourceIndices, size_t indexCount, float attributeWeight) :
+		vertices(vertices),
+		indices(sourceIndices, sourceIndices + indexCount),
+		sourceTriangles(indexCount / 3),
+		attributeWeight(attributeWeight)
+	{
+		const size_t vertexCount = vertices.size();
+		std::iota(sourceTriangles.begin(), sourceTriangles.end(), 0);
+
+		double minimum[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+		double maximum[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+		for (const FbxLoader::Mesh::VertexData& vertex : vertices)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				minimum[axis] = std::min(minimum[axis], vertex.position[axis]);
+				maximum[axis] = std::max(maximum[axis], vertex.position[axis]);
+			}
+		}
+		double extent = std::max(maximum[0] - minimum[0], std::max(maximum[1] - minimum[1], maximum[2] - minimum[2]));
+		if (!(extent > 0.0))
+			extent = 1.0;
+
+		// Group vertices into points by sorting them by position
+		pointVertices.resize(vertexCount);
+		std::iota(pointVertices.begin(), pointVertices.end(), 0);
+		auto samePosition = [&vertices](uint32_t a, uint32_t b)
+		{
+			return vertices[a].position[0] == vertices[b].position[0] && vertices[a].position[1] == vertices[b].position[1] &&
+				vertices[a].position[2] == vertices[b].position[2];
+		};
+		std::sort(pointVertices.begin(), pointVertices.end(), [&vertices](uint32_t a, uint32_t b)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (vertices[a].position[axis] != vertices[b].position[axis])
+					return vertices[a].position[axis] < vertices[b].position[axis];
+			}
+			return a < b;
+		});
+
+		vertexPoints.resize(vertexCount);
+		for (size_t i = 0; i < vertexCount; i++)
+		{
+			const uint32_t vertex = pointVertices[i];
+			if (i == 0 || !samePosition(vertex, pointVertices[i - 1]))
+			{
+				pointOffsets.push_back((uint32_t)i);
+				for (int axis = 0; axis < 3; axis++)
+					positions.push_back((vertices[vertex].position[axis] - minimum[axis]) / extent);
+			}
+			vertexPoints[vertex] = (uint32_t)pointOffsets.size() - 1;
+		}
+		const size_t pointCount = pointOffsets.size();
+		pointOffsets.push_back((uint32_t)vertexCount);
+
+		RemoveDegenerates();
+
+		quadrics.resize(pointCount);
+		locked.assign(pointCount, 0);
+		std::vector<int> pointMaterials(pointCount, -1);
+		std::unordered_map<uint64_t, uint32_t> edgeUses;
+		edgeUses.reserve(indices.size());
+		for (size_t triangle = 0; triangle < indices.size() / 3; triangle++)
+		{
+			const uint32_t points[3] = { vertexPoints[indices[triangle * 3]], vertexPoints[indices[triangle * 3 + 1]], vertexPoints[indices[triangle * 3 + 2]] };
+			double normal[3];
+			TriangleNormal(&positions[points[0] * 3], &positions[points[1] * 3], &positions[points[2] * 3], normal);
+			const double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+			if (length > 0.0)
+			{
+				for (int axis = 0; axis < 3; axis++)
+					normal[axis] /= length;
+				const double d = -(normal[0] * positions[points[0] * 3] + normal[1] * positions[points[0] * 3 + 1] + normal[2] * positions[points[0] * 3 + 2]);
+				for (int corner = 0; corner < 3; corner++)
+					quadrics[points[corner]].AddPlane(normal, d, length * 0.5);
+			}
+
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const int material = vertices[indices[triangle * 3 + corner]].materialIndex;
+				int& pointMaterial = pointMaterials[points[corner]];
+				if (pointMaterial >= 0 && pointMaterial != material)
+					locked[points[corner]] = 1;
+				pointMaterial = material;
+
+				const uint32_t a = std::min(points[corner], points[(corner + 1) % 3]);
+				const uint32_t b = std::max(points[corner], points[(corner + 1) % 3]);
+				edgeUses[((uint64_t)a << 32) | b]++;
+			}
+		}
+
+		for (const std::pair<const uint64_t, uint32_t>& edge : edgeUses)
+		{
+			if (edge.second != 2)
+			{
+				locked[(uint32_t)(edge.first >> 32)] = 1;
+				locked[(uint32_t)edge.first] = 1;
+			}
+		}
+	}
+
+	float Simplifier::Simplify(size_t targetTriangles, float maxError)
+	{
+		const double maxCost = (double)maxError * (double)maxError;
+		std::vector<Collapse> collapses;
+		std::vector<char> touched;
+		std::vector<std::pair<uint32_t, uint32_t>> vertexMap;
+
+		// Every pass collapses an independent set of edges, the points around a collapse wait for the next pass
+		while (indices.size() / 3 > targetTriangles)
+		{
+			BuildAdjacency(indices.data(), indices.size(), vertices.size(), adjacency);
+
+			collapses.clear();
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				const uint32_t a = vertexPoints[indices[i]];
+				const uint32_t b = vertexPoints[indices[i - i % 3 + (i + 1) % 3]];
+				if (!locked[a])
+					collapses.push_back(Collapse{ a, b, 0.0 });
+				if (!locked[b])
+					collapses.push_back(Collapse{ b, a, 0.0 });
+			}
+			std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.from != b.from ? a.from < b.from : a.to < b.to; });
+			collapses.erase(std::unique(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.from == b.from && a.to == b.to; }), collapses.end());
+
+			size_t validCount = 0;
+			for (Collapse& collapse : collapses)
+			{
+				if (!MapVertices(collapse.from, collapse.to, vertexMap))
+					continue;
+				collapse.cost = quadrics[collapse.from].Error(&positions[collapse.to * 3]);
+				if (collapse.cost > maxCost)
+					continue;
+
+				double attributeCost = 0.0;
+				for (const std::pair<uint32_t, uint32_t>& mapped : vertexMap)
+					attributeCost += AttributeDistance(mapped.first, mapped.second);
+				collapses[validCount] = collapse;
+				collapses[validCount].cost += attributeCost * attributeWeight;
+				validCount++;
+			}
+			collapses.resize(validCount);
+			std::stable_sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+			touched.assign(locked.size(), 0);
+			size_t triangleCount = indices.size() / 3;
+			bool collapsed = false;
+			for (const Collapse& collapse : collapses)
+			{
+				if (triangleCount <= targetTriangles)
+					break;
+				if (touched[collapse.from] || touched[collapse.to] || FlipsTriangle(collapse.from, collapse.to))
+					continue;
+
+				MapVertices(collapse.from, collapse.to, vertexMap);
+				for (const std::pair<uint32_t, uint32_t>& mapped : vertexMap)
+				{
+					for (uint32_t i = adjacency.offsets[mapped.first]; i < adjacency.offsets[mapped.first + 1]; i++)
+					{
+						uint32_t* triangle = &indices[adjacency.triangles[i] * 3];
+						bool removed = false;
+						for (int corner = 0; corner < 3; corner++)
+						{
+							touched[vertexPoints[triangle[corner]]] = 1;
+							removed |= vertexPoints[triangle[corner]] == collapse.to;
+							if (triangle[corner] == mapped.first)
+								triangle[corner] = mapped.second;
+						}
+						if (removed)
+							triangleCount--;
+					}
+				}
+
+				quadrics[collapse.to].Add(quadrics[collapse.from]);
+				error = std::max(error, quadrics[collapse.from].Error(&positions[collapse.to * 3]));
+				collapsed = true;
+			}
+
+			RemoveDegenerates();
+			if (!collapsed)
+				break;
+		}
+
+		return (float)std::sqrt(error);
+	}
+
+	// Pairs every vertex of from still in use with the one vertex of to it shares a triangle with. Fails when a vertex has
+	// none or several, collapsing such an edge would tear a seam.
+	bool Simplifier::MapVertices(uint32_t from, uint32_t to, std::vector<std::pair<uint32_t, uint32_t>>& vertexMap) const
+	{
+		vertexMap.clear();
+		for (uint32_t i = pointOffsets[from]; i < pointOffsets[from + 1]; i++)
+		{
+			const uint32_t vertex = pointVertices[i];
+			if (adjacency.offsets[vertex] == adjacency.offsets[vertex + 1])
+				continue;
+
+			uint32_t target = noVertex;
+			for (uint32_t j = adjacency.offsets[vertex]; j < adjacency.offsets[vertex + 1]; j++)
+			{
+				const uint32_t* triangle = &indices[adjacency.triangles[j] * 3];
+				for (int corner = 0; corner < 3; corner++)
+				{
+					if (vertexPoints[triangle[corner]] != to)
+						continue;
+					if (target != noVertex && target != triangle[corner])
+						return false;
+					target = triangle[corner];
+				}
+			}
+			if (target == noVertex)
+				return false;
+			vertexMap.push_back(std::make_pair(vertex, target));
+		}
+		return !vertexMap.empty();
+	}
+
+	// Squared difference of normal, UV, color and skin weights. Only the inline joint slots are compared, influences are
+	// sorted heaviest first so those carry most of the skin.
+	double Simplifier::AttributeDistance(uint32_t a, uint32_t b) const
+	{
+		const FbxLoader::Mesh::VertexData& first = vertices[a];
+		const FbxLoader::Mesh::VertexData& second = vertices[b];
+		double distance = 0.0;
+		for (int axis = 0; axis < 3; axis++)
+			distance += (first.normal[axis] - second.normal[axis]) * (first.normal[axis] - second.normal[axis]);
+		for (int axis = 0; axis < 2; axis++)
+			distance += (first.uv[axis] - second.uv[axis]) * (first.uv[axis] - second.uv[axis]);
+		distance += (first.color.mRed - second.color.mRed) * (first.color.mRed - second.color.mRed);
+		distance += (first.color.mGreen - second.color.mGreen) * (first.color.mGreen - second.color.mGreen);
+		distance += (first.color.mBlue - second.color.mBlue) * (first.color.mBlue - second.color.mBlue);
+		distance += (first.color.mAlpha - second.color.mAlpha) * (first.color.mAlpha - second.color.mAlpha);
+
+		const int firstCount = std::min(first.jointCount, FbxLoader::InlineVertexBones);
+		const int secondCount = std::min(second.jointCount, FbxLoader::InlineVertexBones);
+		for (int bone = 0; bone < firstCount; bone++)
+		{
+			double weight = 0.0;
+			for (int other = 0; other < secondCount; other++)
+			{
+				if (second.jointIndices[other] == first.jointIndices[bone])
+					weight = second.jointWeights[other];
+			}
+			distance += (first.jointWeights[bone] - weight) * (first.jointWeights[bone] - weight);
+		}
+		for (int bone = 0; bone < secondCount; bone++)
+		{
+			bool shared = false;
+			for (int other = 0; other < firstCount; other++)
+				shared |= first.jointIndices[other] == second.jointIndices[bone];
+			if (!shared)
+				distance += (double)second.jointWeights[bone] * second.jointWeights[bone];
+		}
+		return distance;
+	}
+
+	// True when moving from onto to turns a remaining triangle around or collapses it to a line
+	bool Simplifier::FlipsTriangle(uint32_t from, uint32_t to) const
+	{
+		for (uint32_t i = pointOffsets[from]; i < pointOffsets[from + 1]; i++)
+		{
+			const uint32_t vertex = pointVertices[i];
+			for (uint32_t j = adjacency.offsets[vertex]; j < adjacency.offsets[vertex + 1]; j++)
+			{
+				const uint32_t* triangle = &indices[adjacency.triangles[j] * 3];
+				const uint32_t points[3] = { vertexPoints[triangle[0]], vertexPoints[triangle[1]], vertexPoints[triangle[2]] };
+				if (points[0] == to || points[1] == to || points[2] == to)
+					continue;
+
+				const double* corners[3];
+				for (int corner = 0; corner < 3; corner++)
+					corners[corner] = &positions[points[corner] * 3];
+				double before[3], after[3];
+				TriangleNormal(corners[0], corners[1], corners[2], before);
+				for (int corner = 0; corner < 3; corner++)
+				{
+					if (points[corner] == from)
+						corners[corner] = &positions[to * 3];
+				}
+				TriangleNormal(corners[0], corners[1], corners[2], after);
+
+				const double lengths = std::sqrt((before[0] * before[0] + before[1] * before[1] + before[2] * before[2]) *
+					(after[0] * after[0] + after[1] * after[1] + after[2] * after[2]));
+				if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 1e-2 * lengths)
+					return true;
+			}
+		}
+		return false;
+	}
+
+	void Simplifier::RemoveDegenerates()
+	{
+		size_t kept = 0;
+		for (size_t triangle = 0; triangle < indices.size() / 3; triangle++)
+		{
+			const uint32_t a = vertexPoints[indices[triangle * 3]];
+			const uint32_t b = vertexPoints[indices[triangle * 3 + 1]];
+			const uint32_t c = vertexPoints[indices[triangle * 3 + 2]];
+			if (a == b || b == c || c == a)
+				continue;
+
+			std::copy(indices.begin() + triangle * 3, indices.begin() + triangle * 3 + 3, indices.begin() + kept * 3);
+			sourceTriangles[kept] = sourceTriangles[triangle];
+			kept++;
+		}
+		indices.resize(kept * 3);
+		sourceTriangles.resize(kept);
+	}
+
+	// Bounding sphere around the bounds center and the normal cone of the triangles, in the conventions of Mesh::Meshlet
+	void ComputeMeshletBounds(const std::vector<FbxLoader::Mesh::VertexData>& vertices, const uint32_t* meshletVertices,
+		const uint8_t* triangles, FbxLoader::Mesh::Meshlet& meshlet)
+	{
+		double minimum[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+		double maximum[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+		for (uint32_t i = 0; i < meshlet.vertexCount; i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				minimum[axis] = std::min(minimum[axis], vertices[meshletVertices[i]].position[axis]);
+				maximum[axis] = std::max(maximum[axis], vertices[meshletVertices[i]].position[axis]);
+			}
+		}
+		double center[3];
+		for (int axis = 0; axis < 3; axis++)
+			center[axis] = (minimum[axis] + maximum[axis]) * 0.5;
+		double radius = 0.0;
+		for (uint32_t i = 0; i < meshlet.vertexCount; i++)
+		{
+			const FbxVector4& position = vertices[meshletVertices[i]].position;
+			const double offset[3] = { position[0] - center[0], position[1] - center[1], position[2] - center[2] };
+			radius = std::max(radius, offset[0] * offset[0] + offset[1] * offset[1] + offset[2] * offset[2]);
+		}
+		radius = std::sqrt(radius);
+
+		std::vector<double> normals(meshlet.triangleCount * 3, 0.0);
+		double axis[3] = {};
+		for (uint32_t triangle = 0; triangle < meshlet.triangleCount; triangle++)
+		{
+			double corners[3][3];
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const FbxVector4& position = vertices[meshletVertices[triangles[triangle * 3 + corner]]].position;
+				for (int component = 0; component < 3; component++)
+					corners[corner][component] = position[component];
+			}
+			double* normal = &normals[triangle * 3];
+			TriangleNormal(corners[0], corners[1], corners[2], normal);
+			const double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+			if (length <= 0.0)
+				continue;
+			for (int component = 0; component < 3; component++)
+			{
+				normal[component] /= length;
+				axis[component] += normal[component];
+			}
+		}
+
+		const double axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		double minimumDot = 1.0;
+		if (axisLength > 0.0)
+		{
+			for (int component = 0; component < 3; component++)
+				axis[component] /= axisLength;
+			for (uint32_t triangle = 0; triangle < meshlet.triangleCount; triangle++)
+			{
+				const double* normal = &normals[triangle * 3];
+				if (normal[0] != 0.0 || normal[1] != 0.0 || normal[2] != 0.0)
+					minimumDot = std::min(minimumDot, normal[0] * axis[0] + normal[1] * axis[1] + normal[2] * axis[2]);
+			}
+		}
+
+		// Apex far enough back along the axis to lie behind every triangle plane
+		double apexDistance = 0.0;
+		if (axisLength > 0.0 && minimumDot > 0.0)
+		{
+			for (uint32_t triangle = 0; triangle < meshlet.triangleCount; triangle++)
+			{
+				const double* normal = &normals[triangle * 3];
+				const double normalDot = normal[0] * axis[0] + normal[1] * axis[1] + normal[2] * axis[2];
+				if (normalDot <= 0.0)
+					continue;
+				const FbxVector4& position = vertices[meshletVertices[triangles[triangle * 3]]].position;
+				const double planeDistance = (center[0] - position[0]) * normal[0] + (center[1] - position[1]) * normal[1] + (center[2] - position[2]) * normal[2];
+				apexDistance = std::max(apexDistance, planeDistance / normalDot);
+			}
+		}
+
+		for (int component = 0; component < 3; component++)
+		{
+			meshlet.center[component] = (float)center[component];
+			meshlet.coneApex[component] = (float)(center[component] - axis[component] * apexDistance);
+			meshlet.coneAxis[component] = (float)axis[component];
+		}
+		meshlet.radius = (float)radius;
+		// A cone of 90 degrees or more can't be culled, a cutoff of 1 is never reached
+		meshlet.coneCutoff = axisLength > 0.0 && minimumDot > 0.0 ? (float)std::sqrt(1.0 - minimumDot * minimumDot) : 1.0f;
+	}
+}
+
+FbxLoader::VertexCacheStats FbxLoader::AnalyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, int cacheSize)
+{
+	VertexCacheStats stats;
+	std::vector<uint32_t> cacheTime(vertexCount, 0);
+	std::vector<char> referenced(vertexCount, 0);
+	uint32_t time = (uint32_t)cacheSize + 1;
+
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		const uint32_t vertex = indices[i];
+		if (time - cacheTime[vertex] > (uint32_t)cacheSize)
+		{
+			cacheTime[vertex] = time++;
+			stats.misses++;
+		}
+		if (!referenced[vertex])
+		{
+			referenced[vertex] = 1;
+			stats.referencedVertices++;
+		}
+	}
+
+	stats.acmr = indexCount >= 3 ? (float)stats.misses / (float)(indexCount / 3) : 0.0f;
+	stats.atvr = stats.referencedVertices > 0 ? (float)stats.misses / (float)stats.referencedVertices : 0.0f;
+	return stats;
+}
+
+void FbxLoader::Parser::OptimizeMeshes(std::vector<Mesh>& batch)
+{
+	if (!optimizeMeshes)
+		return;
+
+	PhaseScope phase(*this, LoadStats::Optimize);
+	if (workerCount == 1)
+	{
+		for (Mesh& mesh : batch)
+			OptimizeMesh(mesh);
+	}
+	else
+	{
+		GetWorkerPool().Run(batch.size(), [&](size_t meshIndex) { OptimizeMesh(batch[meshIndex]); });
+	}
+}
+
+void FbxLoader::Parser::OptimizeMesh(Mesh& mesh) const
+{
+	const size_t indexCount = mesh.indices.size() / 3 * 3;
+	if (indexCount == 0 || mesh.vertices.empty())
+		return;
+
+	const int cacheSize = std::max(meshOptimization.cacheSize, 3);
+	std::vector<uint32_t> indices(indexCount);
+	for (size_t i = 0; i < indexCount; i++)
+		indices[i] = mesh.indices[i];
+
+	const VertexCacheStats before = AnalyzeVertexCache(indices.data(), indexCount, mesh.vertices.size(), cacheSize);
+
+	std::vector<Mesh::DrawRange> ranges = mesh.drawRanges;
+	if (ranges.empty())
+		ranges.push_back(Mesh::DrawRange{ mesh.materialIndex, 0, (uint32_t)indexCount });
+
+	std::vector<uint32_t> clusterStarts;
+	for (const Mesh::DrawRange& range : ranges)
+	{
+		uint32_t* rangeIndices = indices.data() + range.firstIndex;
+		const size_t rangeCount = std::min((size_t)range.indexCount, indexCount - range.firstIndex) / 3 * 3;
+
+		Tipsify(rangeIndices, rangeCount, mesh.vertices.size(), cacheSize, clusterStarts);
+		if (meshOptimization.overdrawThreshold > 0.0f)
+			SortForOverdraw(rangeIndices, rangeCount, mesh.vertices, clusterStarts, cacheSize, meshOptimization.overdrawThreshold);
+	}
+
+	if (meshOptimization.reorderVertices)
+	{
+		std::vector<uint32_t> remap(mesh.vertices.size(), noVertex);
+		std::vector<Mesh::VertexData> vertices;
+		std::vector<Mesh::ExtraJoints> extraJoints;
+		vertices.reserve(mesh.vertices.size());
+		extraJoints.reserve(mesh.extraJoints.size());
+		for (uint32_t& index : indices)
+		{
+			if (remap[index] == noVertex)
+			{
+				remap[index] = (uint32_t)vertices.size();
+				vertices.push_back(mesh.vertices[index]);
+				if (!mesh.extraJoints.empty())
+					extraJoints.push_back(mesh.extraJoints[index]);
+			}
+			index = remap[index];
+		}
+		mesh.vertices = std::move(vertices);
+		mesh.extraJoints = std::move(extraJoints);
+	}
+
+	mesh.indices.clear();
+	mesh.indices.reserve(indexCount);
+	for (uint32_t index : indices)
+		mesh.indices.push_back(index);
+
+	if (activeStats)
+	{
+		const VertexCacheStats after = AnalyzeVertexCache(indices.data(), indexCount, mesh.vertices.size(), cacheSize);
+
+		std::lock_guard<std::mutex> lock(statsMutex);
+		activeStats->optimizedTriangles += indexCount / 3;
+		activeStats->optimizedVertices += before.referencedVertices;
+		activeStats->cacheMissesBefore += before.misses;
+		activeStats->cacheMissesAfter += after.misses;
+	}
+}
+
+void FbxLoader::Parser::GenerateLods(std::vector<Mesh>& batch)
+{
+	if (!generateLods || lodGeneration.levels.empty())
+		return;
+
+	PhaseScope phase(*this, LoadStats::Lods);
+	if (workerCount == 1)
+	{
+		for (Mesh& mesh : batch)
+			GenerateLods(mesh);
+	}
+	else
+	{
+		GetWorkerPool().Run(batch.size(), [&](size_t meshIndex) { GenerateLods(batch[meshIndex]); });
+	}
+}
+
+void FbxLoader::Parser::GenerateLods(Mesh& mesh) const
+{
+	const size_t indexCount = mesh.indices.size() / 3 * 3;
+	mesh.lods.clear();
+	if (indexCount == 0 || mesh.vertices.empty())
+		return;
+
+	std::vector<uint32_t> indices(indexCount);
+	for (size_t i = 0; i < indexCount; i++)
+		indices[i] = mesh.indices[i];
+
+	std::vector<Mesh::DrawRange> ranges = mesh.drawRanges;
+	if (ranges.empty())
+		ranges.push_back(Mesh::DrawRange{ mesh.materialIndex, 0, (uint32_t)indexCount });
+	std::vector<uint32_t> triangleRanges(indexCount / 3, 0);
+	for (size_t range = 0; range < ranges.size(); range++)
+	{
+		const size_t end = std::min((size_t)ranges[range].firstIndex + ranges[range].indexCount, indexCount) / 3;
+		for (size_t triangle = ranges[range].firstIndex / 3; triangle < end; triangle++)
+			triangleRanges[triangle] = (uint32_t)range;
+	}
+
+	const int cacheSize = std::max(meshOptimization.cacheSize, 3);
+	Simplifier simplifier(mesh.vertices, indices.data(), indexCount, lodGeneration.attributeWeight);
+	size_t previousTriangles = indexCount / 3;
+	std::vector<uint32_t> levelIndices;
+	std::vector<uint32_t> levelRanges;
+	std::vector<uint32_t> clusterStarts;
+	for (const LodLevel& level : lodGeneration.levels)
+	{
+		const double ratio = std::min(std::max((double)level.ratio, 0.0), 1.0);
+		const float error = simplifier.Simplify((size_t)(ratio * (indexCount / 3)), level.maxError);
+		if (simplifier.Indices().size() / 3 >= previousTriangles)
+			continue;
+		previousTriangles = simplifier.Indices().size() / 3;
+
+		// Surviving triangles keep their order, so the ranges of the full mesh stay contiguous
+		Mesh::Lod lod;
+		lod.error = error;
+		levelIndices = simplifier.Indices();
+		levelRanges.clear();
+		for (size_t triangle = 0; triangle < levelIndices.size() / 3; triangle++)
+		{
+			const uint32_t range = triangleRanges[simplifier.SourceTriangles()[triangle]];
+			if (levelRanges.empty() || levelRanges.back() != range)
+			{
+				levelRanges.push_back(range);
+				lod.drawRanges.push_back(Mesh::DrawRange{ ranges[range].materialIndex, (uint32_t)(triangle * 3), 0 });
+			}
+			lod.drawRanges.back().indexCount += 3;
+		}
+
+		if (optimizeMeshes)
+		{
+			for (const Mesh::DrawRange& range : lod.drawRanges)
+			{
+				uint32_t* rangeIndices = levelIndices.data() + range.firstIndex;
+				Tipsify(rangeIndices, range.indexCount, mesh.vertices.size(), cacheSize, clusterStarts);
+				if (meshOptimization.overdrawThreshold > 0.0f)
+					SortForOverdraw(rangeIndices, range.indexCount, mesh.vertices, clusterStarts, cacheSize, meshOptimization.overdrawThreshold);
+			}
+		}
+
+		lod.indices.reserve(levelIndices.size());
+		for (uint32_t index : levelIndices)
+			lod.indices.push_back(index);
+		if (mesh.drawRanges.empty())
+			lod.drawRanges.clear();
+		mesh.lods.push_back(std::move(lod));
+	}
+
+	if (activeStats)
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		activeStats->lodCount += mesh.lods.size();
+		for (const Mesh::Lod& lod : mesh.lods)
+			activeStats->lodTriangles += lod.indices.size() / 3;
+	}
+}
+
+void FbxLoader::Parser::BuildMeshlets(std::vector<Mesh>& batch)
+{
+	if (!generateMeshlets)
+		return;
+
+	PhaseScope phase(*this, LoadStats::Meshlets);
+	if (workerCount == 1)
+	{
+		for (Mesh& mesh : batch)
+			BuildMeshlets(mesh);
+	}
+	else
+	{
+		GetWorkerPool().Run(batch.size(), [&](size_t meshIndex) { BuildMeshlets(batch[meshIndex]); });
+	}
+}
+
+void FbxLoader::Parser::BuildMeshlets(Mesh& mesh) const
+{
+	mesh.meshlets.clear();
+	mesh.meshletVertices.clear();
+	mesh.meshletTriangles.clear();
+	const size_t indexCount = mesh.indices.size() / 3 * 3;
+	if (indexCount == 0 || mesh.vertices.empty())
+		return;
+
+	const size_t maxVertices = (size_t)std::min(std::max(meshletGeneration.maxVertices, 3), 256);
+	const size_t maxTriangles = (size_t)std::min(std::max(meshletGeneration.maxTriangles, 1), 512);
+	const size_t triangleCount = indexCount / 3;
+	std::vector<uint32_t> indices(indexCount);
+	for (size_t i = 0; i < indexCount; i++)
+		indices[i] = mesh.indices[i];
+
+	Adjacency adjacency;
+	BuildAdjacency(indices.data(), indexCount, mesh.vertices.size(), adjacency);
+
+	// Centroid and unit normal of every triangle
+	std::vector<double> triangleData(triangleCount * 6);
+	for (size_t triangle = 0; triangle < triangleCount; triangle++)
+	{
+		double corners[3][3];
+		for (int corner = 0; corner < 3; corner++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+				corners[corner][axis] = mesh.vertices[indices[triangle * 3 + corner]].position[axis];
+		}
+		double* data = &triangleData[triangle * 6];
+		for (int axis = 0; axis < 3; axis++)
+			data[axis] = (corners[0][axis] + corners[1][axis] + corners[2][axis]) / 3.0;
+		TriangleNormal(corners[0], corners[1], corners[2], data + 3);
+		const double length = std::sqrt(data[3] * data[3] + data[4] * data[4] + data[5] * data[5]);
+		for (int axis = 3; axis < 6; axis++)
+			data[axis] = length > 0.0 ? data[axis] / length : 0.0;
+	}
+
+	std::vector<Mesh::DrawRange> ranges = mesh.drawRanges;
+	if (ranges.empty())
+		ranges.push_back(Mesh::DrawRange{ mesh.materialIndex, 0, (uint32_t)indexCount });
+
+	std::vector<uint32_t> liveTriangles(mesh.vertices.size());
+	for (size_t vertex = 0; vertex < mesh.vertices.size(); vertex++)
+		liveTriangles[vertex] = adjacency.offsets[vertex + 1] - adjacency.offsets[vertex];
+	std::vector<uint32_t> localVertex(mesh.vertices.size(), noVertex);
+	std::vector<char> used(triangleCount, 0);
+	std::vector<uint32_t> queued(triangleCount, noVertex); // Meshlet the triangle was last made a candidate for
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> vertices;
+	std::vector<uint32_t> triangles;
+	for (const Mesh::DrawRange& range : ranges)
+	{
+		const size_t first = range.firstIndex / 3;
+		const size_t end = std::min((size_t)range.firstIndex + range.indexCount, indexCount) / 3;
+		size_t cursor = first;
+		double center[3] = {};
+		double normal[3] = {};
+
+		auto finishMeshlet = [&]()
+		{
+			Mesh::Meshlet meshlet = {};
+			meshlet.vertexOffset = (uint32_t)mesh.meshletVertices.size();
+			meshlet.triangleOffset = (uint32_t)mesh.meshletTriangles.size();
+			meshlet.vertexCount = (uint32_t)vertices.size();
+			meshlet.triangleCount = (uint32_t)triangles.size();
+			meshlet.materialIndex = range.materialIndex;
+
+			mesh.meshletVertices.insert(mesh.meshletVertices.end(), vertices.begin(), vertices.end());
+			for (uint32_t triangle : triangles)
+			{
+				for (int corner = 0; corner < 3; corner++)
+					mesh.meshletTriangles.push_back((uint8_t)localVertex[indices[triangle * 3 + corner]]);
+			}
+			while (mesh.meshletTriangles.size() % 4 != 0)
+				mesh.meshletTriangles.push_back(0);
+
+			ComputeMeshletBounds(mesh.vertices, &mesh.meshletVertices[meshlet.vertexOffset], &mesh.meshletTriangles[meshlet.triangleOffset], meshlet);
+			mesh.meshlets.push_back(meshlet);
+
+			for (uint32_t vertex : vertices)
+				localVertex[vertex] = noVertex;
+			vertices.clear();
+			triangles.clear();
+		};
+
+		for (;;)
+		{
+			// Cheapest candidate next to the meshlet: fewest new vertices, then closest to its center, then facing its way.
+			// Triangles that are the last one left at a vertex go first, so no stray fragments are left behind for later
+			// meshlets. An empty meshlet starts next to the last one.
+			uint32_t best = noVertex;
+			size_t bestExtra = 4;
+			double bestScore = DBL_MAX;
+			size_t kept = 0;
+			for (uint32_t triangle : candidates)
+			{
+				if (used[triangle])
+					continue;
+				candidates[kept++] = triangle;
+
+				size_t extra = 0;
+				bool last = false;
+				for (int corner = 0; corner < 3; corner++)
+				{
+					extra += localVertex[indices[triangle * 3 + corner]] == noVertex;
+					last |= liveTriangles[indices[triangle * 3 + corner]] == 1;
+				}
+				if (vertices.size() + extra > maxVertices)
+					continue;
+				if (last)
+					extra = 0;
+				if (extra > bestExtra)
+					continue;
+
+				const double* data = &triangleData[triangle * 6];
+				const double offset[3] = { data[0] - center[0], data[1] - center[1], data[2] - center[2] };
+				double score = std::sqrt(offset[0] * offset[0] + offset[1] * offset[1] + offset[2] * offset[2]);
+				const double normalLength = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+				if (normalLength > 0.0)
+					score *= 1.0 + meshletGeneration.coneWeight * (1.0 - (data[3] * normal[0] + data[4] * normal[1] + data[5] * normal[2]) / normalLength);
+
+				if (extra < bestExtra || score < bestScore)
+				{
+					best = triangle;
+					bestExtra = extra;
+					bestScore = score;
+				}
+			}
+			candidates.resize(kept);
+
+			if (best == noVertex)
+			{
+				if (!triangles.empty())
+				{
+					finishMeshlet();
+					continue;
+				}
+
+				while (cursor < end && used[cursor])
+					cursor++;
+				if (cursor == end)
+					break;
+				best = (uint32_t)cursor;
+			}
+
+			if (triangles.empty())
+			{
+				// Seeded, the candidates around the previous meshlet are done with
+				candidates.clear();
+				for (int axis = 0; axis < 3; axis++)
+					center[axis] = normal[axis] = 0.0;
+			}
+
+			used[best] = 1;
+			triangles.push_back(best);
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const uint32_t vertex = indices[best * 3 + corner];
+				liveTriangles[vertex]--;
+				if (localVertex[vertex] != noVertex)
+					continue;
+				localVertex[vertex] = (uint32_t)vertices.size();
+				vertices.push_back(vertex);
+
+				for (uint32_t i = adjacency.offsets[vertex]; i < adjacency.offsets[vertex + 1]; i++)
+				{
+					const uint32_t triangle = adjacency.triangles[i];
+					if (!used[triangle] && triangle >= first && triangle < end && queued[triangle] != mesh.meshlets.size())
+					{
+						queued[triangle] = (uint32_t)mesh.meshlets.size();
+						candidates.push_back(triangle);
+					}
+				}
+			}
+
+			const double* data = &triangleData[best * 6];
+			const double weight = 1.0 / (double)triangles.size();
+			for (int axis = 0; axis < 3; axis++)
+			{
+				center[axis] += (data[axis] - center[axis]) * weight;
+				normal[axis] += data[3 + axis];
+			}
+
+			if (triangles.size() == maxTriangles)
+				finishMeshlet();
+		}
+	}
+
+	if (activeStats)
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		activeStats->meshletCount += mesh.meshlets.size();
+	}
+}
@@ -0,0 +1,390 @@
+// Batch converter: bakes every FBX file of a directory or manifest into loader cache files.
+// Build together with FbxLoader.cpp, FbxBinary.cpp and FbxCache.cpp.
+//
+// Usage: FbxBatch <input directory | manifest.txt> <output directory> [options]
+//   --workers N        Conversion threads, each with its own long lived FbxManager (default: hardware threads)
+//   --native           Use LoadSceneNative instead of the SDK importer
+//   --format NAME      Vertex format: full, compact, quantized or streams (default: full)
+//   --compress         Store animations as compressed tracks
+//   --report FILE      Per file CSV report (default: <output directory>/report.csv)
+#include "../FbxLoader.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	struct Options
+	{
+		fs::path input;
+		fs::path output;
+		fs::path report;
+		int workers = 0;
+		bool native = false;
+		bool compress = false;
+		FbxLoader::VertexFormat format = FbxLoader::VertexFormat::Full;
+	};
+
+	struct Job
+	{
+		fs::path source;
+		fs::path relative;		// Output path below the output directory, without extension
+		uintmax_t size = 0;
+		uint64_t hash = 0;
+		int duplicateOf = -1;	// Job converting the same content, its result is copied
+
+		bool succeeded = false;
+		double seconds = 0.0;
+		std::string error;
+	};
+
+	void PrintUsage()
+	{
+		printf("usage: FbxBatch <input directory | manifest.txt> <output directory> [--workers N] [--native] [--format full|compact|quantized|streams] [--compress] [--report FILE]\n");
+	}
+
+	bool ParseOptions(int argc, char** argv, Options& options)
+	{
+		if (argc < 3)
+			return false;
+
+		options.input = argv[1];
+		options.output = argv[2];
+		options.report = options.output / "report.csv";
+		for (int i = 3; i < argc; i++)
+		{
+			const bool hasValue = i + 1 < argc;
+			if (strcmp(argv[i], "--workers") == 0 && hasValue)
+			{
+				options.workers = atoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--native") == 0)
+			{
+				options.native = true;
+			}
+			else if (strcmp(argv[i], "--compress") == 0)
+			{
+				options.compress = true;
+			}
+			else if (strcmp(argv[i], "--report") == 0 && hasValue)
+			{
+				options.report = argv[++i];
+			}
+			else if (strcmp(argv[i], "--format") == 0 && hasValue)
+			{
+				const char* format = argv[++i];
+				if (strcmp(format, "full") == 0)
+					options.format = FbxLoader::VertexFormat::Full;
+				else if (strcmp(format, "compact") == 0)
+					options.format = FbxLoader::VertexFormat::Compact;
+				else if (strcmp(format, "quantized") == 0)
+					options.format = FbxLoader::VertexFormat::Quantized;
+				else if (strcmp(format, "streams") == 0)
+					options.format = FbxLoader::VertexFormat::Streams;
+				else
+					return false;
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		if (options.workers <= 0)
+			options.workers = std::max(1, (int)std::thread::hardware_concurrency());
+		return true;
+	}
+
+	bool IsFbx(const fs::path& path)
+	{
+		std::string extension = path.extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)tolower(c); });
+		return extension == ".fbx";
+	}
+
+	// A directory is searched recursively, anything else is read as a manifest with one path per line
+	bool GatherJobs(const fs::path& input, std::vector<Job>& jobs)
+	{
+		std::error_code error;
+		if (fs::is_directory(input, error))
+		{
+			for (const fs::directory_entry& entry : fs::recursive_directory_iterator(input, error))
+			{
+				if (entry.is_regular_file(error) && IsFbx(entry.path()))
+				{
+					Job job;
+					job.source = entry.path();
+					job.relative = fs::relative(entry.path(), input, error).replace_extension();
+					jobs.push_back(job);
+				}
+			}
+			return !error;
+		}
+
+		std::ifstream manifest(input);
+		if (!manifest)
+			return false;
+
+		std::string line;
+		while (std::getline(manifest, line))
+		{
+			while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+				line.pop_back();
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			Job job;
+			job.source = line;
+			jobs.push_back(job);
+		}
+
+		// Outputs mirror the sources below the deepest directory they all share, so entries like "../x.fbx" can't
+		// leave the output directory and "a/x.fbx" and "/a/x.fbx" only meet when they are the same file
+		std::vector<fs::path> absolutes;
+		fs::path root;
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			std::error_code error;
+			absolutes.push_back(fs::absolute(jobs[i].source, error).lexically_normal());
+			const fs::path directory = absolutes.back().parent_path();
+			if (i == 0)
+			{
+				root = directory;
+				continue;
+			}
+
+			fs::path common;
+			for (auto a = root.begin(), b = directory.begin(); a != root.end() && b != directory.end() && *a == *b; ++a, ++b)
+				common /= *a;
+			root = common;
+		}
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			// Without a shared root (sources on several drives) the path below each drive is used
+			fs::path relative = root.empty() ? absolutes[i].relative_path() : absolutes[i].lexically_relative(root);
+			jobs[i].relative = relative.replace_extension();
+		}
+		return true;
+	}
+
+	// Hashes only pick the candidates, files are duplicates when their bytes match
+	bool SameContent(const fs::path& a, const fs::path& b)
+	{
+		std::ifstream first(a, std::ios::binary);
+		std::ifstream second(b, std::ios::binary);
+		if (!first || !second)
+			return false;
+
+		std::vector<char> firstBuffer(1 << 20), secondBuffer(1 << 20);
+		while (first && second)
+		{
+			first.read(firstBuffer.data(), firstBuffer.size());
+			second.read(secondBuffer.data(), secondBuffer.size());
+			if (first.gcount() != second.gcount() || memcmp(firstBuffer.data(), secondBuffer.data(), (size_t)first.gcount()) != 0)
+				return false;
+		}
+		return first.eof() && second.eof();
+	}
+
+	bool Convert(const Options& options, FbxManager* manager, Job& job, const fs::path& target)
+	{
+		FbxLoader::Parser parser(job.source.string().c_str(), manager);
+		parser.SetSourceHash(job.hash);
+		parser.vertexFormat = options.format;
+		parser.compressAnimations = options.compress;
+
+		const bool loaded = options.native ? parser.LoadSceneNative() : parser.LoadScene();
+		if (!loaded)
+		{
+			job.error = "load failed";
+			return false;
+		}
+
+		std::error_code error;
+		fs::create_directories(target.parent_path(), error);
+		if (!parser.SaveCache(target.string().c_str()))
+		{
+			job.error = "cache write failed";
+			return false;
+		}
+		return true;
+	}
+
+	void WriteReport(const fs::path& path, const std::vector<Job>& jobs)
+	{
+		FILE* file = fopen(path.string().c_str(), "w");
+		if (!file)
+		{
+			printf("error: unable to write report %s\n", path.string().c_str());
+			return;
+		}
+
+		fprintf(file, "source,bytes,hash,status,seconds,duplicate_of,error\n");
+		for (const Job& job : jobs)
+		{
+			fprintf(file, "\"%s\",%llu,%016llx,%s,%.3f,\"%s\",\"%s\"\n", job.source.string().c_str(), (unsigned long long)job.size,
+				(unsigned long long)job.hash, job.succeeded ? "ok" : "failed", job.seconds,
+				job.duplicateOf >= 0 ? jobs[job.duplicateOf].source.string().c_str() : "", job.error.c_str());
+		}
+		fclose(file);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	std::vector<Job> jobs;
+	if (!GatherJobs(options.input, jobs))
+	{
+		printf("error: unable to read %s\n", options.input.string().c_str());
+		return 1;
+	}
+
+	// Two inputs that map to the same cache file would overwrite each other, the later one fails instead. Compared
+	// case insensitively, since the output may live on a case insensitive file system.
+	std::unordered_map<std::string, int> outputs;
+	for (int index = 0; index < (int)jobs.size(); index++)
+	{
+		std::string key = jobs[index].relative.generic_string();
+		std::transform(key.begin(), key.end(), key.begin(), [](char c) { return (char)tolower(c); });
+		auto output = outputs.emplace(key, index);
+		if (!output.second)
+		{
+			jobs[index].error = "same output as " + jobs[output.first->second].source.string();
+			printf("error: %s and %s map to the same output, skipping the second\n", jobs[output.first->second].source.string().c_str(),
+				jobs[index].source.string().c_str());
+		}
+	}
+
+	const auto batchStart = std::chrono::steady_clock::now();
+
+	// Hash every input so identical files are only converted once
+	FbxLoader::WorkerPool pool(options.workers);
+	pool.Run(jobs.size(), [&](size_t index)
+	{
+		if (!jobs[index].error.empty())
+			return;
+		std::error_code error;
+		jobs[index].size = fs::file_size(jobs[index].source, error);
+		jobs[index].hash = FbxLoader::HashFile(jobs[index].source.string().c_str());
+	});
+
+	std::unordered_map<uint64_t, std::vector<int>> convertedByHash;
+	std::vector<int> order;
+	for (int index = 0; index < (int)jobs.size(); index++)
+	{
+		Job& job = jobs[index];
+		if (!job.error.empty())
+			continue;
+		if (job.hash == 0)
+		{
+			job.error = "unreadable";
+			continue;
+		}
+
+		std::vector<int>& candidates = convertedByHash[job.hash];
+		for (int candidate : candidates)
+		{
+			if (jobs[candidate].size == job.size && SameContent(jobs[candidate].source, job.source))
+			{
+				job.duplicateOf = candidate;
+				break;
+			}
+		}
+		if (job.duplicateOf < 0)
+		{
+			candidates.push_back(index);
+			order.push_back(index);
+		}
+	}
+
+	// Largest files first, so the long conversions don't end up alone at the tail of the batch
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].size > jobs[b].size; });
+
+	std::atomic<size_t> nextJob(0);
+	std::atomic<size_t> doneCount(0);
+	std::vector<std::thread> workers;
+	for (int worker = 0; worker < options.workers; worker++)
+	{
+		workers.emplace_back([&]()
+		{
+			// One manager per worker for the whole batch, parsers only create and destroy their scenes in it
+			FbxManager* manager = options.native ? nullptr : FbxManager::Create();
+
+			for (size_t next = nextJob++; next < order.size(); next = nextJob++)
+			{
+				Job& job = jobs[order[next]];
+				const fs::path target = options.output / (job.relative.string() + ".fbxcache");
+
+				const auto start = std::chrono::steady_clock::now();
+				try
+				{
+					job.succeeded = Convert(options, manager, job, target);
+				}
+				catch (const std::exception& exception)
+				{
+					job.error = exception.what();
+				}
+				job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				const size_t done = ++doneCount;
+				printf("[%zu/%zu] %s %s (%.2fs)\n", done, order.size(), job.succeeded ? "ok" : "FAILED", job.source.string().c_str(), job.seconds);
+			}
+
+			if (manager)
+				manager->Destroy();
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+
+	// Duplicates get a copy of the converted file instead of a conversion of their own
+	int failed = 0;
+	int duplicates = 0;
+	for (Job& job : jobs)
+	{
+		if (job.duplicateOf >= 0)
+		{
+			duplicates++;
+			const Job& original = jobs[job.duplicateOf];
+			if (original.succeeded)
+			{
+				std::error_code error;
+				const fs::path target = options.output / (job.relative.string() + ".fbxcache");
+				fs::create_directories(target.parent_path(), error);
+				fs::copy_file(options.output / (original.relative.string() + ".fbxcache"), target, fs::copy_options::overwrite_existing, error);
+				job.succeeded = !error;
+				job.error = error ? error.message() : "";
+			}
+			else
+			{
+				job.error = "duplicate of a failed file";
+			}
+		}
+		if (!job.succeeded)
+			failed++;
+	}
+
+	WriteReport(options.report, jobs);
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+	printf("%zu files, %zu converted, %d duplicates, %d failed in %.2fs\n", jobs.size(), order.size(), duplicates, failed, seconds);
+	return failed == 0 ? 0 : 2;
+}
@@ -0,0 +1,1069 @@
+// Load benchmark: generates a deterministic synthetic scene through the SDK exporter and reports the LoadStats phase times of LoadScene.
+// Build together with FbxLoader.cpp, FbxBinary.cpp and FbxCache.cpp.
+//
+// Usage: FbxBench [options]
+//   --meshes N         Meshes in the generated scene (default: 4)
+//   --triangles N      Triangles per mesh, written as quads so triangulation has work to do (default: 20000)
+//   --uvs N            UV sets per mesh (default: 1)
+//   --colors           Add a vertex color layer
+//   --materials N      Materials per mesh, assigned per polygon (default: 2)
+//   --bones N          Joints in the skeleton (default: 32)
+//   --nulls            Put an armature Null above the root joint and group Nulls between joints, as Blender and rigging tools export
+//   --influences N     Skin influences per control point, 0 for no skin (default: 4)
+//   --frames N         Animation length in frames, 0 for no animation (default: 120)
+//   --seed N           Generator seed (default: 1)
+//   --scene FILE       Generated scene path, or an existing file to benchmark with --no-generate (default: FbxBench.fbx)
+//   --no-generate      Benchmark --scene as is
+//   --iterations N     Timed loads (default: 5)
+//   --workers N        Parser::workerCount (default: 1)
+//   --format NAME      Vertex format: full, compact, quantized or streams (default: full)
+//   --native           Also time LoadSceneNative
+//   --optimize         Set Parser::optimizeMeshes and report the ACMR/ATVR it achieves
+//   --lods             Set Parser::generateLods and report the triangles of all levels
+//   --meshlets         Set Parser::generateMeshlets and report the meshlet count
+//   --sink             Drop meshes through Parser::meshSink as they are finished instead of keeping them
+//   --verify-cache     Save a cache of the scene, load it back and check it reproduces the meshes, skeleton and animations
+//   --compare-native   Load the scene with LoadScene and LoadSceneNative and check they produce the same meshes, skeleton and animations
+//   --weld N           Only time vertex welding of N generated triangle corners, the original hash_vert map against VertexWelder
+//   --csv FILE         Write stage timings as CSV, for comparing runs
+#include "../FbxLoader.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+	struct Options
+	{
+		int meshes = 4;
+		int triangles = 20000;
+		int uvs = 1;
+		bool colors = false;
+		int materials = 2;
+		int bones = 32;
+		int influences = 4;
+		int frames = 120;
+		uint32_t seed = 1;
+		std::string scene = "FbxBench.fbx";
+		bool generate = true;
+		int iterations = 5;
+		int workers = 1;
+		bool native = false;
+		bool sink = false;
+		bool optimize = false;
+		bool lods = false;
+		bool meshlets = false;
+		bool verifyCache = false;
+		bool compareNative = false;
+		bool nulls = false;
+		int weldCorners = 0;
+		std::string csv;
+		FbxLoader::VertexFormat format = FbxLoader::VertexFormat::Full;
+	};
+
+	// Rows of the report, the load phases followed by the totals
+	const int RowLoadScene = FbxLoader::LoadStats::PhaseCount;
+	const int RowLoadSceneNative = RowLoadScene + 1;
+	const int RowCount = RowLoadSceneNative + 1;
+
+	const char* RowName(int row)
+	{
+		if (row == RowLoadScene)
+			return "LoadScene total";
+		if (row == RowLoadSceneNative)
+			return "LoadSceneNative total";
+		return FbxLoader::LoadStats::PhaseName((FbxLoader::LoadStats::Phase)row);
+	}
+
+	typedef std::chrono::steady_clock Clock;
+
+	double Milliseconds(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	// xorshift32, the generated scene only depends on the options and the seed
+	struct Random
+	{
+		uint32_t state;
+
+		explicit Random(uint32_t seed) : state(seed ? seed : 1) {}
+
+		uint32_t Next()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+
+		double Uniform() { return (Next() >> 8) * (1.0 / 16777216.0); }
+	};
+
+	void PrintUsage()
+	{
+		printf("usage: FbxBench [--meshes N] [--triangles N] [--uvs N] [--colors] [--materials N] [--bones N] [--nulls] [--influences N] [--frames N] [--seed N]\n"
+			"                [--scene FILE] [--no-generate] [--iterations N] [--workers N] [--format full|compact|quantized|streams] [--native] [--optimize] [--lods] [--meshlets] [--sink] [--verify-cache] [--compare-native] [--weld N] [--csv FILE]\n");
+	}
+
+	bool ParseOptions(int argc, char** argv, Options& options)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const char* arg = argv[i];
+			const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+			int* count = nullptr;
+
+			if (strcmp(arg, "--meshes") == 0) count = &options.meshes;
+			else if (strcmp(arg, "--triangles") == 0) count = &options.triangles;
+			else if (strcmp(arg, "--uvs") == 0) count = &options.uvs;
+			else if (strcmp(arg, "--materials") == 0) count = &options.materials;
+			else if (strcmp(arg, "--bones") == 0) count = &options.bones;
+			else if (strcmp(arg, "--influences") == 0) count = &options.influences;
+			else if (strcmp(arg, "--frames") == 0) count = &options.frames;
+			else if (strcmp(arg, "--iterations") == 0) count = &options.iterations;
+			else if (strcmp(arg, "--workers") == 0) count = &options.workers;
+			else if (strcmp(arg, "--weld") == 0) count = &options.weldCorners;
+
+			if (count)
+			{
+				if (!value)
+					return false;
+				*count = atoi(value);
+				i++;
+			}
+			else if (strcmp(arg, "--colors") == 0)
+			{
+				options.colors = true;
+			}
+			else if (strcmp(arg, "--no-generate") == 0)
+			{
+				options.generate = false;
+			}
+			else if (strcmp(arg, "--native") == 0)
+			{
+				options.native = true;
+			}
+			else if (strcmp(arg, "--sink") == 0)
+			{
+				options.sink = true;
+			}
+			else if (strcmp(arg, "--optimize") == 0)
+			{
+				options.optimize = true;
+			}
+			else if (strcmp(arg, "--lods") == 0)
+			{
+				options.lods = true;
+			}
+			else if (strcmp(arg, "--meshlets") == 0)
+			{
+				options.meshlets = true;
+			}
+			else if (strcmp(arg, "--verify-cache") == 0)
+			{
+				options.verifyCache = true;
+			}
+			else if (strcmp(arg, "--compare-native") == 0)
+			{
+				options.compareNative = true;
+			}
+			else if (strcmp(arg, "--nulls") == 0)
+			{
+				options.nulls = true;
+			}
+			else if (strcmp(arg, "--seed") == 0 && value)
+			{
+				options.seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+			}
+			else if (strcmp(arg, "--scene") == 0 && value)
+			{
+				options.scene = argv[++i];
+			}
+			else if (strcmp(arg, "--csv") == 0 && value)
+			{
+				options.csv = argv[++i];
+			}
+			else if (strcmp(arg, "--format") == 0 && value)
+			{
+				const char* format = argv[++i];
+				if (strcmp(format, "full") == 0)
+					options.format = FbxLoader::VertexFormat::Full;
+				else if (strcmp(format, "compact") == 0)
+					options.format = FbxLoader::VertexFormat::Compact;
+				else if (strcmp(format, "quantized") == 0)
+					options.format = FbxLoader::VertexFormat::Quantized;
+				else if (strcmp(format, "streams") == 0)
+					options.format = FbxLoader::VertexFormat::Streams;
+				else
+					return false;
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		options.meshes = std::max(options.meshes, 1);
+		options.triangles = std::max(options.triangles, 2);
+		options.uvs = std::max(options.uvs, 0);
+		options.materials = std::max(options.materials, 1);
+		options.bones = std::max(options.bones, 1);
+		options.influences = std::min(std::max(options.influences, 0), options.bones);
+		options.frames = std::max(options.frames, 0);
+		options.iterations = std::max(options.iterations, 1);
+		return true;
+	}
+
+	// Transform only node with a Null attribute, the loaders must skip it and keep the joints below it attached to the joint above
+	FbxNode* CreateNull(FbxScene* scene, const char* name, const FbxDouble3& translation, FbxNode* parent)
+	{
+		FbxNode* node = FbxNode::Create(scene, name);
+		node->SetNodeAttribute(FbxNull::Create(scene, name));
+		node->LclTranslation.Set(translation);
+		node->LclRotation.Set(FbxDouble3(0.0, 0.0, 15.0));
+		parent->AddChild(node);
+		return node;
+	}
+
+	// Binary tree of joints, joint i hangs below joint (i - 1) / 2. With --nulls the root hangs below an armature Null and
+	// every fourth joint below a group Null of its parent.
+	void GenerateSkeleton(const Options& options, FbxScene* scene, std::vector<FbxNode*>& bones)
+	{
+		FbxNode* root = scene->GetRootNode();
+		if (options.nulls)
+			root = CreateNull(scene, "Armature", FbxDouble3(0.0, 2.0, 0.0), root);
+
+		for (int i = 0; i < options.bones; i++)
+		{
+			FbxString name = FbxString("Bone") + std::to_string(i).c_str();
+			FbxSkeleton* attribute = FbxSkeleton::Create(scene, name);
+			attribute->SetSkeletonType(i == 0 ? FbxSkeleton::eRoot : FbxSkeleton::eLimbNode);
+
+			FbxNode* node = FbxNode::Create(scene, name);
+			node->SetNodeAttribute(attribute);
+			node->LclTranslation.Set(i == 0 ? FbxDouble3(0, 0, 0) : FbxDouble3((i & 1) ? 5.0 : -5.0, 10.0, 0.0));
+
+			if (i == 0)
+				root->AddChild(node);
+			else if (options.nulls && i % 4 == 3)
+				CreateNull(scene, (FbxString("Group") + std::to_string(i).c_str()).Buffer(), FbxDouble3(0.0, 1.0, 0.0), bones[(i - 1) / 2])->AddChild(node);
+			else
+				bones[(i - 1) / 2]->AddChild(node);
+			bones.push_back(node);
+		}
+	}
+
+	// Grid of quads in the XY plane, every attribute layer the loader reads is filled in
+	void GenerateMesh(const Options& options, FbxScene* scene, int meshIndex, const std::vector<FbxNode*>& bones,
+		const std::vector<FbxSurfaceMaterial*>& materials, Random& random)
+	{
+		const int quads = (options.triangles + 1) / 2;
+		const int columns = std::max(1, (int)std::ceil(std::sqrt((double)quads)));
+		const int rows = (quads + columns - 1) / columns;
+		const int rowPoints = columns + 1;
+		const int controlPointCount = rowPoints * (rows + 1);
+
+		FbxString name = FbxString("Mesh") + std::to_string(meshIndex).c_str();
+		FbxMesh* mesh = FbxMesh::Create(scene, name);
+		mesh->InitControlPoints(controlPointCount);
+		FbxVector4* controlPoints = mesh->GetControlPoints();
+		for (int y = 0; y <= rows; y++)
+		{
+			for (int x = 0; x <= columns; x++)
+			{
+				const double height = std::sin(x * 0.3) * std::cos(y * 0.2);
+				controlPoints[y * rowPoints + x] = FbxVector4(x + meshIndex * (columns + 2.0), y, height);
+			}
+		}
+
+		FbxGeometryElementNormal* normals = mesh->CreateElementNormal();
+		normals->SetMappingMode(FbxGeometryElement::eByControlPoint);
+		normals->SetReferenceMode(FbxGeometryElement::eDirect);
+		for (int i = 0; i < controlPointCount; i++)
+		{
+			FbxVector4 normal(random.Uniform() * 0.2 - 0.1, random.Uniform() * 0.2 - 0.1, 1.0, 0.0);
+			normal.Normalize();
+			normals->GetDirectArray().Add(normal);
+		}
+
+		// UVs are indexed per polygon vertex like most DCC exports, with a seam every few columns
+		std::vector<FbxGeometryElementUV*> uvSets;
+		for (int set = 0; set < options.uvs; set++)
+		{
+			FbxGeometryElementUV* uvs = mesh->CreateElementUV((FbxString("UVSet") + std::to_string(set).c_str()).Buffer());
+			uvs->SetMappingMode(FbxGeometryElement::eByPolygonVertex);
+			uvs->SetReferenceMode(FbxGeometryElement::eIndexToDirect);
+			for (int i = 0; i < controlPointCount; i++)
+				uvs->GetDirectArray().Add(FbxVector2((i % rowPoints) / (double)columns, (i / rowPoints) / (double)rows * (set + 1)));
+			for (int i = 0; i < controlPointCount; i++)
+				uvs->GetDirectArray().Add(FbxVector2((i % rowPoints) / (double)columns + 0.5, (i / rowPoints) / (double)rows * (set + 1)));
+			uvSets.push_back(uvs);
+		}
+
+		if (options.colors)
+		{
+			FbxGeometryElementVertexColor* colors = mesh->CreateElementVertexColor();
+			colors->SetMappingMode(FbxGeometryElement::eByControlPoint);
+			colors->SetReferenceMode(FbxGeometryElement::eDirect);
+			for (int i = 0; i < controlPointCount; i++)
+				colors->GetDirectArray().Add(FbxColor(random.Uniform(), random.Uniform(), random.Uniform(), 1.0));
+		}
+
+		FbxGeometryElementMaterial* materialElement = mesh->CreateElementMaterial();
+		materialElement->SetMappingMode(FbxGeometryElement::eByPolygon);
+		materialElement->SetReferenceMode(FbxGeometryElement::eIndexToDirect);
+
+		for (int quad = 0; quad < quads; quad++)
+		{
+			const int x = quad % columns;
+			const int y = quad / columns;
+			const int corners[4] = { y * rowPoints + x, y * rowPoints + x + 1, (y + 1) * rowPoints + x + 1, (y + 1) * rowPoints + x };
+			const int uvOffset = (x % 8 == 7) ? controlPointCount : 0;
+
+			mesh->BeginPolygon(quad * options.materials / quads);
+			for (int corner = 0; corner < 4; corner++)
+			{
+				mesh->AddPolygon(corners[corner]);
+				for (FbxGeometryElementUV* uvs : uvSets)
+					uvs->GetIndexArray().Add(corners[corner] + uvOffset);
+			}
+			mesh->EndPolygon();
+		}
+
+		FbxNode* node = FbxNode::Create(scene, name);
+		node->SetNodeAttribute(mesh);
+		for (FbxSurfaceMaterial* material : materials)
+			node->AddMaterial(material);
+		scene->GetRootNode()->AddChild(node);
+
+		if (options.influences == 0)
+			return;
+
+		// Each control point gets distinct joints with random weights, the loader normalizes them
+		FbxSkin* skin = FbxSkin::Create(scene, "");
+		std::vector<FbxCluster*> clusters(bones.size());
+		for (size_t bone = 0; bone < bones.size(); bone++)
+		{
+			clusters[bone] = FbxCluster::Create(scene, "");
+			clusters[bone]->SetLink(bones[bone]);
+			clusters[bone]->SetLinkMode(FbxCluster::eNormalize);
+			clusters[bone]->SetTransformMatrix(node->EvaluateGlobalTransform());
+			clusters[bone]->SetTransformLinkMatrix(bones[bone]->EvaluateGlobalTransform());
+		}
+
+		std::vector<int> joints(options.influences);
+		for (int i = 0; i < controlPointCount; i++)
+		{
+			for (int influence = 0; influence < options.influences; influence++)
+			{
+				int joint = (int)(random.Next() % bones.size());
+				while (std::find(joints.begin(), joints.begin() + influence, joint) != joints.begin() + influence)
+					joint = (joint + 1) % (int)bones.size();
+				joints[influence] = joint;
+				clusters[joint]->AddControlPointIndex(i, 0.1 + random.Uniform());
+			}
+		}
+
+		for (FbxCluster* cluster : clusters)
+		{
+			if (cluster->GetControlPointIndicesCount() > 0)
+				skin->AddCluster(cluster);
+		}
+		mesh->AddDeformer(skin);
+	}
+
+	// One stack with a key per frame on every joint rotation channel
+	void GenerateAnimation(const Options& options, FbxScene* scene, const std::vector<FbxNode*>& bones, Random& random)
+	{
+		FbxAnimStack* stack = FbxAnimStack::Create(scene, "Take 001");
+		FbxAnimLayer* layer = FbxAnimLayer::Create(scene, "Base Layer");
+		stack->AddMember(layer);
+
+		FbxTime start, stop;
+		start.SetFrame(0, FbxTime::eFrames30);
+		stop.SetFrame(options.frames - 1, FbxTime::eFrames30);
+		FbxTimeSpan span(start, stop);
+		stack->SetLocalTimeSpan(span);
+
+		const char* components[3] = { FBXSDK_CURVENODE_COMPONENT_X, FBXSDK_CURVENODE_COMPONENT_Y, FBXSDK_CURVENODE_COMPONENT_Z };
+		for (FbxNode* bone : bones)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const double amplitude = random.Uniform() * 45.0;
+				const double phase = random.Uniform() * 6.28318530718;
+
+				FbxAnimCurve* curve = bone->LclRotation.GetCurve(layer, components[axis], true);
+				curve->KeyModifyBegin();
+				for (int frame = 0; frame < options.frames; frame++)
+				{
+					FbxTime time;
+					time.SetFrame(frame, FbxTime::eFrames30);
+					const int key = curve->KeyAdd(time);
+					curve->KeySet(key, time, (float)(amplitude * std::sin(frame * 0.1 + phase)), FbxAnimCurveDef::eInterpolationLinear);
+				}
+				curve->KeyModifyEnd();
+			}
+		}
+	}
+
+	bool GenerateScene(const Options& options, FbxManager* manager)
+	{
+		FbxScene* scene = FbxScene::Create(manager, "FbxBench");
+		scene->GetGlobalSettings().SetAxisSystem(FbxAxisSystem::eMayaYUp);
+		scene->GetGlobalSettings().SetSystemUnit(FbxSystemUnit::cm);
+		scene->GetGlobalSettings().SetTimeMode(FbxTime::eFrames30);
+
+		Random random(options.seed);
+
+		std::vector<FbxNode*> bones;
+		GenerateSkeleton(options, scene, bones);
+
+		std::vector<FbxSurfaceMaterial*> materials;
+		for (int i = 0; i < options.materials; i++)
+			materials.push_back(FbxSurfacePhong::Create(scene, (FbxString("Material") + std::to_string(i).c_str()).Buffer()));
+
+		for (int i = 0; i < options.meshes; i++)
+			GenerateMesh(options, scene, i, bones, materials, random);
+
+		if (options.frames > 0)
+			GenerateAnimation(options, scene, bones, random);
+
+		FbxExporter* exporter = FbxExporter::Create(manager, "");
+		bool status = exporter->Initialize(options.scene.c_str(), manager->GetIOPluginRegistry()->GetNativeWriterFormat(), manager->GetIOSettings());
+		if (status)
+			status = exporter->Export(scene);
+		else
+			FBXSDK_printf("error: unable to write %s\n", options.scene.c_str());
+
+		exporter->Destroy();
+		scene->Destroy();
+		return status;
+	}
+
+	struct StageTimes
+	{
+		std::vector<double> samples[RowCount];
+	};
+
+	struct LoadResult
+	{
+		size_t vertexCount = 0;
+		size_t indexCount = 0;
+		size_t peakMemory = 0;
+		FbxLoader::LoadStats stats;
+	};
+
+	void Configure(const Options& options, FbxLoader::Parser& parser)
+	{
+		parser.workerCount = options.workers;
+		parser.vertexFormat = options.format;
+		parser.optimizeMeshes = options.optimize;
+		parser.generateLods = options.lods;
+		parser.generateMeshlets = options.meshlets;
+	}
+
+	bool Load(const Options& options, FbxManager* manager, bool native, StageTimes& times, LoadResult& result)
+	{
+		FbxLoader::Parser parser(options.scene.c_str(), manager);
+		Configure(options, parser);
+		parser.collectStats = true;
+
+		result = LoadResult();
+		auto count = [&result](const FbxLoader::Mesh& mesh)
+		{
+			result.vertexCount += std::max(std::max(mesh.vertices.size(), mesh.compactVertices.size()), std::max(mesh.quantizedVertices.size(), mesh.streams.vertexCount));
+			result.indexCount += mesh.indices.size();
+		};
+		if (options.sink)
+			parser.meshSink = [&count](FbxLoader::Mesh&& mesh) { count(mesh); };
+
+		if (!(native ? parser.LoadSceneNative() : parser.LoadScene()))
+			return false;
+
+		for (const FbxLoader::Mesh& mesh : parser.meshes)
+			count(mesh);
+		result.peakMemory = parser.stats.peakMemory;
+		result.stats = parser.stats;
+
+		if (native)
+		{
+			times.samples[RowLoadSceneNative].push_back(parser.stats.totalMilliseconds);
+			return true;
+		}
+
+		for (int phase = 0; phase < FbxLoader::LoadStats::PhaseCount; phase++)
+		{
+			if (phase != FbxLoader::LoadStats::Cache)
+				times.samples[phase].push_back(parser.stats.phaseMilliseconds[phase]);
+		}
+		times.samples[RowLoadScene].push_back(parser.stats.totalMilliseconds);
+		return true;
+	}
+
+	template<class T, class A>
+	bool SameBytes(const std::vector<T, A>& a, const std::vector<T, A>& b)
+	{
+		return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+	}
+
+	bool SameBytes(const FbxLoader::IndexBuffer& a, const FbxLoader::IndexBuffer& b)
+	{
+		return a.Width() == b.Width() && a.ByteSize() == b.ByteSize() && (a.empty() || memcmp(a.data(), b.data(), a.ByteSize()) == 0);
+	}
+
+	template<class T>
+	bool SameBytes(const T& a, const T& b)
+	{
+		return memcmp(&a, &b, sizeof(T)) == 0;
+	}
+
+	// Name of the first field of a mesh that differs, nullptr when every field is bit identical
+	const char* CompareMeshExact(const FbxLoader::Mesh& a, const FbxLoader::Mesh& b)
+	{
+		if (!SameBytes(a.indices, b.indices)) return "indices";
+		if (!SameBytes(a.vertices, b.vertices)) return "vertices";
+		if (!SameBytes(a.extraJoints, b.extraJoints)) return "extraJoints";
+		if (!SameBytes(a.compactVertices, b.compactVertices)) return "compactVertices";
+		if (!SameBytes(a.quantizedVertices, b.quantizedVertices)) return "quantizedVertices";
+		if (!SameBytes(a.jointPalette, b.jointPalette)) return "jointPalette";
+		if (a.streams.vertexCount != b.streams.vertexCount || !SameBytes(a.streams.descriptors, b.streams.descriptors)) return "streams";
+		if (!SameBytes(a.streams.positions, b.streams.positions) || !SameBytes(a.streams.normals, b.streams.normals) ||
+			!SameBytes(a.streams.tangents, b.streams.tangents) || !SameBytes(a.streams.uvs, b.streams.uvs) || !SameBytes(a.streams.colors, b.streams.colors) ||
+			!SameBytes(a.streams.jointIndices, b.streams.jointIndices) || !SameBytes(a.streams.jointWeights, b.streams.jointWeights)) return "streams";
+		if (a.attributes != b.attributes) return "attributes";
+		if (!SameBytes(a.boundsMin, b.boundsMin) || !SameBytes(a.boundsMax, b.boundsMax)) return "bounds";
+		if (!SameBytes(a.meshToWorld, b.meshToWorld)) return "meshToWorld";
+		if (!(a.materialName == b.materialName) || a.materialIndex != b.materialIndex) return "material";
+		if (!SameBytes(a.drawRanges, b.drawRanges)) return "drawRanges";
+		if (a.lods.size() != b.lods.size()) return "lods";
+		for (size_t level = 0; level < a.lods.size(); level++)
+		{
+			if (!SameBytes(a.lods[level].indices, b.lods[level].indices) || !SameBytes(a.lods[level].drawRanges, b.lods[level].drawRanges) ||
+				a.lods[level].error != b.lods[level].error) return "lods";
+		}
+		if (!SameBytes(a.meshlets, b.meshlets) || !SameBytes(a.meshletVertices, b.meshletVertices) || !SameBytes(a.meshletTriangles, b.meshletTriangles)) return "meshlets";
+		return nullptr;
+	}
+
+	// The cache stores raw bytes, so a scene read back from it has to match the loaded one bit for bit
+	bool CompareExact(const FbxLoader::Parser& a, const FbxLoader::Parser& b, std::string& difference)
+	{
+		if (a.scaleFactor != b.scaleFactor || a.materialCount != b.materialCount)
+		{
+			difference = "scale factor or material count";
+			return false;
+		}
+
+		if (a.skeleton.joints.size() != b.skeleton.joints.size() || a.skeleton.jointMap.size() != b.skeleton.jointMap.size())
+		{
+			difference = "joint count";
+			return false;
+		}
+		for (size_t i = 0; i < a.skeleton.joints.size(); i++)
+		{
+			const FbxLoader::Joint& joint = a.skeleton.joints[i];
+			const FbxLoader::Joint& other = b.skeleton.joints[i];
+			if (!(joint.jointName == other.jointName) || joint.parentIndex != other.parentIndex || joint.currentIndex != other.currentIndex ||
+				!SameBytes(joint.localMatrix, other.localMatrix) || !SameBytes(joint.globalMatrix, other.globalMatrix))
+			{
+				difference = "joint " + std::to_string(i);
+				return false;
+			}
+		}
+
+		if (a.meshes.size() != b.meshes.size())
+		{
+			difference = "mesh count";
+			return false;
+		}
+		for (size_t i = 0; i < a.meshes.size(); i++)
+		{
+			if (const char* field = CompareMeshExact(a.meshes[i], b.meshes[i]))
+			{
+				difference = "mesh " + std::to_string(i) + " " + field;
+				return false;
+			}
+		}
+
+		if (a.animations.size() != b.animations.size())
+		{
+			difference = "animation count";
+			return false;
+		}
+		for (size_t i = 0; i < a.animations.size(); i++)
+		{
+			const FbxLoader::Animation& animation = a.animations[i];
+			const FbxLoader::Animation& other = b.animations[i];
+			bool same = animation.name == other.name && animation.length == other.length && animation.frameRate == other.frameRate &&
+				animation.frameCount == other.frameCount && SameBytes(animation.animatedJoints, other.animatedJoints) &&
+				animation.localTransforms.size() == other.localTransforms.size() && animation.globalTransforms.size() == other.globalTransforms.size() &&
+				animation.compressed.jointCount == other.compressed.jointCount && animation.compressed.frameCount == other.compressed.frameCount &&
+				SameBytes(animation.compressed.tracks, other.compressed.tracks) && SameBytes(animation.compressed.keyFrames, other.compressed.keyFrames) &&
+				SameBytes(animation.compressed.data, other.compressed.data);
+			for (size_t joint = 0; same && joint < animation.localTransforms.size(); joint++)
+				same = SameBytes(animation.localTransforms[joint], other.localTransforms[joint]);
+			for (size_t joint = 0; same && joint < animation.globalTransforms.size(); joint++)
+				same = SameBytes(animation.globalTransforms[joint], other.globalTransforms[joint]);
+			if (!same)
+			{
+				difference = "animation " + std::to_string(i);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Load the scene, write its cache, read the cache into a second parser and compare the two
+	bool VerifyCache(const Options& options, FbxManager* manager)
+	{
+		const std::string cachePath = options.scene + ".fbxcache";
+
+		FbxLoader::Parser loaded(options.scene.c_str(), manager);
+		Configure(options, loaded);
+		if (!loaded.LoadScene() || !loaded.SaveCache(cachePath.c_str()))
+		{
+			printf("error: unable to write the cache of %s\n", options.scene.c_str());
+			return false;
+		}
+
+		FbxLoader::Parser cached(options.scene.c_str(), manager);
+		Configure(options, cached);
+		if (!cached.LoadCache(cachePath.c_str()))
+		{
+			printf("cache round trip: FAILED, %s was not accepted\n\n", cachePath.c_str());
+			return false;
+		}
+
+		std::string difference;
+		if (!CompareExact(loaded, cached, difference))
+		{
+			printf("cache round trip: FAILED, %s differs\n\n", difference.c_str());
+			return false;
+		}
+		printf("cache round trip: ok, %zu meshes, %zu joints, %zu animations\n\n", cached.meshes.size(), cached.skeleton.joints.size(), cached.animations.size());
+		return true;
+	}
+
+	// Byte wise hash of the original loader, which welded every vertex whose hash was already in an unordered_map
+	size_t HashVertexBytes(const FbxLoader::Mesh::VertexData& data)
+	{
+		const char* bytes = (const char*)&data;
+		size_t hash = 0;
+		for (size_t i = 0; i < sizeof(data); i++)
+			hash = hash * 31 + bytes[i];
+		return hash;
+	}
+
+	// Welds the corners of a generated grid with the original hash_vert map and with VertexWelder, best of --iterations each
+	void WeldBench(const Options& options)
+	{
+		// Two triangles per grid cell. Control points get their own normal, UV and skin, and cells pick a material at
+		// random so the corners on material borders stay apart the way UV seams do in a real mesh.
+		const int side = std::max(2, (int)sqrt(options.weldCorners / 6.0));
+		Random random(options.seed);
+		std::vector<FbxLoader::Mesh::VertexData> points((size_t)(side + 1) * (side + 1));
+		for (int y = 0; y <= side; y++)
+		{
+			for (int x = 0; x <= side; x++)
+			{
+				FbxLoader::Mesh::VertexData& point = points[(size_t)y * (side + 1) + x];
+				point.position = FbxVector4(x, y, random.Uniform(), 1.0);
+				point.normal = FbxVector4(random.Uniform() * 0.2 - 0.1, random.Uniform() * 0.2 - 0.1, 1.0, 0.0);
+				point.uv = FbxVector2((double)x / side, (double)y / side);
+				point.jointCount = std::min(options.influences, FbxLoader::InlineVertexBones);
+				for (int bone = 0; bone < point.jointCount; bone++)
+				{
+					point.jointIndices[bone] = random.Next() % (uint32_t)std::max(options.bones, 1);
+					point.jointWeights[bone] = 1.0f / point.jointCount;
+				}
+			}
+		}
+
+		std::vector<FbxLoader::Mesh::VertexData> corners;
+		corners.reserve((size_t)side * side * 6);
+		for (int y = 0; y < side; y++)
+		{
+			for (int x = 0; x < side; x++)
+			{
+				const size_t a = (size_t)y * (side + 1) + x, b = a + 1, c = a + side + 2, d = a + side + 1;
+				const int materialIndex = (int)(random.Next() % (uint32_t)std::max(options.materials, 1));
+				for (size_t point : { a, b, c, a, c, d })
+				{
+					corners.push_back(points[point]);
+					corners.back().materialIndex = materialIndex;
+				}
+			}
+		}
+
+		double mapMilliseconds = 0.0, welderMilliseconds = 0.0;
+		size_t mapVertices = 0, welderVertices = 0, probes = 0;
+		for (int iteration = 0; iteration < std::max(options.iterations, 1); iteration++)
+		{
+			{
+				const Clock::time_point start = Clock::now();
+				std::unordered_map<size_t, size_t> hashToRealIndex;
+				std::vector<FbxLoader::Mesh::VertexData> vertices;
+				std::vector<size_t> indices;
+				indices.reserve(corners.size());
+				for (const FbxLoader::Mesh::VertexData& corner : corners)
+				{
+					const size_t hash = HashVertexBytes(corner);
+					if (hashToRealIndex.count(hash) > 0)
+					{
+						indices.push_back(hashToRealIndex[hash]);
+					}
+					else
+					{
+						hashToRealIndex[hash] = vertices.size();
+						indices.push_back(vertices.size());
+						vertices.push_back(corner);
+					}
+				}
+				const double milliseconds = Milliseconds(start);
+				mapMilliseconds = iteration == 0 ? milliseconds : std::min(mapMilliseconds, milliseconds);
+				mapVertices = vertices.size();
+			}
+			{
+				const Clock::time_point start = Clock::now();
+				std::vector<FbxLoader::Mesh::VertexData> vertices;
+				FbxLoader::IndexBuffer indices;
+				indices.reserve(corners.size());
+				FbxLoader::VertexWelder welder(vertices, corners.size());
+				for (const FbxLoader::Mesh::VertexData& corner : corners)
+					indices.push_back((uint32_t)welder.Weld(corner));
+				const double milliseconds = Milliseconds(start);
+				welderMilliseconds = iteration == 0 ? milliseconds : std::min(welderMilliseconds, milliseconds);
+				welderVertices = vertices.size();
+				probes = welder.ProbeCount();
+			}
+		}
+
+		printf("welded %zu corners, %d iterations\n\n", corners.size(), std::max(options.iterations, 1));
+		printf("%-26s %10s %10s\n", "welder", "min ms", "vertices");
+		printf("%-26s %10.2f %10zu\n", "hash_vert + unordered_map", mapMilliseconds, mapVertices);
+		printf("%-26s %10.2f %10zu\n", "VertexWelder", welderMilliseconds, welderVertices);
+		printf("\n%.2fx faster, %.2f probes per corner\n", welderMilliseconds > 0.0 ? mapMilliseconds / welderMilliseconds : 0.0, (double)probes / corners.size());
+		if (mapVertices < welderVertices)
+			printf("hash_vert merged %zu distinct vertices on hash collisions\n", welderVertices - mapVertices);
+		else if (mapVertices > welderVertices)
+			printf("hash_vert kept %zu equal vertices apart, their struct padding differed\n", mapVertices - welderVertices);
+	}
+
+	// A triangle corner flattened to position, normal, binormal, tangent, UV and color followed by the skin as (joint, weight)
+	// pairs. Joints are numbered by the reference skeleton and sorted, so the joint order of either load doesn't matter.
+	const int CornerValues = 19 + FbxLoader::MaxVertexBones * 2;
+	typedef std::array<double, CornerValues * 3> TriangleValues;
+
+	const char* CornerValueName(int value)
+	{
+		const int starts[] = { 3, 6, 9, 13, 15, 19 };
+		const char* names[] = { "position", "normal", "binormal", "tangent", "uv", "color" };
+		for (int i = 0; i < 6; i++)
+		{
+			if (value < starts[i])
+				return names[i];
+		}
+		return "skin";
+	}
+
+	bool NearlyEqual(double a, double b)
+	{
+		return fabs(a - b) <= 1e-4 * std::max(1.0, std::max(fabs(a), fabs(b)));
+	}
+
+	// Triangles of a mesh in a canonical order: each starts at its corner with the smallest position, which keeps the winding,
+	// and the triangles are sorted on their values snapped to a 1e-3 grid so vertex and triangle order don't matter
+	std::vector<TriangleValues> CanonicalTriangles(const FbxLoader::Mesh& mesh, const std::vector<int>& jointRemap)
+	{
+		std::vector<TriangleValues> triangles(mesh.indices.size() / 3);
+		for (size_t triangle = 0; triangle < triangles.size(); triangle++)
+		{
+			double corners[3][CornerValues];
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const uint32_t index = mesh.indices[triangle * 3 + corner];
+				const FbxLoader::Mesh::VertexData& vertex = mesh.vertices[index];
+				const double attributes[19] = {
+					vertex.position[0], vertex.position[1], vertex.position[2],
+					vertex.normal[0], vertex.normal[1], vertex.normal[2],
+					vertex.binormal[0], vertex.binormal[1], vertex.binormal[2],
+					vertex.tangent[0], vertex.tangent[1], vertex.tangent[2], vertex.tangent[3],
+					vertex.uv[0], vertex.uv[1],
+					vertex.color.mRed, vertex.color.mGreen, vertex.color.mBlue, vertex.color.mAlpha
+				};
+				std::copy(attributes, attributes + 19, corners[corner]);
+
+				std::pair<double, double> joints[FbxLoader::MaxVertexBones];
+				for (int bone = 0; bone < FbxLoader::MaxVertexBones; bone++)
+				{
+					const unsigned int joint = bone < vertex.jointCount ? mesh.JointIndex(index, bone) : 0;
+					joints[bone] = bone < vertex.jointCount ?
+						std::make_pair(joint < jointRemap.size() ? (double)jointRemap[joint] : -1.0, (double)mesh.JointWeight(index, bone)) :
+						std::make_pair(-1.0, 0.0);
+				}
+				std::sort(joints, joints + FbxLoader::MaxVertexBones);
+				for (int bone = 0; bone < FbxLoader::MaxVertexBones; bone++)
+				{
+					corners[corner][19 + bone * 2] = joints[bone].first;
+					corners[corner][20 + bone * 2] = joints[bone].second;
+				}
+			}
+
+			int first = 0;
+			for (int corner = 1; corner < 3; corner++)
+			{
+				if (std::lexicographical_compare(corners[corner], corners[corner] + 3, corners[first], corners[first] + 3))
+					first = corner;
+			}
+			for (int corner = 0; corner < 3; corner++)
+				std::copy(corners[(first + corner) % 3], corners[(first + corner) % 3] + CornerValues, triangles[triangle].begin() + corner * CornerValues);
+		}
+
+		std::sort(triangles.begin(), triangles.end(), [](const TriangleValues& a, const TriangleValues& b)
+		{
+			for (size_t i = 0; i < a.size(); i++)
+			{
+				const double snappedA = floor(a[i] * 1000.0 + 0.5), snappedB = floor(b[i] * 1000.0 + 0.5);
+				if (snappedA != snappedB)
+					return snappedA < snappedB;
+			}
+			return false;
+		});
+		return triangles;
+	}
+
+	// The native reader decodes the same file in its own way, so its meshes, skeleton and animations are compared to the SDK import with a
+	// tolerance instead of bit for bit, independent of vertex, triangle and joint order
+	bool CompareNative(const Options& options, FbxManager* manager)
+	{
+		FbxLoader::Parser reference(options.scene.c_str(), manager);
+		FbxLoader::Parser native(options.scene.c_str(), manager);
+		Configure(options, reference);
+		Configure(options, native);
+		reference.vertexFormat = native.vertexFormat = FbxLoader::VertexFormat::Full;
+		if (!reference.LoadScene() || !native.LoadSceneNative())
+		{
+			printf("native comparison: FAILED, %s did not load both ways\n\n", options.scene.c_str());
+			return false;
+		}
+
+		auto fail = [](const std::string& difference)
+		{
+			printf("native comparison: FAILED, %s\n\n", difference.c_str());
+			return false;
+		};
+
+		const std::vector<FbxLoader::Joint>& joints = reference.skeleton.joints;
+		if (native.skeleton.joints.size() != joints.size())
+			return fail("joint count " + std::to_string(native.skeleton.joints.size()) + " instead of " + std::to_string(joints.size()));
+
+		// Native joint index to reference joint index, matched by name
+		std::vector<int> jointRemap(joints.size(), -1);
+		for (size_t i = 0; i < native.skeleton.joints.size(); i++)
+		{
+			const FbxLoader::Joint& joint = native.skeleton.joints[i];
+			auto match = reference.skeleton.jointMap.find(joint.jointName.Buffer());
+			if (match == reference.skeleton.jointMap.end())
+				return fail(std::string("joint ") + joint.jointName.Buffer() + " is not in the SDK skeleton");
+			jointRemap[i] = match->second;
+
+			const FbxLoader::Joint& other = joints[match->second];
+			const int parent = joint.parentIndex >= 0 ? jointRemap[joint.parentIndex] : -1;
+			if (parent != other.parentIndex)
+				return fail(std::string("joint ") + joint.jointName.Buffer() + " parent");
+			for (int row = 0; row < 4; row++)
+			{
+				for (int column = 0; column < 4; column++)
+				{
+					if (!NearlyEqual(joint.localMatrix.Get(row, column), other.localMatrix.Get(row, column)))
+						return fail(std::string("joint ") + joint.jointName.Buffer() + " local matrix");
+				}
+			}
+		}
+
+		if (native.meshes.size() != reference.meshes.size())
+			return fail("mesh count " + std::to_string(native.meshes.size()) + " instead of " + std::to_string(reference.meshes.size()));
+
+		std::vector<int> identity(joints.size());
+		for (size_t i = 0; i < identity.size(); i++)
+			identity[i] = (int)i;
+
+		size_t triangleCount = 0;
+		for (size_t meshIndex = 0; meshIndex < reference.meshes.size(); meshIndex++)
+		{
+			const FbxLoader::Mesh& mesh = reference.meshes[meshIndex];
+			const FbxLoader::Mesh& other = native.meshes[meshIndex];
+			const std::string name = "mesh " + std::to_string(meshIndex) + " (" + mesh.materialName.Buffer() + ")";
+			if (!(mesh.materialName == other.materialName) || mesh.materialIndex != other.materialIndex)
+				return fail(name + " material");
+			if (mesh.attributes != other.attributes)
+				return fail(name + " attributes");
+
+			const std::vector<TriangleValues> triangles = CanonicalTriangles(mesh, identity);
+			const std::vector<TriangleValues> otherTriangles = CanonicalTriangles(other, jointRemap);
+			if (triangles.size() != otherTriangles.size())
+				return fail(name + " triangle count " + std::to_string(otherTriangles.size()) + " instead of " + std::to_string(triangles.size()));
+			for (size_t triangle = 0; triangle < triangles.size(); triangle++)
+			{
+				for (size_t i = 0; i < triangles[triangle].size(); i++)
+				{
+					if (!NearlyEqual(triangles[triangle][i], otherTriangles[triangle][i]))
+						return fail(name + " " + CornerValueName((int)(i % CornerValues)) + " of triangle " + std::to_string(triangle));
+				}
+			}
+			triangleCount += triangles.size();
+		}
+
+		if (native.animations.size() != reference.animations.size())
+			return fail("animation count " + std::to_string(native.animations.size()) + " instead of " + std::to_string(reference.animations.size()));
+
+		auto sameMatrix = [](const FbxAMatrix& a, const FbxAMatrix& b)
+		{
+			for (int row = 0; row < 4; row++)
+			{
+				for (int column = 0; column < 4; column++)
+				{
+					if (!NearlyEqual(a.Get(row, column), b.Get(row, column)))
+						return false;
+				}
+			}
+			return true;
+		};
+
+		size_t frameCount = 0;
+		for (size_t animationIndex = 0; animationIndex < reference.animations.size(); animationIndex++)
+		{
+			const FbxLoader::Animation& animation = reference.animations[animationIndex];
+			const FbxLoader::Animation& other = native.animations[animationIndex];
+			const std::string name = std::string("animation ") + animation.name.Buffer();
+			if (!(animation.name == other.name))
+				return fail(name + " is " + other.name.Buffer() + " natively");
+			if (other.frameCount != animation.frameCount)
+				return fail(name + " frame count " + std::to_string(other.frameCount) + " instead of " + std::to_string(animation.frameCount));
+			if (other.localTransforms.size() != joints.size() || other.globalTransforms.size() != joints.size() ||
+				animation.localTransforms.size() != joints.size() || animation.globalTransforms.size() != joints.size())
+				return fail(name + " joint count");
+
+			for (size_t joint = 0; joint < joints.size(); joint++)
+			{
+				const int match = jointRemap[joint];
+				const std::string jointName = name + " joint " + native.skeleton.joints[joint].jointName.Buffer();
+				for (FbxLongLong frame = 0; frame < animation.frameCount; frame++)
+				{
+					if (!sameMatrix(other.localTransforms[joint][frame], animation.localTransforms[match][frame]))
+						return fail(jointName + " local transform at frame " + std::to_string(frame));
+					if (!sameMatrix(other.globalTransforms[joint][frame], animation.globalTransforms[match][frame]))
+						return fail(jointName + " global transform at frame " + std::to_string(frame));
+				}
+			}
+			frameCount += (size_t)animation.frameCount;
+		}
+
+		printf("native comparison: ok, %zu meshes, %zu triangles, %zu joints, %zu animations, %zu frames\n\n", reference.meshes.size(),
+			triangleCount, joints.size(), reference.animations.size(), frameCount);
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (options.weldCorners > 0)
+	{
+		WeldBench(options);
+		return 0;
+	}
+
+	FbxManager* manager = FbxManager::Create();
+	manager->SetIOSettings(FbxIOSettings::Create(manager, IOSROOT));
+
+	if (options.generate)
+	{
+		const Clock::time_point start = Clock::now();
+		if (!GenerateScene(options, manager))
+		{
+			manager->Destroy();
+			return 1;
+		}
+		printf("generated %s: %d meshes x %d triangles, %d uv sets%s, %d materials, %d bones%s, %d influences, %d frames (%.0f ms)\n",
+			options.scene.c_str(), options.meshes, options.triangles, options.uvs, options.colors ? ", colors" : "", options.materials,
+			options.bones, options.nulls ? " with Nulls" : "", options.influences, options.frames, Milliseconds(start));
+	}
+
+	if ((options.verifyCache && !VerifyCache(options, manager)) || (options.compareNative && !CompareNative(options, manager)))
+	{
+		manager->Destroy();
+		return 1;
+	}
+
+	StageTimes times;
+	LoadResult result;
+	for (int iteration = 0; iteration < options.iterations; iteration++)
+	{
+		if (!Load(options, manager, false, times, result))
+		{
+			printf("error: unable to load %s\n", options.scene.c_str());
+			manager->Destroy();
+			return 1;
+		}
+
+		LoadResult nativeResult;
+		if (options.native)
+			Load(options, manager, true, times, nativeResult);
+	}
+	manager->Destroy();
+
+	printf("%zu vertices, %zu indices, %d iterations, %d workers, peak memory %.1f MB\n\n", result.vertexCount, result.indexCount,
+		options.iterations, options.workers, result.peakMemory / (1024.0 * 1024.0));
+	if (options.optimize)
+	{
+		printf("ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n\n", result.stats.acmrBefore, result.stats.acmrAfter, result.stats.atvrBefore, result.stats.atvrAfter);
+	}
+	if (options.lods)
+	{
+		printf("%zu LOD levels, %zu triangles\n\n", result.stats.lodCount, result.stats.lodTriangles);
+	}
+	if (options.meshlets)
+	{
+		printf("%zu meshlets, %.1f triangles each\n\n", result.stats.meshletCount,
+			result.stats.meshletCount > 0 ? (double)result.indexCount / 3.0 / (double)result.stats.meshletCount : 0.0);
+	}
+	printf("%-26s %10s %10s %10s\n", "stage", "min ms", "median ms", "max ms");
+
+	FILE* csv = options.csv.empty() ? nullptr : fopen(options.csv.c_str(), "w");
+	if (csv)
+		fprintf(csv, "stage,min_ms,median_ms,max_ms\n");
+
+	for (int row = 0; row < RowCount; row++)
+	{
+		std::vector<double>& samples = times.samples[row];
+		if (samples.empty())
+			continue;
+
+		std::sort(samples.begin(), samples.end());
+		const double median = samples[samples.size() / 2];
+		printf("%-26s %10.2f %10.2f %10.2f\n", RowName(row), samples.front(), median, samples.back());
+		if (csv)
+			fprintf(csv, "\"%s\",%.3f,%.3f,%.3f\n", RowName(row), samples.front(), median, samples.back());
+	}
+
+	if (csv)
+		fclose(csv);
+	else if (!options.csv.empty())
+		printf("error: unable to write %s\n", options.csv.c_str());
+	return 0;
+}